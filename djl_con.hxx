@@ -717,6 +717,33 @@ class ConsoleConfiguration
             return EOF;
         } //redirected_getch()
 
+        static int redirected_read( void * buf, size_t len )
+        {
+            // block until at least one byte is available or end of file, then return what's there.
+            // unlike redirected_getch(), no translation is done. returns 0 at end of file.
+
+            assert( !isatty( fileno( stdin ) ) );
+            if ( 0 == len )
+                return 0;
+
+            if ( s_kbhitPeekAvailable )
+            {
+                // portable_kbhit() already consumed this byte; don't block waiting for more
+
+                s_kbhitPeekAvailable = false;
+                * (char *) buf = s_kbhitPeekByte;
+                return 1;
+            }
+
+            int result;
+            do
+            {
+                result = (int) read( 0, buf, (unsigned int) len );
+            } while ( ( result < 0 ) && ( EINTR == errno ) );
+
+            return ( result > 0 ) ? result : 0;
+        } //redirected_read
+
 #ifdef _WIN32
         // behave like getch() on linux -- extended characters have escape sequences
 
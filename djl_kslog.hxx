@@ -1,4 +1,19 @@
-// writes and reads keystrokes to and from a file
+// writes and reads keystrokes to and from a script file
+//
+// A script has one step per line:
+//   text <characters>    type the characters after the space
+//   key <key>            type enter, esc, tab, backspace, space, up, down, left, right, home, end, pgup, pgdn,
+//                        ins, del, f1 - f10, ^a - ^z, or 4 hex digits of scancode then ascii character
+//   cycles <n>           wait until n emulated cycles have passed since the prior step
+//   ticks <n>            the same in 18.2 per second BIOS timer ticks
+//   waitfor <text>       wait until the text is anywhere on the screen
+//   waitat <r>,<c> <text> wait until the text is at 0-based row r and column c
+//   timeout <seconds>    emulated seconds the text waits after this wait before timing out. 0 is forever. default 10
+//   # comment
+// Waits are measured in emulated time, so a script plays back the same way at any host speed. If the app waits
+// for a key, cycle waits complete right away. Text waits only complete when the text is on the screen. If one
+// times out, the script stops and TimedOut() is true.
+// Write mode saves each keystroke with the cycles since the prior one.
 
 #pragma once
 
@@ -6,8 +21,10 @@ class CKeyStrokes
 {
     public:
         enum KeystrokeMode { ksm_None, ksm_Write, ksm_Read };
+        typedef bool ( * ScreenTextFinder )( const char * text, int row, int col ); // row -1 means anywhere
 
-        CKeyStrokes() : ksmode( ksm_None ) {}
+        CKeyStrokes() : next( 0 ), stepStart( 0 ), lastCycles( 0 ), cyclesPerTick( 262144 ), scancodes( 0 ), timedOut( false ),
+                        timedOutStep( 0 ), ksmode( ksm_None ) {}
 
         ~CKeyStrokes()
         {
@@ -15,92 +32,302 @@ class CKeyStrokes
                 Persist();
         } //~CKeyStrokes
 
-        void SetMode( KeystrokeMode ksm )
+        bool SetMode( KeystrokeMode ksm, const char * path, uint64_t cycles_per_tick, const uint8_t * ascii_to_scancode )
         {
             ksmode = ksm;
+            filename = path ? path : "kslog.txt";
+            cyclesPerTick = cycles_per_tick;
+            scancodes = ascii_to_scancode;
             if ( ksm_Read == ksm )
-                Restore();
+                return Restore();
+            return true;
         } //SetMode
 
-        bool KeystrokeAvailable() { return ( ( ksm_Read == ksmode ) && keys.size() ); }
         bool InReadMode() { return ( ksm_Read == ksmode ); }
+        uint64_t CyclesPerTick() { return cyclesPerTick; }
+        bool TimedOut() { return timedOut; }
+        uint32_t TimedOutLine() { return steps[ timedOutStep ].line; }
+        const char * TimedOutText() { return steps[ timedOutStep ].text.c_str(); }
+        bool StepsRemaining() { return ( ( ksm_Read == ksmode ) && ( next < steps.size() ) ); }
+        bool KeystrokeAvailable() { return ( StepsRemaining() && ( ks_Key == steps[ next ].kind ) ); }
+
+        bool Advance( uint64_t cycles, bool blocked, ScreenTextFinder finder )
+        {
+            // move past waits that are complete and return true if the next step is a keystroke.
+            // blocked means the app is waiting for a key, so there's no point waiting for more cycles to pass.
+            // apps may poll for keys while still drawing, so text waits are only complete once the text is found.
+            // finder is 0 where the screen shouldn't be checked, and waitfor steps remain pending.
+
+            lastCycles = cycles;
+            while ( next < steps.size() )
+            {
+                KeyStep & step = steps[ next ];
+                if ( ks_Key == step.kind )
+                    return true;
+
+                if ( ks_Cycles == step.kind )
+                {
+                    if ( !blocked && ( ( cycles - stepStart ) < step.value ) )
+                        return false;
+                }
+                else
+                {
+                    if ( !finder )
+                        return false;
+
+                    if ( !finder( step.text.c_str(), step.row, step.col ) )
+                    {
+                        if ( ( 0 == step.value ) || ( ( cycles - stepStart ) < step.value ) )
+                            return false;
+
+                        tracer.Trace( "script line %u timed out waiting for '%s'. stopping the script\n", step.line, step.text.c_str() );
+                        timedOut = true;
+                        timedOutStep = next;
+                        next = steps.size();
+                        return false;
+                    }
+                }
+
+                tracer.Trace( "script line %u wait is complete at cycle %llu\n", step.line, cycles );
+                next++;
+                stepStart = cycles;
+            }
+
+            return false;
+        } //Advance
 
         uint16_t Peek()
         {
             assert( KeystrokeAvailable() );
-            tracer.Trace( "peeked keystroke %04x\n", keys[ 0 ] );
-            return keys[ 0 ];
+            tracer.Trace( "peeked keystroke %04x\n", (uint16_t) steps[ next ].value );
+            return (uint16_t) steps[ next ].value;
         } //Peek
 
         uint16_t ConsumeNext()
         {
             assert( KeystrokeAvailable() );
-            tracer.Trace( "keystrokes in read buffer available: %zd\n", keys.size() );
+            tracer.Trace( "keystroke script steps remaining: %zd\n", steps.size() - next );
 
-            uint16_t x = keys[ 0 ];
-            keys.erase( keys.begin() ); // expensive, but not very frequent
+            uint16_t x = (uint16_t) steps[ next ].value;
+            next++;
+            stepStart = lastCycles;
             return x;
         } //ConsumeNext
 
-        void Append( uint16_t x )
+        void Append( uint16_t x, uint64_t cycles )
         {
             if ( ksm_Write == ksmode )
             {
                 tracer.Trace( "pushing char %04x onto the keystroke log\n", x );
-                keys.push_back( x );
+                KeyStep step;
+                step.kind = ks_Key;
+                step.value = x;
+                step.cycles = cycles;
+                steps.push_back( step );
             }
         } //Append
 
         bool Persist()
         {
-            // save what's in the vector to kslog.txt
+            // save the keystrokes as a script with the cycles between them
 
-            tracer.Trace( "persisting %zd keystrokes\n", keys.size() );
+            tracer.Trace( "persisting %zd keystrokes\n", steps.size() );
 
-            FILE * fp = fopen( "kslog.txt", "w" );
+            FILE * fp = fopen( filename.c_str(), "w" );
             if ( 0 != fp )
             {
-                for ( size_t i = 0; i < keys.size(); i++ )
-                    fprintf( fp, "%04x", keys[ i ] );
+                uint64_t prior = 0;
+                for ( size_t i = 0; i < steps.size(); i++ )
+                {
+                    if ( steps[ i ].cycles > prior )
+                        fprintf( fp, "cycles %llu\n", (unsigned long long) ( steps[ i ].cycles - prior ) );
+                    fprintf( fp, "key %04x\n", (uint16_t) steps[ i ].value );
+                    prior = steps[ i ].cycles;
+                }
                 fclose( fp );
                 return true;
             }
 
-            tracer.Trace( "error: can't create file kslog.txt\n" );
+            tracer.Trace( "error: can't create keystroke file %s\n", filename.c_str() );
             return false;
         } //Persist
 
         bool Restore()
         {
-            // read what's in kslog.txt to the vector
+            // read the script into steps
 
-            tracer.Trace( "restoring kslog.txt\n" );
-            FILE * fp = fopen( "kslog.txt", "r" );
-            if ( 0 != fp )
+            tracer.Trace( "restoring keystroke script %s\n", filename.c_str() );
+            FILE * fp = fopen( filename.c_str(), "r" );
+            if ( 0 == fp )
+            {
+                tracer.Trace( "error: can't find keystroke file %s to read it\n", filename.c_str() );
+                return false;
+            }
+
+            char line[ 512 ];
+            uint32_t lineNumber = 0;
+            bool ok = true;
+            uint64_t timeout = cyclesPerTick * 182;  // 10 seconds at 18.2 ticks per second
+
+            while ( ok && fgets( line, sizeof( line ), fp ) )
             {
-                long l = portable_filelen( fp );
-                size_t count = l / 4;
-                tracer.Trace( "keystroke file length: %ld, count %zd\n", l, count );
-                for ( size_t i = 0; i < count; i++ )
+                lineNumber++;
+                size_t len = strlen( line );
+                while ( len && ( '\n' == line[ len - 1 ] || '\r' == line[ len - 1 ] ) )
+                    line[ --len ] = 0;
+
+                if ( 0 == len || '#' == line[ 0 ] )
+                    continue;
+
+                char * arg = strchr( line, ' ' );
+                if ( arg )
+                    *arg++ = 0;
+                else
+                    arg = line + len;
+
+                if ( !strcmp( line, "text" ) )
+                {
+                    for ( char * p = arg; *p; p++ )
+                    {
+                        uint8_t c = 0x7f & *p;
+                        AddStep( ks_Key, ( ( scancodes ? scancodes[ c ] : 0 ) << 8 ) | c, lineNumber );
+                    }
+                }
+                else if ( !strcmp( line, "key" ) )
+                {
+                    uint16_t x;
+                    ok = ParseKey( arg, x );
+                    if ( ok )
+                        AddStep( ks_Key, x, lineNumber );
+                }
+                else if ( !strcmp( line, "cycles" ) || !strcmp( line, "ticks" ) )
+                {
+                    ok = ( 0 != isdigit( arg[ 0 ] ) );
+                    uint64_t n = strtoull( arg, 0, 10 );
+                    AddStep( ks_Cycles, ( 't' == line[ 0 ] ) ? n * cyclesPerTick : n, lineNumber );
+                }
+                else if ( !strcmp( line, "waitfor" ) )
+                {
+                    ok = ( 0 != arg[ 0 ] );
+                    AddStep( ks_Text, timeout, lineNumber );
+                    steps.back().text = arg;
+                }
+                else if ( !strcmp( line, "waitat" ) )
                 {
-                    char ac[ 5 ] = {0};
-                    if ( fread( ac, 1, 4, fp ) )
+                    int row, col, used = 0;
+                    ok = ( 2 == sscanf( arg, "%d,%d %n", &row, &col, &used ) ) && ( used > 0 ) && ( row >= 0 ) && ( col >= 0 ) && ( 0 != arg[ used ] );
+                    if ( ok )
                     {
-                        uint16_t x = (uint16_t) strtoull( ac, 0, 16 );
-                        tracer.Trace( "read key %04x\n", x );
-                        keys.push_back( x );
+                        AddStep( ks_Text, timeout, lineNumber );
+                        steps.back().text = arg + used;
+                        steps.back().row = row;
+                        steps.back().col = col;
                     }
                 }
+                else if ( !strcmp( line, "timeout" ) )
+                {
+                    ok = ( 0 != isdigit( arg[ 0 ] ) );
+                    timeout = strtoull( arg, 0, 10 ) * cyclesPerTick * 182 / 10;
+                }
+                else if ( 0 == ( len % 4 ) && len == strspn( line, "0123456789abcdefABCDEF" ) )
+                {
+                    // the original format: 4 hex digits per keystroke with no separators
 
-                fclose( fp );
-                return true;
+                    for ( size_t i = 0; i < len; i += 4 )
+                    {
+                        char ac[ 5 ] = {0};
+                        memcpy( ac, line + i, 4 );
+                        AddStep( ks_Key, strtoul( ac, 0, 16 ), lineNumber );
+                    }
+                }
+                else
+                    ok = false;
+
+                if ( !ok )
+                    tracer.Trace( "error: can't parse line %u of keystroke file %s\n", lineNumber, filename.c_str() );
             }
 
-            tracer.Trace( "error: can't find kslog.txt to read it\n" );
-            return false;
+            fclose( fp );
+            tracer.Trace( "keystroke script has %zd steps\n", steps.size() );
+            return ok;
         } //Restore
 
     private:
-        vector<uint16_t> keys; // high part = scancode, lowpart = ascii char
+        enum KeyStepKind { ks_Key, ks_Cycles, ks_Text };
+
+        struct KeyStep
+        {
+            KeyStepKind kind;
+            uint64_t value;   // keystroke (high part = scancode, low part = ascii char), cycles to wait, or text wait timeout
+            uint64_t cycles;  // write mode: cycle count when the key was typed
+            uint32_t line;    // read mode: script line number
+            string text;      // waitfor and waitat text
+            int row, col;     // waitat position. row is -1 for waitfor
+        };
+
+        void AddStep( KeyStepKind kind, uint64_t value, uint32_t line )
+        {
+            KeyStep step;
+            step.kind = kind;
+            step.value = value;
+            step.cycles = 0;
+            step.line = line;
+            step.row = -1;
+            step.col = -1;
+            steps.push_back( step );
+        } //AddStep
+
+        bool ParseKey( const char * name, uint16_t & x )
+        {
+            static const struct { const char * name; uint16_t key; } keyNames[] =
+            {
+                { "enter", 0x1c0d }, { "esc", 0x011b }, { "tab", 0x0f09 }, { "backspace", 0x0e08 }, { "space", 0x3920 },
+                { "up", 0x4800 }, { "down", 0x5000 }, { "left", 0x4b00 }, { "right", 0x4d00 }, { "home", 0x4700 },
+                { "end", 0x4f00 }, { "pgup", 0x4900 }, { "pgdn", 0x5100 }, { "ins", 0x5200 }, { "del", 0x5300 },
+            };
+
+            for ( size_t i = 0; i < sizeof( keyNames ) / sizeof( keyNames[ 0 ] ); i++ )
+            {
+                if ( !strcmp( name, keyNames[ i ].name ) )
+                {
+                    x = keyNames[ i ].key;
+                    return true;
+                }
+            }
+
+            if ( 'f' == name[ 0 ] && isdigit( name[ 1 ] ) )
+            {
+                int f = atoi( name + 1 );
+                if ( f < 1 || f > 10 )
+                    return false;
+                x = (uint16_t) ( ( 0x3a + f ) << 8 );
+                return true;
+            }
+
+            if ( '^' == name[ 0 ] && isalpha( name[ 1 ] ) && 0 == name[ 2 ] )
+            {
+                uint8_t c = (uint8_t) ( tolower( name[ 1 ] ) - 'a' + 1 );
+                x = (uint16_t) ( ( ( scancodes ? scancodes[ c ] : 0 ) << 8 ) | c );
+                return true;
+            }
+
+            if ( 4 == strlen( name ) && 4 == strspn( name, "0123456789abcdefABCDEF" ) )
+            {
+                x = (uint16_t) strtoul( name, 0, 16 );
+                return true;
+            }
+
+            return false;
+        } //ParseKey
+
+        vector<KeyStep> steps;
+        size_t next;                 // read mode: index of the next step
+        uint64_t stepStart;          // cycle count when the prior step completed
+        uint64_t lastCycles;         // cycle count as of the last call to Advance
+        uint64_t cyclesPerTick;
+        const uint8_t * scancodes;   // ascii_to_scancode for text steps
+        bool timedOut;               // a text wait timed out and the script stopped
+        size_t timedOutStep;         // the step that timed out
+        string filename;
         KeystrokeMode ksmode;
 };
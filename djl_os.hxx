@@ -104,6 +104,7 @@
 
     template < typename T, size_t N > size_t _countof( T ( & arr )[ N ] ) { return std::extent< T[ N ] >::value; }
     #define _stricmp strcasecmp
+    #define _strnicmp strncasecmp
     #define MAX_PATH 1024
 
     extern "C" inline char * strupr( char * s )
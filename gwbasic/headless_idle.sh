@@ -0,0 +1,25 @@
+#!/bin/bash
+# checks that an idle app run with -headless sleeps rather than spinning. run from this folder.
+# usage: headless_idle.sh [path to ntvdm]
+
+ntvdm=${1:-../ntvdm}
+( sleep 7 | $ntvdm -headless GWBASIC.EXE > /dev/null 2>&1 & )
+sleep 2
+pid=$(pgrep -n -f "^$ntvdm -headless GWBASIC.EXE")
+if [ -z "$pid" ]; then
+    echo "ntvdm isn't running"
+    exit 1
+fi
+
+t1=$(cat /proc/$pid/task/*/stat | awk '{t += $14 + $15} END {print t}')
+sleep 4
+t2=$(cat /proc/$pid/task/*/stat | awk '{t += $14 + $15} END {print t}')
+kill $pid
+
+ticks=$((t2 - t1))
+echo "cpu ticks used in 4 seconds of idle headless GW-BASIC: $ticks"
+if [ $ticks -gt 40 ]; then
+    echo "FAIL: idle headless run isn't sleeping"
+    exit 1
+fi
+echo "PASS"
@@ -23,11 +23,47 @@
 #include <djltrace.hxx>
 #include <djl8086d.hxx>
 
+#if !defined( _WIN32 ) && !defined( WATCOM ) && !defined( sparc ) && !defined( __mc68000__ )
+#include <sys/mman.h>
+#endif
+
 using namespace std;
 
 #include "i8086.hxx"
 
-uint8_t memory[ 0x10fff0 ];  // though only 0..fffff is addressable on the 8086
+// Guest RAM is mapped from the OS with inaccessible guard pages on either side so host code that
+// runs off either end of guest memory faults immediately rather than corrupting other state. The
+// anonymous mapping is zero-filled, and fork()ed children share its pages copy-on-write.
+// Platforms without mmap use a static array. Either way memory is an array reference so sizeof()
+// and indexing work as before.
+
+static uint8_t * allocate_guest_memory()
+{
+#if defined( _WIN32 )
+    SYSTEM_INFO si;
+    GetSystemInfo( &si );
+    size_t page = si.dwPageSize;
+    size_t size = round_up( (size_t) GuestMemorySize, page );
+    uint8_t * p = (uint8_t *) VirtualAlloc( 0, size + 2 * GuestMemoryGuardSize, MEM_RESERVE, PAGE_NOACCESS );
+    if ( p && VirtualAlloc( p + GuestMemoryGuardSize, size, MEM_COMMIT, PAGE_READWRITE ) )
+        return p + GuestMemoryGuardSize;
+#elif !defined( WATCOM ) && !defined( sparc ) && !defined( __mc68000__ )
+    size_t page = (size_t) sysconf( _SC_PAGESIZE );
+    size_t size = round_up( (size_t) GuestMemorySize, page );
+    void * p = mmap( 0, size + 2 * GuestMemoryGuardSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( MAP_FAILED != p )
+    {
+        uint8_t * pmem = (uint8_t *) p + GuestMemoryGuardSize;
+        if ( 0 == mprotect( pmem, size, PROT_READ | PROT_WRITE ) )
+            return pmem;
+    }
+#endif
+
+    static uint8_t fallback_memory[ GuestMemorySize ];
+    return fallback_memory;
+} //allocate_guest_memory
+
+uint8_t ( & memory )[ GuestMemorySize ] = * (uint8_t ( * )[ GuestMemorySize ]) allocate_guest_memory(); // though only 0..fffff is addressable on the 8086
 
 i8086 cpu;
 static CDisassemble8086 g_Disassembler;
@@ -3,7 +3,10 @@
 #include <bitset>
 using namespace std;
 
-extern uint8_t memory[ 0x10fff0 ];
+const uint32_t GuestMemorySize = 0x10fff0;       // ffff:ffff is the highest 8086 address
+const uint32_t GuestMemoryGuardSize = 64 * 1024; // inaccessible bytes before and after guest memory when it's mapped from the OS
+
+extern uint8_t ( & memory )[ GuestMemorySize ];
 
 // tracking cycles slows execution by >6%
 #define I8086_TRACK_CYCLES
@@ -104,6 +107,8 @@ struct i8086
 
     uint64_t emulate( uint64_t maxcycles );             // execute up to about maxcycles
     void exit_emulate_early( void );                    // tell the emulator not to wait for maxcycles to return
+    uint64_t get_cycles() { return cycles; }            // cycles executed so far during the current call to emulate()
+    void add_cycles( uint64_t amount ) { cycles += amount; } // account for time that passed without executing instructions
     bool external_interrupt( uint8_t interrupt_num );   // invoke this simulated hardware/external interrupt immediately
     void trace_instructions( bool trace );              // enable/disable tracing each instruction
     void trace_state( void );                           // trace the registers
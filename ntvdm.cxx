@@ -54,9 +54,11 @@
 //     0x00400 -- 0x0057f   bios data
 //     0x00580 -- 0x005ff   "list of lists" is 0x5b0 and extends in both directions
 //     0x00600 -- 0x00bff   assembly code for interrupt helper routines that can't be accomplished in C
-//     0x00c00 -- 0x00fff   interrupt routine stubs (here, not in BIOS space because it fits)
+//     0x00c00 -- 0x00eff   interrupt routine stubs (here, not in BIOS space because it fits)
+//     0x00f00 -- 0x00f1f   EMS driver header and int 67h stub if -ems is used
+//     0x00f20 -- 0x00f2f   XMS driver entry point if -xms is used
 //     0x01000 -- 0xb7fff   apps are loaded here. On real hardware you can only go to 0x9ffff.
-//     0xb8000 -- 0xeffff   reserved for hardware (CGA in particular)
+//     0xb8000 -- 0xeffff   reserved for hardware (CGA in particular). 0xe0000 - 0xeffff is the EMS page frame with -ems
 //     0xf0000 -- 0xfbfff   system monitor (0 for now)
 //     0xfc000 -- 0xfffff   bios code and hard-coded bios data (mostly 0 for now)
 
@@ -82,10 +84,37 @@
 #endif
 #include <time.h>
 #include <string>
+#include <dirent.h>
+#endif
+
+#if !defined( _WIN32 ) && !defined( WATCOM ) && !defined( sparc ) && !defined( __mc68000__ )
+#define USE_FORK true
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#define USE_MMAP true
+#include <atomic>
+#define USE_RENDER_THREAD true
+#if defined( __linux__ )
+#define USE_EVENTFD true
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#else
+#define USE_EVENTFD false
+#endif
+#else
+#define USE_FORK false
+#define USE_MMAP false
+#define USE_RENDER_THREAD false
+#define USE_EVENTFD false
 #endif
 
 #include <assert.h>
 #include <vector>
+#include <unordered_map>
 
 #include <djltrace.hxx>
 #include <djl_con.hxx>
@@ -148,6 +177,12 @@ uint16_t AllocateEnvironment( uint16_t segStartingEnv, const char * pathToExecut
 uint16_t LoadBinary( const char * app, const char * acAppArgs, uint8_t lenAppArgs, uint16_t segment, bool setupRegs,
                      le16_t * reg_ss, le16_t * reg_sp, le16_t * reg_cs, le16_t * reg_ip, bool bootSectorLoad );
 uint16_t LoadOverlay( const char * app, uint16_t segLoadAddress, uint16_t segmentRelocationFactor );
+void RunForkServer();
+void ReportForkServerExit( int code );
+void PublishDisplaySnapshot();
+void MarkVideoPagesDirty();
+void RecordTerminalOutput( const char * p, size_t len );
+bool ScriptKeystrokeAvailable( bool blocked = false );
 
 uint16_t GetSegment( uint8_t * p )
 {
@@ -171,6 +206,17 @@ struct FileEntry
     }
 };
 
+struct FCBFileEntry : FileEntry
+{
+    char dosName[ 11 ];     // name and extension from the FCB used to open the file. checked on each FCB call
+    uint32_t hostOffset;    // where fp is positioned, so sequential I/O doesn't need to seek
+    uint8_t lastOp;         // FCBOpRead or FCBOpWrite. C requires a seek when switching between the two
+    uint32_t fileSize;      // file length including writes made through the FCB
+    uint32_t bufOffset;     // file offset of the first byte in the read-ahead buffer
+    uint32_t bufLength;     // count of valid bytes in the read-ahead buffer
+    vector<uint8_t> buf;    // read-ahead buffer for record-at-a-time reads
+};
+
 struct AppExecuteMode3
 {
     le16_t segLoadAddress;
@@ -224,7 +270,7 @@ struct ExeHeader
     le16_t reloc_table_offset;
     le16_t overlay_number;
 
-    void Trace()
+    void Trace() const
     {
         tracer.Trace( "  exe header:\n" );
         tracer.Trace( "    signature:            %04x = %u\n", (uint16_t) signature, (uint16_t) signature );
@@ -250,13 +296,6 @@ struct ExeRelocation
     le16_t segment;
 };
 
-struct DosAllocation
-{
-    uint16_t segment;          // segment handed out to the app, 1 past the MCB
-    uint16_t para_length;      // length in paragraphs including MCB.
-    uint16_t seg_process;      // the process PSP that allocated the memory or 0 prior to the app running
-};
-
 struct IntCalled
 {
     uint8_t i;      // interrupt #
@@ -283,6 +322,12 @@ const uint16_t OffsetSystemFileTable = 0xf0;
 
 CDJLTrace tracer;
 
+// There is one DOS machine per process: cpu, memory[], and the globals below are its state, and so are the
+// host's current directory (DOS's current directory) and stdin/stdout/stderr (DOS handles 0-2). Since
+// machines can't share a current directory or standard handles, running many jobs is done with processes
+// rather than threads -- -server fork()s a loaded machine per job and the children share its pages
+// copy-on-write, and -jobs fork()s a fresh machine per manifest entry.
+
 static uint16_t g_segHardware = ScreenBufferSegment; // first byte beyond where apps have available memory
 static uint16_t blankLine[ScreenColumns] = {0};      // an optimization for filling lines with blanks
 #ifdef _WIN32                                        // only locked by the Windows-only code paths below;
@@ -292,9 +337,11 @@ static ConsoleConfiguration g_consoleConfig;         // to get into and out of 8
 static bool g_haltExecution = false;                 // true when the app is shutting down
 static uint16_t g_diskTransferSegment = 0;           // segment of current disk transfer area
 static uint16_t g_diskTransferOffset = 0;            // offset of current disk transfer area
-static vector<FileEntry> g_fileEntries;              // vector of currently open files
-static vector<FileEntry> g_fileEntriesFCB;           // vector of currently open files with FCBs
-static vector<DosAllocation> g_allocEntries;         // vector of blocks allocated to DOS apps
+static vector<FileEntry> g_fileEntries;              // currently open files indexed by DOS handle. free slots have fp == 0
+static vector<FCBFileEntry> g_fileEntriesFCB;        // currently open FCB files indexed by the slot stored in the FCB. free slots have fp == 0
+static unordered_map<uint16_t, vector<uint16_t>> g_processFileHandles; // PSP segment => DOS handles opened by that process
+static uint16_t g_segFirstMCB = 0;                   // segment of the first memory control block or 0 before the first allocation
+static uint8_t g_allocStrategy = 0;                  // int 21h 58h: 0 first fit, 1 best fit, 2 last fit
 static uint16_t g_currentPSP = 0;                    // psp of the currently running process
 static uint16_t g_mainPSP = 0;                       // psp of the main app
 static bool g_use80xRowsMode = false;                // true to force 80 x 25/43/50 with cursor positioning
@@ -307,7 +354,6 @@ static int g_appTerminationReturnCode = 0;           // when int 21 function 4c
 static char g_acRoot[ MAX_PATH ];                    // host folder ending in slash/backslash that maps to DOS "C:\"
 static char g_acApp[ MAX_PATH ];                     // the DOS .com or .exe being run
 static char g_thisApp[ MAX_PATH ];                   // name of this exe (argv[0]), likely NTVDM
-static char g_lastLoadedApp[ MAX_PATH ] = {0};       // path of most recenly loaded program (though it may have terminated)
 static bool g_PackedFileCorruptWorkaround = false;   // if true, allocate memory starting at 64k, not AppSegment
 static uint16_t g_int21_3f_seg = 0;                  // segment where this code resides with ip = 0
 static uint16_t g_int21_a_seg = 0;                   // "
@@ -318,13 +364,32 @@ static char cwd[ MAX_PATH ] = {0};                   // used as a temporary in s
 static vector<IntCalled> g_InterruptsCalled;         // track interrupt usage
 static high_resolution_clock::time_point g_tAppStart; // system time at app start
 static uint8_t g_bufferLastUpdate[ 80 * 50 * 2 ] = {0}; // used to check for changes in video memory. At most we support 80 by 50
-static CKeyStrokes g_keyStrokes;                     // read or write keystrokes between kslog.txt and the app
+static int g_terminalAttribute = -1;                 // attribute the terminal's colors match, or -1 if unknown
+static uint32_t g_redrawGeneration = 0;              // incremented when the whole display must be redrawn
+static bool g_renderThreadActive = false;            // true if a render thread draws published display snapshots
+static uint32_t g_framesPerSecond = 30;              // most often the render thread draws the display
+static CKeyStrokes g_keyStrokes;                     // read a keystroke script or write one of the keys typed
+static uint64_t g_cyclesBeforeEmulate = 0;           // emulated cycles before the current call to cpu.emulate()
 static bool g_UseOneThread = false;                  // true if no keyboard thread should be used
 static bool g_InEmulator = false;                    // true if running in another emulator: RVOS, ARMOS, X64OS, etc.
 static uint64_t g_msAtStart = 0;                     // milliseconds since epoch at app start
 static bool g_SendControlCInt = false;               // set to true when/if a ^C is detected and an interrupt should be sent
 static uint16_t g_builtInHandles[ 5 ] = { 0, 1, 2, 3, 4 }; // stdin, stdout, stderr, stdaux, stdprn are all mapped to self initially
 static bool g_IsIntelC45App = false;                 // true for apps generated by the Intel C compiler
+static bool g_consoleOutputPending = false;          // true if tty output is sitting in the stdout buffer
+static CDuration g_consoleOutputDuration;            // limits how long tty output can sit in the stdout buffer
+static bool g_batchIO = false;                       // true if stdin and stdout are both redirected. no console emulation
+static const char * g_pcSaveSnapshot = 0;            // -save: snapshot file to write when the app first waits for input
+static bool g_headless = false;                      // -headless: never draw the display or set up the console for it
+static FILE * g_recordFile = 0;                      // -record: asciicast v2 recording of terminal output
+static FILE * g_framesFile = 0;                      // -frames: log of pixels changed in CGA graphics modes
+static uint8_t g_cgaColorSelect = 0x30;              // CGA color select register, port 0x3d9
+static bool g_textMode80xRows = false;               // g_use80xRowsMode to restore when leaving a graphics mode
+static const char * g_pcForkServer = 0;              // -server: UNIX socket path where fork server jobs are accepted
+static int g_forkServerFunction = -1;                // -server: fork at the first int 21h with this ah. -1 for the app's first instruction
+static int g_forkServerConnection = -1;              // in a fork server job, the connection the exit code is reported on
+static uint64_t g_cycleBudget = 0;                   // -jobs: stop the job after this many 8086 cycles. 0 for no limit
+const int JobCyclesExitCode = 152;                   // -jobs: exit code of a job stopped by its cycle budget. 128 + SIGXCPU, as shells report
 
 // Set to true to fill dos memory allocations with patterns to detect apps that use memory they previously freed.
 
@@ -334,8 +399,8 @@ static bool g_validateState = false;
 const uint16_t DOS_HANDLE_INVALID = (uint16_t) -1;
 
 #ifndef _WIN32
-static bool g_forcePathsUpper = false;               // helpful for Linux
-static bool g_forcePathsLower = false;               // helpful for Linux
+static bool g_forcePathsUpper = false;               // create new files and folders with uppercase names
+static bool g_forcePathsLower = false;               // create new files and folders with lowercase names
 static bool g_altPressedRecently = false;            // hack because I can't figure out if ALT is currently pressed
 #endif
 
@@ -489,6 +554,183 @@ void remove_double_backslash( char * p )
     } while( true );
 } //remove_double_backslash
 
+#ifndef _WIN32
+
+// DOS paths are case-insensitive and Linux paths aren't. This maps each component of a host path to the name that
+// actually exists on disk regardless of case. Folder listings are cached (uppercase name -> host name), so after the
+// first touch of a folder a lookup is a hash probe. A folder is only re-read when a lookup misses and the folder's
+// modification time has changed, which covers files created by the app or by other processes.
+// Components that don't exist yet (e.g. a file about to be created) get the case selected with -u or -l, if any.
+
+class CCaseFoldingResolver
+{
+    private:
+        struct FolderNames
+        {
+            uint64_t mtime;
+            unordered_map<string, string> names;
+        };
+
+        unordered_map<string, FolderNames> folders;   // key is the absolute host folder path ending in '/'
+
+        static uint64_t FolderTime( const char * folder )
+        {
+            struct stat statbuf;
+            if ( 0 != stat( folder, & statbuf ) )
+                return 0;
+#ifdef __APPLE__
+            return ( (uint64_t) statbuf.st_mtimespec.tv_sec * 1000000000 ) + statbuf.st_mtimespec.tv_nsec;
+#elif defined( __mc68000__ ) // this newlib target's struct stat lacks the nanosecond-precision st_mtim substruct
+            return (uint64_t) statbuf.st_mtime;
+#else
+            return ( (uint64_t) statbuf.st_mtim.tv_sec * 1000000000 ) + statbuf.st_mtim.tv_nsec;
+#endif
+        } //FolderTime
+
+        static void Upper( string & s )
+        {
+            for ( size_t i = 0; i < s.length(); i++ )
+                s[ i ] = (char) toupper( (uint8_t) s[ i ] );
+        } //Upper
+
+        static bool LoadFolder( const string & folder, FolderNames & fn )
+        {
+            fn.names.clear();
+            fn.mtime = FolderTime( folder.c_str() );
+
+            DIR * pdir = opendir( folder.c_str() );
+            if ( !pdir )
+                return false;
+
+            struct dirent * pent;
+            while ( 0 != ( pent = readdir( pdir ) ) )
+            {
+                string name( pent->d_name );
+                string key( name );
+                Upper( key );
+
+                // if two host files differ only by case, prefer the one that's already uppercase like DOS
+
+                auto it = fn.names.find( key );
+                if ( it == fn.names.end() )
+                    fn.names[ key ] = name;
+                else if ( name == key )
+                    it->second = name;
+            }
+
+            closedir( pdir );
+            tracer.Trace( "  case resolver cached %zu names for folder '%s'\n", fn.names.size(), folder.c_str() );
+            return true;
+        } //LoadFolder
+
+        const string * Lookup( const string & folder, const string & component )
+        {
+            string key( component );
+            Upper( key );
+
+            auto itf = folders.find( folder );
+            if ( itf == folders.end() )
+            {
+                FolderNames fn;
+                if ( !LoadFolder( folder, fn ) )
+                    return 0;
+                itf = folders.emplace( folder, std::move( fn ) ).first;
+            }
+            else
+            {
+                auto itn = itf->second.names.find( key );
+                if ( itn != itf->second.names.end() )
+                    return & itn->second;
+
+                if ( FolderTime( folder.c_str() ) == itf->second.mtime )
+                    return 0;
+
+                LoadFolder( folder, itf->second );
+            }
+
+            auto itn = itf->second.names.find( key );
+            if ( itn != itf->second.names.end() )
+                return & itn->second;
+
+            return 0;
+        } //Lookup
+
+    public:
+        void Resolve( char * path )
+        {
+            // rewrite path in place. the length never changes since only the case of characters changes
+
+            if ( 0 == *path )
+                return;
+
+            string folder;
+            size_t start = 0;
+            size_t len_root = strlen( g_acRoot );
+
+            if ( '/' == path[ 0 ] )
+            {
+                if ( !strncmp( path, g_acRoot, len_root ) )
+                {
+                    folder = g_acRoot;
+                    start = len_root;
+                }
+                else
+                {
+                    folder = "/";
+                    start = 1;
+                }
+            }
+            else
+            {
+                char acCurDir[ MAX_PATH ];
+                if ( !getcwd( acCurDir, sizeof( acCurDir ) ) )
+                    return;
+                folder = acCurDir;
+                if ( '/' != folder.back() )
+                    folder += '/';
+            }
+
+            bool exists = true;
+
+            while ( 0 != path[ start ] )
+            {
+                char * pcomp = path + start;
+                char * pslash = strchr( pcomp, '/' );
+                size_t len = pslash ? ( pslash - pcomp ) : strlen( pcomp );
+                string component( pcomp, len );
+
+                if ( 0 != len && "." != component && ".." != component && !strpbrk( component.c_str(), "*?" ) )
+                {
+                    const string * pname = exists ? Lookup( folder, component ) : 0;
+                    if ( pname )
+                        memcpy( pcomp, pname->c_str(), len );
+                    else
+                    {
+                        exists = false;
+                        if ( g_forcePathsUpper )
+                            for ( size_t i = 0; i < len; i++ )
+                                pcomp[ i ] = (char) toupper( (uint8_t) pcomp[ i ] );
+                        else if ( g_forcePathsLower )
+                            for ( size_t i = 0; i < len; i++ )
+                                pcomp[ i ] = (char) tolower( (uint8_t) pcomp[ i ] );
+                    }
+
+                    component.assign( pcomp, len );
+                }
+
+                folder += component;
+                folder += '/';
+                start += len;
+                if ( '/' == path[ start ] )
+                    start++;
+            }
+        } //Resolve
+};
+
+static CCaseFoldingResolver g_caseResolver;         // maps DOS paths to existing host files regardless of case
+
+#endif
+
 const char * DOSToHostPath( const char * p )
 {
     tracer.Trace( "  original dos path: '%s'\n", p );
@@ -532,14 +774,6 @@ const char * DOSToHostPath( const char * p )
 #ifndef _WIN32
     backslash_to_slash( host_path );
     cr_to_zero( host_path );
-
-    char * start = host_path;
-    if ( '/' == host_path[0] )
-        start += strlen( g_acRoot );
-    if ( g_forcePathsLower )
-        strlwr( start );
-    else if ( g_forcePathsUpper )
-        strupr( start );
 #endif
 
     tracer.Trace( "  translated dos path '%s' to host path '%s'\n", p, host_path );
@@ -567,6 +801,11 @@ const char * DOSToHostPath( const char * p )
         }
     }
 
+#ifndef _WIN32
+    g_caseResolver.Resolve( host_path );
+    tracer.Trace( "  case-resolved host path '%s'\n", host_path );
+#endif
+
     return host_path;
 } //DOSToHostPath
 
@@ -574,6 +813,10 @@ const char * DOSToHostPath( const char * p )
 static HANDLE g_hConsoleOutput = 0;                // the Windows console output handle
 static HANDLE g_hConsoleInput = 0;                 // the Windows console input handle
 static HANDLE g_heventKeyStroke;
+#elif USE_EVENTFD
+static int g_keystrokeEventFd = -1;                // like g_heventKeyStroke: wakes the main thread when a keystroke arrives
+static int g_keyboardRearmFd = -1;                 // the main thread has scheduled int 9 for the last keystroke signaled
+static int g_keyboardStopFd = -1;                  // the keyboard thread should exit
 #endif
 
 uint8_t * GetDiskTransferAddress() { return cpu.flat_address8( g_diskTransferSegment, g_diskTransferOffset ); }
@@ -612,15 +855,39 @@ static void usage( char const * perr )
     printf( "  -b               load/run program as the boot sector at 07c0:0000\n" );
     printf( "  -c               tty mode. don't automatically make text area 80x25.\n" );
     printf( "  -C               make text area 80x25 (not tty mode). also -C:43 -C:50\n" );
+#if USE_FORK
+    printf( "  -connect:socket  run PROGRAM as a job of the -server listening on socket\n" );
+#endif
     printf( "  -d               don't clear the display on exit\n" );
     printf( "  -e:env,...       define environment variables.\n" );
+    printf( "  -ems[:MB]        provide LIM EMS 4.0 expanded memory. default 4MB, max 32MB\n" );
     printf( "  -f               fill memory blocks with patterns to find app bugs\n" );
+    printf( "  -frames:file     log pixels changed in CGA graphics modes to file\n" );
+    printf( "  -fps:N           most frames per second drawn in 80x25 mode or logged. default 30\n" );
     printf( "  -h               load high above 64k and below 0xa0000.\n" );
+    printf( "  -headless[:file] don't draw the display. at exit write the screen to file\n" );
+    printf( "                     -headless:file,ansi writes it with colors and the cursor\n" );
+    printf( "                     in CGA graphics modes the file is a PPM image\n" );
     printf( "  -i               trace instructions to %s.log.\n", g_thisApp );
     printf( "  -j               app debugging: validate CPU state periodically\n" );
+#if USE_FORK
+    printf( "  -jobs:manifest   run the manifest's jobs in parallel and summarize results\n" );
+    printf( "                     -jobs:manifest,N runs at most N at once. default: # of cores\n" );
+#endif
+    printf( "  -kr[:file]       type keystrokes from a script. default kslog.txt\n" );
+    printf( "  -kw[:file]       write the keystrokes typed to a script. default kslog.txt\n" );
+    printf( "  -load:file       resume the app from a snapshot written by -save\n" );
     printf( "  -m               after the app ends, print video memory\n" );
     printf( "  -p               show performance stats on exit.\n" );
     printf( "  -r:root          root folder that maps to C:\\\n" );
+#if USE_RENDER_THREAD
+    printf( "  -record:file     record terminal output to file in asciicast v2 format\n" );
+#endif
+    printf( "  -save:file       write a snapshot to file when the app first waits for input\n" );
+#if USE_FORK
+    printf( "  -server:socket   run -connect jobs, each in a fork of the loaded app\n" );
+    printf( "                     -server:socket,XX forks at the first int 21h with ah XX\n" );
+#endif
     printf( "  -t               enable debug tracing to %s.log\n", g_thisApp );
 #ifdef I8086_TRACK_CYCLES
     printf( "  -s:X             set processor speed in Hz.\n" );
@@ -628,14 +895,12 @@ static void usage( char const * perr )
     printf( "                     for 4.77 MHz 8088 use -s:4500000.\n" );
 #endif
 #ifndef _WIN32
-    printf( "  -u               force DOS paths to be uppercase\n" );
-    printf( "  -l               force DOS paths to be lowercase\n" );
+    printf( "  -u               create new files and folders with uppercase names\n" );
+    printf( "  -l               create new files and folders with lowercase names\n" );
+    printf( "                     existing host files are found regardless of case\n" );
 #endif
-/* work in progress
-    printf( "            -kr    read keystrokes from kslog.txt\n" );
-    printf( "            -kw    write keywtrokes to kslog.txt\n" );
-*/
     printf( "  -v               output version information and exit.\n" );
+    printf( "  -xms[:MB]        provide XMS 3.0 extended memory. default 16MB, max 63MB\n" );
     printf( "  -?               output this help and exit.\n" );
     printf( "\n" );
     printf( "Examples:\n" );
@@ -655,6 +920,11 @@ static void usage( char const * perr )
     exit( 1 );
 } //usage
 
+uint64_t EmulatedCycles()
+{
+    return g_cyclesBeforeEmulate + cpu.get_cycles();
+} //EmulatedCycles
+
 class CKbdBuffer
 {
     private:
@@ -679,7 +949,7 @@ class CKbdBuffer
             if ( userGenerated )
             {
                 uint16_t stroke = ( ( (uint16_t) scancode ) << 8 ) | asciiChar;
-                g_keyStrokes.Append( stroke );
+                g_keyStrokes.Append( stroke, EmulatedCycles() );
             }
 
             if ( IsFull() )
@@ -767,6 +1037,7 @@ void SetActiveDisplayPage( uint8_t page )
 {
     assert( page <= 3 );
     * cpu.flat_address8( 0x40, 0x62 ) = page;
+    MarkVideoPagesDirty(); // the new page may have been written while it wasn't displayed
 } //SetActiveDisplayPage
 
 uint8_t GetVideoMode()
@@ -777,6 +1048,7 @@ uint8_t GetVideoMode()
 void SetVideoMode( uint8_t mode )
 {
     * cpu.flat_address8( 0x40, 0x49 ) = mode;
+    MarkVideoPagesDirty();
 } //SetVideoMode
 
 uint8_t GetVideoModeOptions()
@@ -813,6 +1085,7 @@ void SetScreenRows( uint8_t rows )
 {
     tracer.Trace( "  setting screen rows to %u\n", rows );
     * cpu.flat_address8( 0x40, 0x84 ) = rows - 1;
+    MarkVideoPagesDirty();
 } //SetScreenRows
 
 void TraceBiosInfo()
@@ -831,24 +1104,179 @@ uint8_t * GetVideoMem( uint8_t displayPage )
     return cpu.flat_address8( ScreenBufferSegment, 0x1000 * displayPage );
 } //GetVideoMem
 
+// In 80x25 mode the display is refreshed from the active text page. Rather than compare the page with the last
+// update each time the app polls the keyboard, the text pages are write-protected after a refresh. The first write
+// to a page, whether by the app or by int 10h code here, faults and marks the page dirty. Clean pages need no compare.
+// Where guest memory isn't mmap'd every page is always considered dirty.
+
+const uint32_t VideoTrackedPages = 4;                // 4k text pages at b800:0000
+const uint32_t VideoPageBytes = 0x1000;
+static int g_videoTracking = 0;                      // 0 not yet tried, 1 tracking writes, -1 not possible
+static volatile uint32_t g_videoDirty = 0xf;         // bit n is set if text page n may have changed since the last refresh
+static volatile uint32_t g_videoScriptDirty = 0xf;   // the same since the last -kr waitfor check of the screen
+
+#if USE_MMAP
+
+static size_t g_videoProtectUnit = 0;                // host page size; a multiple of VideoPageBytes
+
+static void VideoWriteFault( int sig, siginfo_t * info, void * context )
+{
+    uint8_t * pvideo = memory + ScreenBufferSegment * 16;
+    uint8_t * p = (uint8_t *) info->si_addr;
+    if ( p < pvideo || p >= ( pvideo + VideoTrackedPages * VideoPageBytes ) )
+    {
+        // not a video write. let the fault happen again without this handler so the process crashes as usual
+
+        signal( sig, SIG_DFL );
+        return;
+    }
+
+    size_t unit = ( p - pvideo ) / g_videoProtectUnit;
+    mprotect( pvideo + unit * g_videoProtectUnit, g_videoProtectUnit, PROT_READ | PROT_WRITE );
+    uint32_t pages = (uint32_t) ( g_videoProtectUnit / VideoPageBytes );
+    uint32_t mask = ( ( 1u << pages ) - 1 ) << ( unit * pages );
+    g_videoDirty |= mask;
+    g_videoScriptDirty |= mask;
+} //VideoWriteFault
+
+static void EnableVideoWriteTracking()
+{
+    g_videoTracking = -1;
+    size_t pageSize = (size_t) sysconf( _SC_PAGESIZE );
+    uint8_t * pvideo = memory + ScreenBufferSegment * 16;
+    if ( ( 0 == pageSize ) || ( 0 != ( ( VideoTrackedPages * VideoPageBytes ) % pageSize ) ) || ( 0 != ( (size_t) pvideo % pageSize ) ) )
+        return;
+
+    struct sigaction sa;
+    memset( &sa, 0, sizeof( sa ) );
+    sa.sa_sigaction = VideoWriteFault;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset( &sa.sa_mask );
+    if ( sigaction( SIGSEGV, &sa, 0 ) || sigaction( SIGBUS, &sa, 0 ) ) // macOS raises SIGBUS for protection faults
+        return;
+
+    g_videoProtectUnit = pageSize;
+    g_videoDirty = ( 1u << VideoTrackedPages ) - 1;
+    g_videoScriptDirty = g_videoDirty;
+    g_videoTracking = 1;
+    tracer.Trace( "  tracking writes to video memory with %zu byte protection units\n", pageSize );
+} //EnableVideoWriteTracking
+
+static void ProtectVideoPages( uint32_t first, uint32_t last, volatile uint32_t & dirty = g_videoDirty )
+{
+    // clear the dirty bits before protecting so a write between the two is seen.
+    // the display and -kr waitfor checks each clear their own bits; a write faults and sets both
+
+    uint8_t * pvideo = memory + ScreenBufferSegment * 16;
+    for ( uint32_t page = first; page <= last; page++ )
+        dirty &= ~( 1u << page );
+
+    uint8_t * pstart = pvideo + ( first * VideoPageBytes / g_videoProtectUnit ) * g_videoProtectUnit;
+    uint8_t * pend = pvideo + round_up( (size_t) ( last + 1 ) * VideoPageBytes, g_videoProtectUnit );
+    mprotect( pstart, pend - pstart, PROT_READ );
+} //ProtectVideoPages
+
+void VideoMemoryWillChange( void * p, size_t len )
+{
+    // host reads into guest memory fail with EFAULT rather than faulting, so unprotect first
+
+    uint8_t * pvideo = memory + ScreenBufferSegment * 16;
+    if ( ( 1 == g_videoTracking ) && ( (uint8_t *) p < ( pvideo + VideoTrackedPages * VideoPageBytes ) ) && ( ( (uint8_t *) p + len ) > pvideo ) )
+    {
+        mprotect( pvideo, VideoTrackedPages * VideoPageBytes, PROT_READ | PROT_WRITE );
+        g_videoDirty = ( 1u << VideoTrackedPages ) - 1;
+        g_videoScriptDirty = g_videoDirty;
+    }
+} //VideoMemoryWillChange
+
+#else
+
+static void EnableVideoWriteTracking() { g_videoTracking = -1; }
+static void ProtectVideoPages( uint32_t first, uint32_t last, volatile uint32_t & dirty = g_videoDirty ) {}
+void VideoMemoryWillChange( void * p, size_t len ) {}
+
+#endif
+
+void MarkVideoPagesDirty()
+{
+    // for changes to what's displayed that aren't writes to video memory: page flips, mode sets, and row counts
+
+    g_videoDirty = ( 1u << VideoTrackedPages ) - 1;
+    g_videoScriptDirty = g_videoDirty;
+} //MarkVideoPagesDirty
+
+static bool VideoPagesDirty( uint8_t displayPage, uint32_t & first, uint32_t & last, volatile uint32_t & dirty = g_videoDirty )
+{
+    // the text pages holding displayPage's rows. 43 and 50 row modes span two pages
+
+    first = displayPage;
+    last = get_min( (uint32_t) ( displayPage + ( ScreenColumns * GetScreenRows() * 2 - 1 ) / VideoPageBytes ), VideoTrackedPages - 1 );
+    if ( 1 != g_videoTracking )
+        return true;
+
+    uint32_t mask = ( ( 2u << last ) - 1 ) & ~( ( 1u << first ) - 1 );
+    return ( 0 != ( dirty & mask ) );
+} //VideoPagesDirty
+
 bool DisplayUpdateRequired()
 {
+    // -headless never draws, so there's nothing pending that should keep an idle app from sleeping
+
+    if ( g_headless )
+        return false;
+
+    uint32_t first, last;
+    if ( !VideoPagesDirty( GetActiveDisplayPage(), first, last ) )
+        return false;
+
     return ( 0 != memcmp( g_bufferLastUpdate, GetVideoMem( GetActiveDisplayPage() ), ScreenColumns * GetScreenRows() * 2 ) );
 } //DisplayUpdateRequired
 
+// tty output is left in the stdout buffer rather than flushed per character. It goes to the screen when the app
+// asks for input, when it sleeps, when it's been sitting for a bit (see the main loop), and at exit.
+// Escape sequences for 80x25 mode also go through stdout, so ordering is preserved.
+
+void flush_console_output()
+{
+    if ( g_consoleOutputPending )
+    {
+        g_consoleOutputPending = false;
+        fflush( stdout );
+    }
+} //flush_console_output
+
 void SleepAndScheduleInterruptCheck()
 {
-    if ( g_UseOneThread && g_consoleConfig.throttled_kbhit() )
+    if ( g_UseOneThread && !g_batchIO && g_consoleConfig.throttled_kbhit() )
         g_KbdPeekAvailable = true; // make sure an int9 gets scheduled
 
+    if ( ScriptKeystrokeAvailable( true ) ) // the app is looping waiting for a key
+        g_KbdPeekAvailable = true;
+
     CKbdBuffer kbd_buf;
     //tracer.Trace( "  update required: %d, kbdpeek available: %d\n", DisplayUpdateRequired(), g_KbdPeekAvailable );
-    if ( kbd_buf.IsEmpty() && !DisplayUpdateRequired() && !g_KbdPeekAvailable )
+    if ( kbd_buf.IsEmpty() && !DisplayUpdateRequired() && !g_KbdPeekAvailable && !g_keyStrokes.StepsRemaining() )
     {
+        flush_console_output();
         tracer.Trace( "  sleeping in SleepAndScheduleInterruptCheck. g_KbdPeekAvailable %d\n", g_KbdPeekAvailable );
 #ifdef _WIN32
         DWORD dw = WaitForSingleObject( g_heventKeyStroke, 1 );
         tracer.Trace( "  sleep woke up due to %s\n", ( 0 == dw ) ? "keystroke event signaled" : "timeout" );
+#elif USE_EVENTFD
+        if ( -1 != g_keystrokeEventFd )
+        {
+            // keystrokes wake this right away, so just wake for the next timer tick
+
+            struct pollfd pfd = { g_keystrokeEventFd, POLLIN, 0 };
+            if ( 1 == poll( &pfd, 1, 55 ) )
+            {
+                uint64_t count;
+                if ( read( g_keystrokeEventFd, &count, sizeof( count ) ) ) {} // reset the event
+                tracer.Trace( "  sleep woke up due to keystroke event signaled\n" );
+            }
+        }
+        else
+            sleep_ms( 10 );
 #else
         sleep_ms( 10 );
 #endif
@@ -963,24 +1391,26 @@ static void trace_all_open_files()
     tracer.Trace( "\n" );
 
     size_t cEntries = g_fileEntries.size();
-    tracer.Trace( "  all files, count %d:\n", cEntries );
+    tracer.Trace( "  all files, table size %d:\n", cEntries );
     for ( size_t i = 0; i < cEntries; i++ )
     {
         FileEntry & fe = g_fileEntries[ i ];
-        tracer.Trace( "    file entry %d, fp %p, handle %u, mode %s, process %u, path %s\n",
-                      i, fe.fp, fe.handle, get_access_mode( fe.mode ), fe.seg_process, fe.path );
+        if ( fe.fp )
+            tracer.Trace( "    file entry %d, fp %p, handle %u, mode %s, process %u, path %s\n",
+                          i, fe.fp, fe.handle, get_access_mode( fe.mode ), fe.seg_process, fe.path );
     }
 } //trace_all_open_files
 
 static void trace_all_open_files_fcb()
 {
     size_t cEntries = g_fileEntriesFCB.size();
-    tracer.Trace( "  all fcb files, count %d:\n", cEntries );
+    tracer.Trace( "  all fcb files, table size %d:\n", cEntries );
     for ( size_t i = 0; i < cEntries; i++ )
     {
         FileEntry & fe = g_fileEntriesFCB[ i ];
-        tracer.Trace( "    fcb file entry %d, fp %p, handle %u, mode %s, process %u, path %s\n",
-                      i, fe.fp, fe.handle, get_access_mode( fe.mode ), fe.seg_process, fe.path );
+        if ( fe.fp )
+            tracer.Trace( "    fcb file entry %d, fp %p, handle %u, mode %s, process %u, path %s\n",
+                          i, fe.fp, fe.handle, get_access_mode( fe.mode ), fe.seg_process, fe.path );
     }
 } //trace_all_open_files_fcb
 
@@ -994,6 +1424,8 @@ static bool tc_build_file_open()
     for ( size_t i = 0; i < cEntries; i++ )
     {
         FileEntry & fe = g_fileEntries[ i ];
+        if ( !fe.fp )
+            continue;
 
         for ( size_t e = 0; e < _countof( build_ext ); e++ )
             if ( ends_with( fe.path, build_ext[ e ] ) )
@@ -1037,22 +1469,6 @@ static int compare_int_entries( const void * a, const void * b )
     return -1;
 } //compare_int_entries
 
-static int compare_file_entries( const void * a, const void * b )
-{
-    // sort by file handle, low to high
-
-    FileEntry const * pa = (FileEntry const *) a;
-    FileEntry const * pb = (FileEntry const *) b;
-
-    if ( pa->handle > pb->handle )
-        return 1;
-
-    if ( pa->handle == pb->handle )
-        return 0;
-
-    return -1;
-} //compare_file_entries
-
 void MarkBuiltInFree( uint16_t handle )
 {
     if ( handle <= 4 )
@@ -1075,101 +1491,89 @@ void MarkFreeBuiltInBusy( uint16_t handle )
         g_builtInHandles[ handle ] = handle;
 } // MarkFreeBuiltInBusy
 
+// Files opened with handles live in g_fileEntries at the index of their DOS handle, so lookups on every
+// read, write, seek, and close are a bounds check and an array index. Each process's handles are also
+// tracked so they can be closed when the process exits.
+
+void AddFileEntry( FileEntry & fe )
+{
+    if ( fe.handle >= g_fileEntries.size() )
+        g_fileEntries.resize( 1 + (size_t) fe.handle );
+
+    assert( 0 == g_fileEntries[ fe.handle ].fp );
+    g_fileEntries[ fe.handle ] = fe;
+    g_processFileHandles[ fe.seg_process ].push_back( fe.handle );
+} //AddFileEntry
+
 FILE * RemoveFileEntry( uint16_t handle )
 {
-    for ( size_t i = 0; i < g_fileEntries.size(); i++ )
+    if ( handle < g_fileEntries.size() && g_fileEntries[ handle ].fp )
     {
-        if ( handle == g_fileEntries[ i ].handle )
+        FileEntry & fe = g_fileEntries[ handle ];
+        FILE * fp = fe.fp;
+        tracer.Trace( "  removing file entry %s: %d\n", fe.path, handle );
+
+        vector<uint16_t> & handles = g_processFileHandles[ fe.seg_process ];
+        for ( size_t i = 0; i < handles.size(); i++ )
         {
-            FILE * fp = g_fileEntries[ i ].fp;
-            tracer.Trace( "  removing file entry %s: %d\n", g_fileEntries[ i ].path, i );
-            g_fileEntries.erase( g_fileEntries.begin() + i );
-            MarkBuiltInFree( handle );
-            return fp;
+            if ( handle == handles[ i ] )
+            {
+                handles.erase( handles.begin() + i );
+                break;
+            }
         }
+
+        fe.fp = 0;
+        MarkBuiltInFree( handle );
+        return fp;
     }
 
     tracer.Trace( "  ERROR: could not remove file entry for handle %04x\n", handle );
     return 0;
 } //RemoveFileEntry
 
-FILE * RemoveFileEntryFCB( const char * pname )
+size_t FindFileEntryIndex( uint16_t handle )
 {
-    for ( size_t i = 0; i < g_fileEntriesFCB.size(); i++ )
+    if ( handle < g_fileEntries.size() && g_fileEntries[ handle ].fp )
     {
-        if ( !_stricmp( pname, g_fileEntriesFCB[ i ].path ) )
-        {
-            FILE * fp = g_fileEntriesFCB[ i ].fp;
-            tracer.Trace( "  removing fcb file entry %s: %d\n", g_fileEntriesFCB[ i ].path, i );
-            g_fileEntriesFCB.erase( g_fileEntriesFCB.begin() + i );
-            return fp;
-        }
+        tracer.Trace( "  found file entry '%s': %d\n", g_fileEntries[ handle ].path, handle );
+        return handle;
     }
 
-    tracer.Trace( "  ERROR: could not remove fcb file entry for name '%s'\n", pname );
-    return 0;
-} //RemoveFileEntryFCB
+    tracer.Trace( "  could not find file entry for handle %04x\n", handle );
+    return (size_t) -1;
+} //FindFileEntryIndex
 
 FILE * FindFileEntry( uint16_t handle )
 {
-    for ( size_t i = 0; i < g_fileEntries.size(); i++ )
-    {
-        if ( handle == g_fileEntries[ i ].handle )
-        {
-            tracer.Trace( "  found file entry '%s': %d\n", g_fileEntries[ i ].path, i );
-            return g_fileEntries[ i ].fp;
-        }
-    }
+    size_t index = FindFileEntryIndex( handle );
+    if ( (size_t) -1 != index )
+        return g_fileEntries[ index ].fp;
 
     tracer.Trace( "  ERROR: could not find file entry for handle %04x\n", handle );
     return 0;
 } //FindFileEntry
 
-size_t FindFileEntryIndex( uint16_t handle )
-{
-    for ( size_t i = 0; i < g_fileEntries.size(); i++ )
-    {
-        if ( handle == g_fileEntries[ i ].handle )
-        {
-            tracer.Trace( "  found file entry '%s': %d\n", g_fileEntries[ i ].path, i );
-            return i;
-        }
-    }
-
-    tracer.Trace( "  could not find file entry for handle %04x\n", handle );
-    return (size_t) -1;
-} //FindFileEntryIndex
-
 size_t FindFileEntryIndexByProcess( uint16_t seg )
 {
-    for ( size_t i = 0; i < g_fileEntries.size(); i++ )
-    {
-        if ( seg == g_fileEntries[ i ].seg_process )
-            return i;
-    }
-    return (size_t) -1;
-} //FindFileEntryIndexByProcess
+    auto it = g_processFileHandles.find( seg );
+    if ( it == g_processFileHandles.end() )
+        return (size_t) -1;
 
-size_t FindFileEntryIndexByProcessFCB( uint16_t seg )
-{
-    for ( size_t i = 0; i < g_fileEntriesFCB.size(); i++ )
+    if ( it->second.empty() )
     {
-        if ( seg == g_fileEntriesFCB[ i ].seg_process )
-            return i;
+        g_processFileHandles.erase( it );
+        return (size_t) -1;
     }
-    return (size_t) -1;
-} //FindFileEntryIndexByProcessFCB
+
+    return it->second.back();
+} //FindFileEntryIndexByProcess
 
 const char * FindFileEntryPath( uint16_t handle )
 {
-    for ( size_t i = 0; i < g_fileEntries.size(); i++ )
-    {
-        if ( handle == g_fileEntries[ i ].handle )
-        {
-            tracer.Trace( "  found file entry '%s': %d\n", g_fileEntries[ i ].path, i );
-            return g_fileEntries[ i ].path;
-        }
-    }
+    size_t index = FindFileEntryIndex( handle );
+    if ( (size_t) -1 != index )
+        return g_fileEntries[ index ].path;
 
     tracer.Trace( "  ERROR: could not find file entry for handle %04x\n", handle );
     return 0;
@@ -1179,7 +1583,7 @@ size_t FindFileEntryFromPath( const char * pfile )
 {
     for ( size_t i = 0; i < g_fileEntries.size(); i++ )
     {
-        if ( !_stricmp( pfile, g_fileEntries[ i ].path ) )
+        if ( g_fileEntries[ i ].fp && !_stricmp( pfile, g_fileEntries[ i ].path ) )
         {
             tracer.Trace( "  found file entry '%s': %d\n", g_fileEntries[ i ].path, i );
             return i;
@@ -1190,26 +1594,6 @@ size_t FindFileEntryFromPath( const char * pfile )
     return (size_t) -1;
 } //FindFileEntryFromPath
 
-FILE * FindFileEntryFromFileFCB( const char * pfile )
-{
-    for ( size_t i = 0; i < g_fileEntriesFCB.size(); i++ )
-    {
-        if ( !_stricmp( pfile, g_fileEntriesFCB[ i ].path ) )
-        {
-            tracer.Trace( "  found fcb file entry '%s': %d\n", g_fileEntriesFCB[ i ].path, i );
-            return g_fileEntriesFCB[ i ].fp;
-        }
-    }
-
-    tracer.Trace( "  NOTICE: could not find fcb file entry for path %s\n", pfile );
-    return 0;
-} //FindFileEntryFromFileFCB
-
-void SortFileHandles()
-{
-    qsort( g_fileEntries.data(), g_fileEntries.size(), sizeof( FileEntry ), compare_file_entries );
-} //SortFileHandles
-
 uint16_t FindFirstFreeFileHandle()
 {
     // First try to use any closed built-in handles. This DOS behavior is required for some apps to run.
@@ -1226,30 +1610,9 @@ uint16_t FindFirstFreeFileHandle()
     // An app can close a built-in handle and the next dup or open call must use that handle, so
     // stdin can be redirected from a file, etc.
 
-    SortFileHandles(); // needed for the algorithm below to work
     uint16_t freehandle = 5;
-
-    do
-    {
-        bool keep_looking = false;
-
-        for ( size_t i = 0; i < g_fileEntries.size(); i++ )
-        {
-            if ( g_fileEntries[ i ].handle == freehandle )
-            {
-                keep_looking = true;
-                break;
-            }
-
-            if ( g_fileEntries[ i ].handle > freehandle )
-                return freehandle;
-        }
-
-        if ( keep_looking )
-            freehandle++;
-        else
-            break;
-    } while( true );
+    while ( freehandle < g_fileEntries.size() && g_fileEntries[ freehandle ].fp )
+        freehandle++;
 
     return freehandle;
 } //FindFirstFreeFileHandle
@@ -1268,236 +1631,258 @@ struct DOSMemoryControlBlock
 };
 #pragma pack(pop)
 
-static void trace_all_allocations()
+static DOSMemoryControlBlock * GetMCB( uint16_t segMCB )
 {
-    size_t cEntries = g_allocEntries.size();
-    tracer.Trace( "  all allocations, count %d:\n", cEntries );
-    for ( size_t i = 0; i < cEntries; i++ )
-    {
-        DosAllocation & da = g_allocEntries[i];
-        DOSMemoryControlBlock *pmcb = (DOSMemoryControlBlock *) cpu.flat_address( da.segment - 1, 0 );
+    return (DOSMemoryControlBlock *) cpu.flat_address( segMCB, 0 );
+} //GetMCB
 
-        tracer.Trace( "      alloc entry %d, process %04x, uses segment %04x, para len %04x, (MCB %04x - %04x)  header %c, psp %04x, paras %04x\n", i,
-                      da.seg_process, da.segment, da.para_length, da.segment - 1, da.segment - 1 + da.para_length - 1,
-                      pmcb->header, (uint16_t) pmcb->psp, (uint16_t) pmcb->paras );
-        //tracer.TraceBinaryData( (uint8_t *) cpu.flat_address( da.segment, 0 ), get_min( 0x1000, ( da.para_length - 1 ) * 16 ), 8 );
-    }
+static bool IsValidMCB( uint16_t segMCB )
+{
+    // the MCB chain in guest memory is the only record of allocations, so check it before trusting it.
+    // an app that writes past the end of its block can trash the next MCB, just like on real DOS.
+
+    if ( 0 == g_segFirstMCB || segMCB < g_segFirstMCB || segMCB >= g_segHardware )
+        return false;
+
+    DOSMemoryControlBlock * pmcb = GetMCB( segMCB );
+    if ( 'M' != pmcb->header && 'Z' != pmcb->header )
+        return false;
+
+    uint32_t end = (uint32_t) segMCB + 1 + pmcb->paras;
+    if ( 'Z' == pmcb->header )
+        return ( end <= g_segHardware );
+
+    return ( end < g_segHardware );
+} //IsValidMCB
+
+static uint16_t NextMCB( uint16_t segMCB )
+{
+    // returns the segment of the MCB that follows segMCB or 0 at the end of the chain or if the chain is corrupt
+
+    DOSMemoryControlBlock * pmcb = GetMCB( segMCB );
+    if ( 'Z' == pmcb->header )
+        return 0;
+
+    uint16_t segNext = segMCB + 1 + pmcb->paras;
+    return IsValidMCB( segNext ) ? segNext : 0;
+} //NextMCB
+
+static uint16_t FirstMCB()
+{
+    return IsValidMCB( g_segFirstMCB ) ? g_segFirstMCB : 0;
+} //FirstMCB
+
+static void trace_all_allocations()
+{
+    if ( !tracer.IsEnabled() )
+        return;
+
+    tracer.Trace( "  all memory control blocks, first at %04x:\n", g_segFirstMCB );
+    size_t i = 0;
+    for ( uint16_t seg = FirstMCB(); 0 != seg; seg = NextMCB( seg ), i++ )
+    {
+        DOSMemoryControlBlock * pmcb = GetMCB( seg );
+        tracer.Trace( "      mcb %d at %04x, header %c, psp %04x, paras %04x, uses segment %04x - %04x %s\n", i, seg,
+                      pmcb->header, (uint16_t) pmcb->psp, (uint16_t) pmcb->paras, seg + 1, seg + pmcb->paras,
+                      ( 0 == pmcb->psp ) ? "(free)" : "" );
+    }
 } //trace_all_allocations
 
-size_t FindAllocationEntry( uint16_t segment )
+DOSMemoryControlBlock * FindAllocation( uint16_t segment )
 {
-    for ( size_t i = 0; i < g_allocEntries.size(); i++ )
+    // segment is the one handed out to the app, 1 past the MCB. The lookup is just a look at the MCB in front of it.
+
+    uint16_t segMCB = segment - 1;
+    if ( IsValidMCB( segMCB ) )
     {
-        if ( segment == g_allocEntries[ i ].segment )
+        DOSMemoryControlBlock * pmcb = GetMCB( segMCB );
+        if ( 0 != pmcb->psp && ( 'Z' == pmcb->header || 0 != NextMCB( segMCB ) ) )
         {
-            tracer.Trace( "  found allocation entry segment %04x para len %04x\n", g_allocEntries[ i ].segment, g_allocEntries[ i ].para_length );
-            return i;
+            tracer.Trace( "  found allocation segment %04x paras %04x\n", segment, (uint16_t) pmcb->paras );
+            return pmcb;
         }
     }
 
-    tracer.Trace( "  ERROR: could not find alloc entry for segment %04x\n", segment );
+    tracer.Trace( "  ERROR: could not find allocation for segment %04x\n", segment );
     trace_all_allocations();
-    return (size_t) -1;
-} //FindAllocationEntry
+    return 0;
+} //FindAllocation
 
-size_t FindAllocationEntryByProcess( uint16_t segment )
+void initialize_mcb( uint16_t segMCB, uint8_t header, uint16_t psp, uint16_t paragraphs )
 {
-    for ( size_t i = 0; i < g_allocEntries.size(); i++ )
-    {
-        if ( segment == g_allocEntries[ i ].seg_process )
-            return i;
-    }
+    DOSMemoryControlBlock *pmcb = GetMCB( segMCB );
 
-    return (size_t) -1;
-} //FindAllocationEntry
+    pmcb->header = header;
+    pmcb->psp = psp;
+    pmcb->paras = paragraphs;
+    memset( pmcb->reserved, 0, sizeof( pmcb->reserved ) );
+    memset( pmcb->appname, 0, sizeof( pmcb->appname ) );
+} //initialize_mcb
 
-void reset_mcb_tags()
+static void coalesce_free_mcbs( uint16_t segMCB )
 {
-    // 1) update header with M for non-last and Z for last entries
-    // 2) update paras to point to the next MCB, even if that means lying about the actually allocated size
-    // 3) ... unless it's the last (Z) MCB, in which case update paras to reflect reality
+    // merge any free blocks that follow segMCB into it. DOS does this lazily rather than when blocks are freed.
 
-    for ( size_t i = 0; i < g_allocEntries.size(); i++ )
+    DOSMemoryControlBlock * pmcb = GetMCB( segMCB );
+
+    do
     {
-        DosAllocation & da = g_allocEntries[i];
-        DOSMemoryControlBlock *pmcb = (DOSMemoryControlBlock *) cpu.flat_address( da.segment - 1, 0 );
+        uint16_t segNext = NextMCB( segMCB );
+        if ( 0 == segNext )
+            break;
 
-        if ( i == ( g_allocEntries.size() - 1 ) )
-        {
-            pmcb->header = 'Z';
-            pmcb->paras = da.para_length - 1; // mcb has user-known-size. DosAllocation has actual size
-        }
-        else
-        {
-            pmcb->header = 'M';
-            pmcb->paras = g_allocEntries[ i + 1 ].segment - da.segment - 1; // -1 to exclude the MCB
-        }
-    }
-} //reset_mcb_tags
+        DOSMemoryControlBlock * pnext = GetMCB( segNext );
+        if ( 0 != pnext->psp )
+            break;
+
+        pmcb->paras = pmcb->paras + 1 + pnext->paras;
+        pmcb->header = pnext->header;
+    } while ( true );
+} //coalesce_free_mcbs
 
-void initialize_mcb( uint16_t segMCB, uint16_t paragraphs )
+static void split_mcb( uint16_t segMCB, uint16_t paragraphs )
 {
-    DOSMemoryControlBlock *pmcb = (DOSMemoryControlBlock *) cpu.flat_address( segMCB, 0 );
+    // shrink the block at segMCB to paragraphs and turn what's left into a free block after it
 
-    pmcb->header = 'M'; // mark as not the last in the chain
-    pmcb->psp = ( 0 == g_currentPSP ) ? 8 : g_currentPSP; // this is what's expected
+    DOSMemoryControlBlock * pmcb = GetMCB( segMCB );
+    if ( pmcb->paras <= paragraphs )
+        return;
+
+    initialize_mcb( segMCB + 1 + paragraphs, pmcb->header, 0, pmcb->paras - paragraphs - 1 );
+    pmcb->header = 'M';
     pmcb->paras = paragraphs;
-    memset( pmcb->appname, 0, sizeof( pmcb->appname ) );
-} //initialize_mcb
+} //split_mcb
 
 uint16_t AllocateMemory( uint16_t request_paragraphs, uint16_t & largest_block )
 {
-    size_t cEntries = g_allocEntries.size();
-
     // DOS V2 sort.exe asks for 0 paragraphs
 
     if ( 0 == request_paragraphs )
         request_paragraphs = 1;
 
-    // save room for the MCB prior to the allocation if the call isn't just to see how much RAM is available
+    tracer.Trace( "  request to allocate %04x paragraphs (excluding MCB)\n", request_paragraphs );
 
-    if ( 0xffff != request_paragraphs )
-        request_paragraphs++;
+    if ( 0 == g_segFirstMCB )
+    {
+        // Microsoft (R) Overlay Linker Version 3.61 with Quick C v 1.0 is a packed EXE that required /h to be in high memory
+        // before the loader unpacked EXEPACK images natively. Other apps like pas2.exe still need it.
 
-    tracer.Trace( "  request to allocate %04x paragraphs (including MCB)\n", request_paragraphs );
-    trace_all_allocations();
+        const uint16_t baseSeg = g_PackedFileCorruptWorkaround ? ( 65536 / 16 ) : AppSegment;
 
-    uint16_t allocatedSeg = 0;
-    size_t insertLocation = 0;
+        g_segFirstMCB = baseSeg;
+        initialize_mcb( baseSeg, 'Z', 0, g_segHardware - baseSeg - 1 ); // hardware starts at 0xb800, apps load at baseSeg, -1 for MCB
+        tracer.Trace( "    created the memory control block chain at segment %04x\n", baseSeg );
 
-    // sometimes allocate an extra spaceBetween paragraphs between blocks for overly-optimistic resize requests.
-    // I'm looking at you link.exe v5.10 from 1990. QBX and cl.exe run link.exe as a child process, so look for that too.
-    // debug.com from DOS v2 is even worse about this.
+        // update the entry in the "list of lists" of the first memory control block
 
-    uint16_t spaceBetween = ( ends_with( g_acApp, "LINK.EXE" ) || ends_with( g_lastLoadedApp, "LINK.EXE" ) ) ? 0x40 : 0;
-    spaceBetween = ( ends_with( g_acApp, "DEBUG.COM" ) || ends_with( g_lastLoadedApp, "DEBUG.COM" ) ) ? 0x60 : spaceBetween;
-    if ( ends_with( g_acApp, "ILINK.EXE" ) )
-        spaceBetween = 0;
+        cpu.setmword( SegmentListOfLists, OffsetListOfLists - 2, baseSeg );
+        tracer.Trace( "  wrote segment of first MCB %04x to list of lists - 2 at %04x:%04x\n", baseSeg, SegmentListOfLists, OffsetListOfLists - 2 );
+    }
 
-    if ( 0 == cEntries )
-    {
-        // Microsoft (R) Overlay Linker Version 3.61 with Quick C v 1.0 is a packed EXE that requires /h to be in high memory
+    trace_all_allocations();
 
-        const uint16_t baseSeg = g_PackedFileCorruptWorkaround ? ( 65536 / 16 ) : AppSegment;
-        const uint16_t ParagraphsAvailable = g_segHardware - baseSeg - 1;  // hardware starts at 0xb800, apps load at baseSeg, -1 for MCB
+    // walk the chain looking for a free block per the int 21h 58h strategy, merging neighboring free blocks along the way
+
+    uint8_t fit = g_allocStrategy & 3;
+    uint16_t chosenSeg = 0;
+    uint16_t largest = 0;
 
-        if ( request_paragraphs > ParagraphsAvailable )
+    uint16_t seg = g_segFirstMCB;
+    do
+    {
+        if ( !IsValidMCB( seg ) )
         {
-            largest_block = ParagraphsAvailable;
-            tracer.Trace( "allocating first bock, and reporting %04x paragraphs available\n", largest_block );
-            trace_all_allocations();
+            tracer.Trace( "  ERROR: the memory control block chain is corrupt at segment %04x\n", seg );
+            largest_block = 0;
             return 0;
         }
 
-        allocatedSeg = baseSeg; // default if nothing is allocated yet
-        tracer.Trace( "    allocating first block at segment %04x\n", allocatedSeg );
-
-        // update the entry in the "list of lists" of the first memory control block
+        DOSMemoryControlBlock * pmcb = GetMCB( seg );
+        if ( 0 == pmcb->psp )
+        {
+            coalesce_free_mcbs( seg );
 
-        cpu.setmword( SegmentListOfLists, OffsetListOfLists - 2, allocatedSeg );
-        tracer.Trace( "  wrote segment of first allocation %04x to list of lists - 2 at %04x:%04x\n", allocatedSeg, SegmentListOfLists, OffsetListOfLists - 2 );
-    }
-    else
-    {
-        uint16_t largestGap = 0;
+            if ( pmcb->paras > largest )
+                largest = pmcb->paras;
 
-        for ( size_t i = 0; i < cEntries; i++ )
-        {
-            uint16_t after = g_allocEntries[ i ].segment - 1 + g_allocEntries[ i ].para_length;
-            if ( i < ( cEntries - 1 ) )
+            if ( ( pmcb->paras >= request_paragraphs ) &&
+                 ( ( 1 != fit ) || ( 0 == chosenSeg ) || ( pmcb->paras < GetMCB( chosenSeg )->paras ) ) )
             {
-                uint16_t freePara = g_allocEntries[ i + 1 ].segment - 1 - after;
-                if ( freePara > largestGap )
-                    largestGap = freePara;
-
-                if ( freePara >= ( request_paragraphs + spaceBetween) )
-                {
-                    tracer.Trace( "  using gap from previously freed memory: %02x\n", after );
-                    allocatedSeg = after;
-                    insertLocation = i + 1;
+                chosenSeg = seg; // last fit keeps going to find the highest block
+                if ( 0 == fit )
                     break;
-                }
-            }
-            else if ( ( after + request_paragraphs + spaceBetween ) <= g_segHardware )
-            {
-                tracer.Trace( "  using gap after allocated memory: %02x\n", after );
-                allocatedSeg = after + spaceBetween;
-                insertLocation = i + 1;
-                break;
             }
         }
 
-        // if allocation failed, try again without spaceBetween
-
-        if ( 0 != spaceBetween && 0 == allocatedSeg )
-        {
-            for ( size_t i = 0; i < cEntries; i++ )
-            {
-                uint16_t after = g_allocEntries[ i ].segment - 1 + g_allocEntries[ i ].para_length;
-                if ( i < ( cEntries - 1 ) )
-                {
-                    uint16_t freePara = g_allocEntries[ i + 1 ].segment - 1 - after;
-                    if ( freePara > largestGap )
-                        largestGap = freePara;
+        if ( 'Z' == pmcb->header )
+            break;
 
-                    if ( freePara >= request_paragraphs )
-                    {
-                        tracer.Trace( "  using gap from previously freed memory: %02x\n", after );
-                        allocatedSeg = after;
-                        insertLocation = i + 1;
-                        break;
-                    }
-                }
-                else if ( ( after + request_paragraphs ) <= g_segHardware )
-                {
-                    tracer.Trace( "  using gap after allocated memory: %02x\n", after );
-                    allocatedSeg = after;
-                    insertLocation = i + 1;
-                    break;
-                }
-            }
-        }
+        seg = seg + 1 + pmcb->paras;
+    } while ( true );
 
-        if ( 0 == allocatedSeg )
-        {
-            DosAllocation & last = g_allocEntries[ cEntries - 1 ];
-            uint16_t firstFreeSeg = last.segment - 1 + last.para_length;
-            assert( firstFreeSeg <= g_segHardware );
-            largest_block = g_segHardware - firstFreeSeg;
-            if ( largest_block > spaceBetween )
-                largest_block -= spaceBetween;
+    if ( 0 == chosenSeg )
+    {
+        largest_block = largest;
+        tracer.Trace( "  ERROR: unable to allocate %02x paragraphs. returning that %02x paragraphs are free\n", request_paragraphs, largest_block );
+        return 0;
+    }
 
-            if ( largestGap > largest_block )
-                largest_block = largestGap;
+    DOSMemoryControlBlock * pchosen = GetMCB( chosenSeg );
+    uint16_t segMCB = chosenSeg;
 
-            largest_block--; // don't include the MCB
+    if ( ( 2 == fit ) && ( pchosen->paras > request_paragraphs ) )
+    {
+        // last fit takes the top of the block and leaves the bottom free
 
-            tracer.Trace( "  ERROR: unable to allocate %02x paragraphs. returning that %02x paragraphs are free\n", request_paragraphs, largest_block );
-            return 0;
-        }
+        uint16_t below = pchosen->paras - request_paragraphs - 1;
+        segMCB = chosenSeg + 1 + below;
+        initialize_mcb( segMCB, pchosen->header, 0, request_paragraphs );
+        pchosen->header = 'M';
+        pchosen->paras = below;
     }
+    else
+        split_mcb( chosenSeg, request_paragraphs );
 
-    allocatedSeg++; // move past the MCB
+    GetMCB( segMCB )->psp = ( 0 == g_currentPSP ) ? 8 : g_currentPSP; // this is what's expected
+    uint16_t allocatedSeg = segMCB + 1;
+    tracer.Trace( "  allocated segment %04x from the %s\n", allocatedSeg, ( 0 == NextMCB( segMCB ) ) ? "last block" : "chain" );
 
     if ( g_fillDOSMemoryBlocks )
-        memset( cpu.flat_address( allocatedSeg, 0 ), 'a', ( request_paragraphs - 1 ) * 16 );
+        memset( cpu.flat_address( allocatedSeg, 0 ), 'a', request_paragraphs * 16 );
 
-    DosAllocation da;
-    da.segment = allocatedSeg;
-    da.para_length = request_paragraphs;
-    da.seg_process = g_currentPSP;
-    g_allocEntries.insert( insertLocation + g_allocEntries.begin(), da );
     largest_block = g_segHardware - allocatedSeg;
-    initialize_mcb( allocatedSeg - 1, request_paragraphs - 1 );
-    reset_mcb_tags();
     trace_all_allocations();
     return allocatedSeg;
 } //AllocateMemory
 
+bool ResizeMemory( uint16_t segment, uint16_t request_paragraphs, uint16_t & max_paragraphs )
+{
+    // grow or shrink the block in place. Like DOS, a failed attempt to grow leaves the block as large as possible.
+    // apps like link.exe v5.10 from 1990 and debug.com from DOS v2 ignore that the request failed and use the memory.
+
+    DOSMemoryControlBlock * pmcb = FindAllocation( segment );
+    if ( 0 == pmcb )
+        return false;
+
+    uint16_t segMCB = segment - 1;
+    coalesce_free_mcbs( segMCB );
+    max_paragraphs = pmcb->paras;
+
+    if ( request_paragraphs > max_paragraphs )
+    {
+        trace_all_allocations();
+        return false;
+    }
+
+    split_mcb( segMCB, request_paragraphs );
+    trace_all_allocations();
+    return true;
+} //ResizeMemory
+
 bool FreeMemory( uint16_t segment )
 {
-    size_t entry = FindAllocationEntry( segment );
-    if ( -1 == entry )
+    DOSMemoryControlBlock * pmcb = FindAllocation( segment );
+    if ( 0 == pmcb )
     {
         // The Microsoft Basic compiler BC.EXE 7.10 attempts to free segment 0x80, which it doesn't own.
         // Turbo Pascal v5.5 exits a process never created except via int21 0x55, which frees that PSP,
@@ -1507,13 +1892,13 @@ bool FreeMemory( uint16_t segment )
         return false;
     }
 
-    tracer.Trace( "  freeing memory with segment %04x entry %d\n", segment, entry );
+    tracer.Trace( "  freeing memory with segment %04x paras %04x\n", segment, (uint16_t) pmcb->paras );
 
     if ( g_fillDOSMemoryBlocks )
-        memset( cpu.flat_address( segment, 0 ), 'f', ( g_allocEntries[ entry ].para_length - 1 ) * 16 );
+        memset( cpu.flat_address( segment, 0 ), 'f', pmcb->paras * 16 );
 
-    g_allocEntries.erase( g_allocEntries.begin() + entry );
-    reset_mcb_tags();
+    pmcb->psp = 0;
+    coalesce_free_mcbs( segment - 1 );
 
     trace_all_allocations();
     return true;
@@ -1533,16 +1918,30 @@ bool keyState( int vkey )
 } //keyState
 #endif
 
+void SendCursorPosition( uint8_t row, uint8_t col )
+{
+    char ac[ 12 ];
+    int len = snprintf( ac, sizeof( ac ), "\x1b[%d;%dH", row + 1, col + 1 ); // vt-100 row/col are 1-based
+    fwrite( ac, 1, len, stdout );
+    fflush( stdout );
+    RecordTerminalOutput( ac, len );
+} //SendCursorPosition
+
 void UpdateScreenCursorPosition( uint8_t row, uint8_t col )
 {
     //tracer.Trace( "  updating screen cursor position to %d %d\n", row, col );
     assert( g_use80xRowsMode );
+    if ( g_headless )
+        return;
+
 #ifdef _WIN32
     COORD pos = { col, row };
     SetConsoleCursorPosition( g_hConsoleOutput, pos );
 #else
-    printf( "\x1b[%d;%dH", row + 1, col + 1 );    // vt-100 row/col are 1-based
-    fflush( stdout );
+    if ( g_renderThreadActive )
+        PublishDisplaySnapshot(); // the snapshot has the cursor position
+    else
+        SendCursorPosition( row, col );
 #endif
 } //UpdateScreenCursorPosition
 
@@ -1759,16 +2158,12 @@ void UpdateHandleMap()
     DOSPSP * psp = (DOSPSP *) cpu.flat_address( g_currentPSP, 0 );
     memset( & ( psp->fileHandles[5] ), 0xff, sizeof( psp->fileHandles ) - 5 );
 
-    size_t cEntries = g_fileEntries.size();
-    if ( 0 != cEntries )
+    size_t cEntries = get_min( g_fileEntries.size(), _countof( psp->fileHandles ) );
+    for ( size_t i = 5; i < cEntries; i++ )
     {
-        cEntries = get_min( cEntries, _countof( psp->fileHandles ) );
-
-        for ( int i = 0; i < cEntries; i++ )
-        {
-            FileEntry & fe = g_fileEntries[ i ];
+        FileEntry & fe = g_fileEntries[ i ];
+        if ( fe.fp )
             psp->fileHandles[ fe.handle ] = (uint8_t) fe.handle;
-        }
     }
 
     psp->TraceHandleMap();
@@ -1821,18 +2216,248 @@ bool GetDOSFilenameFromFCB( DOSFCB &fcb, char * filename )
     *filename = 0;
 
 #ifndef _WIN32
-    if ( g_forcePathsUpper )
-        strupr( orig );
-    else if ( g_forcePathsLower )
-        strlwr( orig );
+    g_caseResolver.Resolve( orig );
 #endif
 
     return ( 0 != *orig && '.' != *orig );
 } //GetDOSFilenameFromFCB
 
+// FCB files are found via a slot number that's stashed in the reserved bytes of the FCB when the file is
+// opened or created (DOS also keeps its own bookkeeping there). The filename is checked as well since apps
+// can copy, move, or reuse FCBs. If the FCB doesn't have a valid slot the table is searched by filename.
+
+const uint8_t FCBSlotTag = 0xfc;
+
+static void SetFCBSlot( DOSFCB * pfcb, size_t slot )
+{
+    pfcb->reserved[ 0 ] = FCBSlotTag;
+    pfcb->reserved[ 1 ] = (uint8_t) ( slot & 0xff );
+    pfcb->reserved[ 2 ] = (uint8_t) ( ( slot >> 8 ) & 0xff );
+} //SetFCBSlot
+
+static void ClearFCBSlot( DOSFCB * pfcb )
+{
+    if ( FCBSlotTag == pfcb->reserved[ 0 ] )
+        memset( pfcb->reserved, 0, 3 );
+} //ClearFCBSlot
+
+void AddFileEntryFCB( DOSFCB * pfcb, FileEntry & fe )
+{
+    size_t slot = 0;
+    while ( slot < g_fileEntriesFCB.size() && g_fileEntriesFCB[ slot ].fp )
+        slot++;
+
+    if ( slot == g_fileEntriesFCB.size() )
+        g_fileEntriesFCB.resize( slot + 1 );
+
+    FCBFileEntry & entry = g_fileEntriesFCB[ slot ];
+    (FileEntry &) entry = fe;
+    memcpy( entry.dosName, pfcb->name, sizeof( entry.dosName ) );
+    entry.hostOffset = (uint32_t) ftell( fe.fp );
+    entry.lastOp = 0;
+    entry.fileSize = (uint32_t) portable_filelen( fe.fp );
+    entry.bufOffset = 0;
+    entry.bufLength = 0;
+
+    SetFCBSlot( pfcb, slot );
+} //AddFileEntryFCB
+
+size_t FindFileEntryIndexFCB( DOSFCB * pfcb, const char * pfile )
+{
+    if ( FCBSlotTag == pfcb->reserved[ 0 ] )
+    {
+        size_t slot = (size_t) pfcb->reserved[ 1 ] | ( (size_t) pfcb->reserved[ 2 ] << 8 );
+        if ( slot < g_fileEntriesFCB.size() && g_fileEntriesFCB[ slot ].fp && !_stricmp( pfile, g_fileEntriesFCB[ slot ].path ) )
+            return slot;
+    }
+
+    for ( size_t i = 0; i < g_fileEntriesFCB.size(); i++ )
+    {
+        if ( g_fileEntriesFCB[ i ].fp && !_stricmp( pfile, g_fileEntriesFCB[ i ].path ) )
+        {
+            tracer.Trace( "  found fcb file entry '%s' by name: %d\n", g_fileEntriesFCB[ i ].path, i );
+            SetFCBSlot( pfcb, i );
+            return i;
+        }
+    }
+
+    tracer.Trace( "  NOTICE: could not find fcb file entry for path %s\n", pfile );
+    return (size_t) -1;
+} //FindFileEntryIndexFCB
+
+FCBFileEntry * FindFileEntryFromFileFCB( DOSFCB * pfcb )
+{
+    // the common case: the FCB has the slot from when it was opened and the name hasn't changed
+
+    if ( FCBSlotTag == pfcb->reserved[ 0 ] )
+    {
+        size_t slot = (size_t) pfcb->reserved[ 1 ] | ( (size_t) pfcb->reserved[ 2 ] << 8 );
+        if ( slot < g_fileEntriesFCB.size() && g_fileEntriesFCB[ slot ].fp &&
+             !memcmp( g_fileEntriesFCB[ slot ].dosName, pfcb->name, sizeof( g_fileEntriesFCB[ slot ].dosName ) ) )
+            return & g_fileEntriesFCB[ slot ];
+    }
+
+    char filename[ DOS_FILENAME_SIZE ];
+    if ( !GetDOSFilenameFromFCB( *pfcb, filename ) )
+    {
+        tracer.Trace( "  ERROR: can't parse filename in FCB\n" );
+        return 0;
+    }
+
+    size_t slot = FindFileEntryIndexFCB( pfcb, filename );
+    if ( (size_t) -1 == slot )
+        return 0;
+
+    return & g_fileEntriesFCB[ slot ];
+} //FindFileEntryFromFileFCB
+
+FILE * RemoveFileEntryFCB( size_t slot )
+{
+    FileEntry & fe = g_fileEntriesFCB[ slot ];
+    FILE * fp = fe.fp;
+    tracer.Trace( "  removing fcb file entry %s: %d\n", fe.path, slot );
+    fe.fp = 0;
+    return fp;
+} //RemoveFileEntryFCB
+
+FILE * RemoveFileEntryFCB( DOSFCB * pfcb, const char * pfile )
+{
+    size_t slot = FindFileEntryIndexFCB( pfcb, pfile );
+    if ( (size_t) -1 == slot )
+    {
+        tracer.Trace( "  ERROR: could not remove fcb file entry for name '%s'\n", pfile );
+        return 0;
+    }
+
+    ClearFCBSlot( pfcb );
+    return RemoveFileEntryFCB( slot );
+} //RemoveFileEntryFCB
+
+size_t FindFileEntryIndexByProcessFCB( uint16_t seg )
+{
+    for ( size_t i = 0; i < g_fileEntriesFCB.size(); i++ )
+    {
+        if ( g_fileEntriesFCB[ i ].fp && seg == g_fileEntriesFCB[ i ].seg_process )
+            return i;
+    }
+    return (size_t) -1;
+} //FindFileEntryIndexByProcessFCB
+
+// FCB record I/O. Apps read and write one record (often 128 bytes) per call, so track where the host file
+// is positioned to avoid seeking on sequential access and read ahead for small reads.
+
+const uint32_t FCBReadAheadSize = 16 * 1024;
+const uint8_t FCBOpRead = 1;
+const uint8_t FCBOpWrite = 2;
+
+static bool FCBSeek( FCBFileEntry & entry, uint32_t offset, uint8_t op )
+{
+    if ( offset == entry.hostOffset && op == entry.lastOp )
+        return true;
+
+    entry.lastOp = op;
+    if ( fseek( entry.fp, offset, SEEK_SET ) )
+    {
+        entry.hostOffset = (uint32_t) -1;
+        tracer.Trace( "  ERROR: FCB seek to %u failed, error %d = %s\n", offset, errno, strerror( errno ) );
+        return false;
+    }
+
+    entry.hostOffset = offset;
+    return true;
+} //FCBSeek
+
+static uint32_t FCBRead( FCBFileEntry & entry, uint32_t offset, uint8_t * p, uint32_t len )
+{
+    uint32_t copied = 0;
+
+    if ( offset >= entry.bufOffset && offset < ( entry.bufOffset + entry.bufLength ) )
+    {
+        copied = get_min( len, entry.bufOffset + entry.bufLength - offset );
+        memcpy( p, entry.buf.data() + ( offset - entry.bufOffset ), copied );
+        if ( copied == len )
+            return copied;
+
+        offset += copied;
+        p += copied;
+        len -= copied;
+    }
+
+    if ( !FCBSeek( entry, offset, FCBOpRead ) )
+        return copied;
+
+    if ( len >= FCBReadAheadSize )
+    {
+        VideoMemoryWillChange( p, len );
+        uint32_t num_read = (uint32_t) fread( p, 1, len, entry.fp );
+        entry.hostOffset += num_read;
+        return copied + num_read;
+    }
+
+    entry.buf.resize( FCBReadAheadSize );
+    uint32_t num_read = (uint32_t) fread( entry.buf.data(), 1, FCBReadAheadSize, entry.fp );
+    entry.hostOffset += num_read;
+    entry.bufOffset = offset;
+    entry.bufLength = num_read;
+    tracer.Trace( "  read ahead %u bytes at offset %u\n", num_read, offset );
+
+    uint32_t to_copy = get_min( len, num_read );
+    memcpy( p, entry.buf.data(), to_copy );
+    return copied + to_copy;
+} //FCBRead
+
+static void InvalidateFCBCaches( const char * path, FILE * fpWriter )
+{
+    // a write through a handle or another FCB leaves FCB read-ahead data and cached file sizes stale.
+    // fpWriter made the change; flush it so the other streams see the new contents and length.
+
+    for ( size_t i = 0; i < g_fileEntriesFCB.size(); i++ )
+    {
+        FCBFileEntry & entry = g_fileEntriesFCB[ i ];
+        if ( 0 == entry.fp || fpWriter == entry.fp || _stricmp( path, entry.path ) )
+            continue;
+
+        fflush( fpWriter );
+        entry.bufLength = 0;
+        entry.hostOffset = (uint32_t) -1; // seek before the next read so stdio drops what it buffered
+        entry.fileSize = (uint32_t) portable_filelen( entry.fp );
+        tracer.Trace( "  file '%s' changed; FCB read-ahead dropped and size is now %u\n", path, entry.fileSize );
+    }
+} //InvalidateFCBCaches
+
+static void FlushHandleWrites( const char * path )
+{
+    // an FCB opened on a file that's also open by handle must see what was written through the handle
+
+    for ( size_t i = 0; i < g_fileEntries.size(); i++ )
+        if ( 0 != g_fileEntries[ i ].fp && !_stricmp( path, g_fileEntries[ i ].path ) )
+            fflush( g_fileEntries[ i ].fp );
+} //FlushHandleWrites
+
+static uint32_t FCBWrite( FCBFileEntry & entry, uint32_t offset, const uint8_t * p, uint32_t len )
+{
+    if ( 0 != entry.bufLength && offset < ( entry.bufOffset + entry.bufLength ) && ( offset + len ) > entry.bufOffset )
+        entry.bufLength = 0;
+
+    if ( !FCBSeek( entry, offset, FCBOpWrite ) )
+        return 0;
+
+    uint32_t num_written = (uint32_t) fwrite( p, 1, len, entry.fp );
+    entry.hostOffset += num_written;
+    if ( ( offset + num_written ) > entry.fileSize )
+        entry.fileSize = offset + num_written;
+
+    InvalidateFCBCaches( entry.path, entry.fp );
+    return num_written;
+} //FCBWrite
+
 void ClearLastUpdateBuffer()
 {
     memset( g_bufferLastUpdate, 0, sizeof( g_bufferLastUpdate ) );
+    g_videoDirty = ( 1u << VideoTrackedPages ) - 1;
+    g_redrawGeneration++;
+    if ( !g_renderThreadActive )
+        g_terminalAttribute = -1; // the terminal may have been reset too. the render thread resets it for snapshots
 } //ClearLastUpdateBuffer
 
 void traceDisplayBuffers()
@@ -1937,175 +2562,485 @@ static const wchar_t CP437_to_Unicode[ 256 ] =
     0x2261, 0x00b1, 0x2265, 0x2264, 0x2320, 0x2321, 0x00f7, 0x2248, 0x00b0, 0x2219, 0x00b7, 0x221a, 0x207f, 0x00b2, 0x25a0, 0x00a0, // 240
 };
 
-// The Linux/MacOS code that uses ANSI escape sequences and utf-8 mostly works for Windows,
-// but CP 437 characters 7 through 15 and 17 are translated badly by Windows Terminal.
-// It's a shame, but two implementations are necessary to get all of CP 437 on Windows.
-
-#ifdef _WIN32
-
-void UpdateDisplayRow( uint32_t y )
+int unicode_to_utf8( char * p, unsigned short u )
 {
-    assert( g_use80xRowsMode );
-    if ( y >= GetScreenRows() )
-        return;
-
-    uint8_t * pbuf = GetVideoMem( GetActiveDisplayPage() );
-    uint32_t yoffset = y * ScreenColumns * 2;
-    memcpy( g_bufferLastUpdate + yoffset, pbuf + yoffset, ScreenColumns * 2 );
-    WORD aAttribs[ ScreenColumns ];
-    WCHAR awcLine[ ScreenColumns ];
+    if ( u <= 0x7f )
+    {
+        p[ 0 ] = (char) u;
+        return 1;
+    }
 
-    for ( size_t x = 0; x < ScreenColumns; x++ )
+    if ( u <= 0x7ff )
     {
-        size_t offset = yoffset + x * 2;
-        awcLine[ x ] = CP437_to_Unicode[ pbuf[ offset ] ];
-        aAttribs[ x ] = pbuf[ 1 + offset ];
+        p[0] = (char) ( 0xc0 | ( ( u >> 6 ) & 0x1f ) );
+        p[1] = (char) ( 0x80 | ( u & 0x3f ) );
+        return 2;
     }
 
-    COORD pos = { 0, (SHORT) y };
-    SetConsoleCursorPosition( g_hConsoleOutput, pos );
+    p[0] = (char) ( 0xe0 | ( ( u >> 12 ) & 0xf ) );
+    p[1] = (char) ( 0x80 | ( ( u >> 6 ) & 0x3f ) );
+    p[2] = (char) ( 0x80 | ( u & 0x30 ) | ( u & 0xf ) );
+    return 3;
+} //unicode_to_utf8
 
-    BOOL ok = WriteConsoleW( g_hConsoleOutput, awcLine, ScreenColumns, 0, 0 );
-    if ( !ok )
-        tracer.Trace( "writeconsole failed row %u with error %d\n", y, GetLastError() );
+void DecodeAttributes( uint8_t a, uint8_t & fg, uint8_t & bg, bool & intense )
+{
+    fg = ( a & 7 );
+    bg = ( ( a >> 4 ) & 7 );
+    intense = ( 0 != ( a & 8 ) );
+} //DecodeAttributes
+
+// These tables (roughly) map DOS foreground and background colors to ANSI escape sequence colors.
+
+static const uint8_t FGColorMap[ 8 ] =
+{
+    30, 34, 32, 36, 31, 35, 33, 37,
+};
+
+static const uint8_t BGColorMap[ 8 ] =
+{
+    40, 44, 42, 46, 41, 45, 43, 47,
+};
+
+// The Linux/MacOS code that uses ANSI escape sequences and utf-8 mostly works for Windows,
+// but CP 437 characters 7 through 15 and 17 are translated badly by Windows Terminal.
+// It's a shame, but two implementations are necessary to get all of CP 437 on Windows.
+
+#ifdef _WIN32
+
+void RenderDisplayRow( uint32_t y, const uint8_t * prow, uint8_t * plast )
+{
+    memcpy( plast, prow, ScreenColumns * 2 );
+    WORD aAttribs[ ScreenColumns ];
+    WCHAR awcLine[ ScreenColumns ];
+
+    for ( size_t x = 0; x < ScreenColumns; x++ )
+    {
+        size_t offset = x * 2;
+        awcLine[ x ] = CP437_to_Unicode[ prow[ offset ] ];
+        aAttribs[ x ] = prow[ 1 + offset ];
+    }
+
+    COORD pos = { 0, (SHORT) y };
+    SetConsoleCursorPosition( g_hConsoleOutput, pos );
+
+    BOOL ok = WriteConsoleW( g_hConsoleOutput, awcLine, ScreenColumns, 0, 0 );
+    if ( !ok )
+        tracer.Trace( "writeconsole failed row %u with error %d\n", y, GetLastError() );
 
     DWORD dwWritten; // not optional
     ok = WriteConsoleOutputAttribute( g_hConsoleOutput, aAttribs, ScreenColumns, pos, &dwWritten );
     if ( !ok )
         tracer.Trace( "writeconsoleoutputattribute failed row %u with error %d\n", y, GetLastError() );
-
-    UpdateScreenCursorPosition(); // restore original position of the cursor
-} //UpdateDisplayRow
+} //RenderDisplayRow
 
 #else // everything but Windows
 
-int unicode_to_utf8( char * p, unsigned short u )
+// The terminal is updated at cell granularity. Only spans of cells that differ from what was last drawn are
+// written, preceded by a cursor move, and color escape sequences are only sent when the attribute differs
+// from what the terminal is already using. Output goes to the stdout buffer and is written once per frame
+// when UpdateScreenCursorPosition() flushes.
+
+const size_t MaxCellGap = 4;                         // rewrite up to this many unchanged cells rather than move the cursor
+
+static wchar_t CellCharacter( uint8_t c )
 {
-    if ( u <= 0x7f )
+#if defined( __riscv ) || defined( _WIN32 ) || defined( __aarch64__ ) || defined( __amd64 )
+    // When NTVDM built for RISC-V runs in RVOS/ARMOS/X64OS emulation on Windows, CP 437
+    // characters 7 through 13 are interpreted by Windows Terminal as control
+    // characters, not actual chacters. This is after they are converted to
+    // UTF-8 and sent via write() to stdout. I can't find a way to configure
+    // Windows Terminal to not do this. As a workaround, map those characters
+    // to smiley faces, which is how I feel about this hack.
+    // This is also why WriteConsoleW is used instead of ansi escape sequences
+    // on Windows builds.
+
+    if ( g_InEmulator && c >= 7 && c <= 0x1f )
+        return CP437_to_Unicode_Windows_Hack[ c ];
+#endif
+
+    return CP437_to_Unicode[ c ];
+} //CellCharacter
+
+void RenderDisplayRow( uint32_t y, const uint8_t * prow, uint8_t * plastRow )
+{
+    // draw row y of prow, given that the terminal shows plastRow, then update plastRow
+
+    const uint16_t * pcells = (const uint16_t *) prow;
+    uint16_t * plast = (uint16_t *) plastRow;
+
+    // worst case per cell: a 10-byte cursor move, an 11-byte color sequence, and 3 bytes of utf-8
+
+    static char acLine[ ScreenColumns * 24 ];
+    int len = 0;
+    size_t x = 0;
+
+    while ( x < ScreenColumns )
     {
-        p[ 0 ] = (char) u;
-        return 1;
+        if ( pcells[ x ] == plast[ x ] )
+        {
+            x++;
+            continue;
+        }
+
+        // extend the span through short runs of unchanged cells
+
+        size_t lastChanged = x;
+        for ( size_t next = x + 1; ( next < ScreenColumns ) && ( ( next - lastChanged ) <= MaxCellGap ); next++ )
+            if ( pcells[ next ] != plast[ next ] )
+                lastChanged = next;
+
+        len += snprintf( & acLine[ len ], 11, "\x1b[%u;%zuH", y + 1, x + 1 ); // vt-100 row/col are 1-based
+
+        for ( ; x <= lastChanged; x++ )
+        {
+            const uint8_t * pcell = (const uint8_t *) ( pcells + x );
+            uint8_t attribute = pcell[ 1 ] & 0x7f; // DecodeAttributes ignores the blink bit
+            if ( attribute != g_terminalAttribute )
+            {
+                uint8_t fgRGB, bgRGB;
+                bool intense;
+                DecodeAttributes( attribute, fgRGB, bgRGB, intense );
+                len += snprintf( & acLine[ len ], 12, "\x1b[%d;%d;%dm", intense ? 1 : 0, FGColorMap[ fgRGB ], BGColorMap[ bgRGB ] );
+                g_terminalAttribute = attribute;
+            }
+
+            len += unicode_to_utf8( & ( acLine[ len ] ), CellCharacter( pcell[ 0 ] ) );
+            assert( len < _countof( acLine ) );
+        }
     }
 
-    if ( u <= 0x7ff )
+    memcpy( plast, pcells, ScreenColumns * 2 );
+
+    //tracer.Trace( "termwrite '%.*s'\n", len, acLine );
+    if ( 0 != len )
     {
-        p[0] = (char) ( 0xc0 | ( ( u >> 6 ) & 0x1f ) );
-        p[1] = (char) ( 0x80 | ( u & 0x3f ) );
-        return 2;
+        fwrite( acLine, 1, len, stdout );
+        RecordTerminalOutput( acLine, len );
     }
+} //RenderDisplayRow
 
-    p[0] = (char) ( 0xe0 | ( ( u >> 12 ) & 0xf ) );
-    p[1] = (char) ( 0x80 | ( ( u >> 6 ) & 0x3f ) );
-    p[2] = (char) ( 0x80 | ( u & 0x30 ) | ( u & 0xf ) );
-    return 3;
-} //unicode_to_utf8
+#endif
 
-void DecodeAttributes( uint8_t a, uint8_t & fg, uint8_t & bg, bool & intense )
-{
-    fg = ( a & 7 );
-    bg = ( ( a >> 4 ) & 7 );
-    intense = ( 0 != ( a & 8 ) );
-} //DecodeAttributes
+#if USE_RENDER_THREAD
 
-// These tables (roughly) map DOS foreground and background colors to ANSI escape sequence colors.
+// With a render thread the emulator never writes to the terminal in 80x25 mode. It publishes snapshots of the
+// active text page and cursor, and the render thread draws the latest one at most g_framesPerSecond times a
+// second. Snapshots are triple buffered so neither side waits: the emulator fills its back buffer then swaps it
+// with the in-between buffer, and the render thread swaps its front buffer with the in-between one when it's fresh.
+// The render thread sleeps until a snapshot is published, so it never wakes in tty mode or while the display is idle.
 
-static const uint8_t FGColorMap[ 8 ] =
+struct DisplaySnapshot
 {
-    30, 34, 32, 36, 31, 35, 33, 37,
+    uint8_t cells[ 80 * 50 * 2 ];
+    uint8_t rows;
+    uint8_t cursorRow;
+    uint8_t cursorCol;
+    uint32_t redrawGeneration;
 };
 
-static const uint8_t BGColorMap[ 8 ] =
+const uint32_t SnapshotFresh = 4;                    // set in g_snapshotLatest when the emulator has published
+static DisplaySnapshot g_snapshots[ 3 ];
+static std::atomic<uint32_t> g_snapshotLatest( 1 );  // the in-between snapshot, perhaps with SnapshotFresh
+static uint32_t g_snapshotBack = 0;                  // the snapshot the emulator fills
+static uint32_t g_snapshotFront = 2;                 // the snapshot the render thread draws
+static CSimpleThread * g_renderThread = 0;           // signaled when a snapshot is published
+
+void PublishDisplaySnapshot()
 {
-    40, 44, 42, 46, 41, 45, 43, 47,
-};
+    DisplaySnapshot & snap = g_snapshots[ g_snapshotBack ];
+    uint32_t bytes = ScreenColumns * GetScreenRows() * 2;
+    memcpy( g_bufferLastUpdate, GetVideoMem( GetActiveDisplayPage() ), bytes );
+    memcpy( snap.cells, g_bufferLastUpdate, bytes );
+    snap.rows = GetScreenRows();
+    GetCursorPosition( snap.cursorRow, snap.cursorCol, GetActiveDisplayPage() );
+    snap.redrawGeneration = g_redrawGeneration;
+    uint32_t prior = g_snapshotLatest.exchange( g_snapshotBack | SnapshotFresh );
+    g_snapshotBack = prior & ~SnapshotFresh;
 
-void UpdateDisplayRow( uint32_t y )
+    // if the prior snapshot was drawn the render thread may be waiting for this one. otherwise it'll see it soon
+
+    if ( ( 0 == ( prior & SnapshotFresh ) ) && g_renderThread )
+    {
+        C_pthread_mutex_t_lock mtx_lock( g_renderThread->the_mutex );
+        pthread_cond_signal( & g_renderThread->end_condition );
+    }
+} //PublishDisplaySnapshot
+
+static void RenderLatestSnapshot()
 {
-    assert( g_use80xRowsMode );
-    if ( y >= GetScreenRows() )
+    if ( 0 == ( g_snapshotLatest.load() & SnapshotFresh ) )
         return;
 
-    uint8_t * pbuf = GetVideoMem( GetActiveDisplayPage() );
-    uint32_t yoffset = y * ScreenColumns * 2;
+    g_snapshotFront = g_snapshotLatest.exchange( g_snapshotFront ) & ~SnapshotFresh;
+    const DisplaySnapshot & snap = g_snapshots[ g_snapshotFront ];
 
-    memcpy( g_bufferLastUpdate + yoffset, pbuf + yoffset, ScreenColumns * 2 );
-    uint8_t attribs[ ScreenColumns ];
-    wchar_t awc[ ScreenColumns ];
+    static uint8_t lastRendered[ 80 * 50 * 2 ];      // what the terminal shows
+    static uint32_t renderedGeneration = 0;
+    if ( snap.redrawGeneration != renderedGeneration )
+    {
+        memset( lastRendered, 0, sizeof( lastRendered ) );
+        g_terminalAttribute = -1;
+        renderedGeneration = snap.redrawGeneration;
+    }
 
-    for ( size_t x = 0; x < ScreenColumns; x++ )
+    flockfile( stdout ); // keep other output from landing in the middle of the frame
+    for ( uint32_t y = 0; y < snap.rows; y++ )
     {
-        size_t offset = yoffset + x * 2;
-        awc[ x ] = CP437_to_Unicode[ pbuf[ offset ] ];
-        attribs[ x ] = pbuf[ 1 + offset ];
+        uint32_t yoffset = y * ScreenColumns * 2;
+        if ( memcmp( lastRendered + yoffset, snap.cells + yoffset, ScreenColumns * 2 ) )
+            RenderDisplayRow( y, snap.cells + yoffset, lastRendered + yoffset );
+    }
 
-#if defined( __riscv ) || defined( _WIN32 ) || defined( __aarch64__ ) || defined( __amd64 )
-        // When NTVDM built for RISC-V runs in RVOS/ARMOS/X64OS emulation on Windows, CP 437
-        // characters 7 through 13 are interpreted by Windows Terminal as control
-        // characters, not actual chacters. This is after they are converted to
-        // UTF-8 and sent via write() to stdout. I can't find a way to configure
-        // Windows Terminal to not do this. As a workaround, map those characters
-        // to smiley faces, which is how I feel about this hack.
-        // This is also why WriteConsoleW is used instead of ansi escape sequences
-        // on Windows builds.
+    SendCursorPosition( snap.cursorRow, snap.cursorCol );
+    funlockfile( stdout );
+} //RenderLatestSnapshot
+
+void * RenderThreadProc( void * param )
+{
+    tracer.Trace( "renderthreadproc: started threadproc, %u frames per second\n", g_framesPerSecond );
+    CSimpleThread & thread = * (CSimpleThread *) param;
+    long frameNS = 1000000000 / g_framesPerSecond;
 
-        if ( g_InEmulator )
+    do
+    {
         {
-            if ( pbuf[ offset ] >= 7 && pbuf[ offset ] <= 0x1f )
-                awc[ x ] = CP437_to_Unicode_Windows_Hack[ pbuf[ offset ] ];
+            C_pthread_mutex_t_lock mtx_lock( thread.the_mutex );
+            while ( !thread.stop_running && ( 0 == ( g_snapshotLatest.load() & SnapshotFresh ) ) )
+                pthread_cond_wait( & thread.end_condition, & thread.the_mutex );
         }
-#endif
-    }
 
-    printf( "\x1b[%d;1H", y + 1 ); // move to the correct row and column
+        RenderLatestSnapshot(); // after being told to stop too, so the final display is drawn
 
-    uint8_t fgRGB, bgRGB;
-    bool intense;
-    static char acLine[ ScreenColumns * 13 ]; // 3 for utf-8 + 10 per attribute escape sequence worst-case per character
-    int len = 0;
+        // wait out the rest of the frame. publishing signals the condition too, so wait until the time is up
 
-    for ( size_t x = 0; x < ScreenColumns; x++ )
+        struct timespec to;
+
+        #if 1 // this is required to build using g++ 11 on old systems like Mac OS X 10.7.5
+            struct timeval tv;
+            gettimeofday( &tv, 0 );
+            to.tv_sec = tv.tv_sec;
+            to.tv_nsec = tv.tv_usec * 1000;
+        #else
+            clock_gettime( CLOCK_REALTIME, &to );
+        #endif
+
+        to.tv_nsec += frameNS;
+        if ( to.tv_nsec >= 1000000000 ) // overflow
+        {
+            to.tv_sec += 1;
+            to.tv_nsec -= 1000000000;
+        }
+
+        {
+            C_pthread_mutex_t_lock mtx_lock( thread.the_mutex );
+            while ( !thread.stop_running && ( ETIMEDOUT != pthread_cond_timedwait( & thread.end_condition, & thread.the_mutex, & to ) ) )
+                continue;
+        }
+    } while ( !thread.stop_running );
+
+    RenderLatestSnapshot(); // anything published during the last frame
+
+    tracer.Trace( "renderthreadproc: falling out of threadproc\n" );
+    return 0;
+} //RenderThreadProc
+
+
+// -record writes terminal output as an asciicast v2 file, which asciinema and other players can replay.
+// Output is collected into events under a lock and a background thread writes them, so recording costs
+// the emulator and render threads a copy. Output less than RecordEventGap apart is combined into one event.
+
+const double RecordEventGap = 0.005;                 // seconds
+static pthread_mutex_t g_recordMutex = PTHREAD_MUTEX_INITIALIZER;
+static high_resolution_clock::time_point g_recordStart;
+static string g_recordPending;                       // output not yet in an event
+static double g_recordPendingTime = 0.0;             // seconds from the start of the recording to g_recordPending
+static string g_recordEvents;                        // event lines not yet written to g_recordFile
+static bool g_recordThreadRunning = false;           // if false, events are written by whoever records output
+
+bool StartRecording( const char * path, uint8_t rows )
+{
+    g_recordFile = fopen( path, "w" );
+    if ( !g_recordFile )
+        return false;
+
+    g_recordStart = high_resolution_clock::now();
+    fprintf( g_recordFile, "{\"version\": 2, \"width\": %u, \"height\": %u, \"timestamp\": %llu, \"env\": {\"TERM\": \"xterm-256color\"}}\n",
+             ScreenColumns, rows, (unsigned long long) time( 0 ) );
+    return true;
+} //StartRecording
+
+static void AppendRecordEvent()
+{
+    // called with g_recordMutex held
+
+    char ac[ 40 ];
+    snprintf( ac, sizeof( ac ), "[%.6f, \"o\", \"", g_recordPendingTime );
+    g_recordEvents += ac;
+
+    for ( size_t i = 0; i < g_recordPending.size(); i++ )
     {
-        if ( ( 0 == x ) || ( attribs[ x ] != attribs[ x - 1 ] ) )
+        char c = g_recordPending[ i ];
+        if ( '"' == c || '\\' == c )
+        {
+            g_recordEvents += '\\';
+            g_recordEvents += c;
+        }
+        else if ( (uint8_t) c < 0x20 )
         {
-            DecodeAttributes( attribs[ x ], fgRGB, bgRGB, intense );
-            len += snprintf( & acLine[ len ], 11, "\x1b[%d;%d;%dm", intense ? 1 : 0, FGColorMap[ fgRGB ], BGColorMap[ bgRGB ] );
+            snprintf( ac, sizeof( ac ), "\\u%04x", (uint8_t) c );
+            g_recordEvents += ac;
         }
+        else
+            g_recordEvents += c;
+    }
+
+    g_recordEvents += "\"]\n";
+    g_recordPending.clear();
+} //AppendRecordEvent
+
+static void WriteRecordEvents( bool final )
+{
+    string events;
 
-        len += unicode_to_utf8( & ( acLine[ len ] ), awc[ x ] );
-        assert( len < _countof( acLine ) );
+    {
+        C_pthread_mutex_t_lock lock( g_recordMutex );
+        double now = duration_cast<std::chrono::microseconds>( high_resolution_clock::now() - g_recordStart ).count() / 1000000.0;
+        if ( !g_recordPending.empty() && ( final || ( ( now - g_recordPendingTime ) >= RecordEventGap ) ) )
+            AppendRecordEvent();
+        events.swap( g_recordEvents );
     }
 
-    //tracer.Trace( "termwrite '%.*s'\n", len, acLine );
-    printf( "%.*s", len, acLine );  // write( 1, acLine, len ) is faster but can't intersperse write() and printf() without flushing.
+    if ( !events.empty() )
+        fwrite( events.data(), 1, events.size(), g_recordFile );
+} //WriteRecordEvents
 
-    UpdateScreenCursorPosition(); // this does a fflush( stdout ) to get everything to the screen
-} //UpdateDisplayRow
+void RecordTerminalOutput( const char * p, size_t len )
+{
+    if ( !g_recordFile )
+        return;
+
+    size_t eventBytes;
+
+    {
+        C_pthread_mutex_t_lock lock( g_recordMutex );
+        double now = duration_cast<std::chrono::microseconds>( high_resolution_clock::now() - g_recordStart ).count() / 1000000.0;
+        if ( !g_recordPending.empty() && ( ( now - g_recordPendingTime ) >= RecordEventGap ) )
+            AppendRecordEvent();
+        if ( g_recordPending.empty() )
+            g_recordPendingTime = now;
+        g_recordPending.append( p, len );
+        eventBytes = g_recordEvents.size();
+    }
+
+    if ( !g_recordThreadRunning && ( eventBytes >= 64 * 1024 ) )
+        WriteRecordEvents( false );
+} //RecordTerminalOutput
+
+void * RecordThreadProc( void * param )
+{
+    CSimpleThread & thread = * (CSimpleThread *) param;
+
+    do
+    {
+        struct timespec to;
+
+        #if 1 // this is required to build using g++ 11 on old systems like Mac OS X 10.7.5
+            struct timeval tv;
+            gettimeofday( &tv, 0 );
+            to.tv_sec = tv.tv_sec;
+            to.tv_nsec = tv.tv_usec * 1000;
+        #else
+            clock_gettime( CLOCK_REALTIME, &to );
+        #endif
+
+        to.tv_nsec += ( 100 * 1000000 ); // 100 milliseconds
+        if ( to.tv_nsec >= 1000000000 ) // overflow
+        {
+            to.tv_sec += 1;
+            to.tv_nsec -= 1000000000;
+        }
+
+        {
+            C_pthread_mutex_t_lock mtx_lock( thread.the_mutex );
+            pthread_cond_timedwait( & thread.end_condition, & thread.the_mutex, & to );
+        }
+
+        WriteRecordEvents( false );
+    } while ( !thread.stop_running );
+
+    return 0;
+} //RecordThreadProc
+
+void StopRecording()
+{
+    WriteRecordEvents( true );
+    fclose( g_recordFile );
+    g_recordFile = 0;
+} //StopRecording
+
+#else
+
+void PublishDisplaySnapshot() {}
+void RecordTerminalOutput( const char * p, size_t len ) {}
 
 #endif
 
+void UpdateDisplayRow( uint32_t y )
+{
+    assert( g_use80xRowsMode );
+    if ( g_headless || ( y >= GetScreenRows() ) )
+        return;
+
+    if ( !g_renderThreadActive )
+    {
+        uint32_t yoffset = y * ScreenColumns * 2;
+        RenderDisplayRow( y, GetVideoMem( GetActiveDisplayPage() ) + yoffset, g_bufferLastUpdate + yoffset );
+    }
+
+    UpdateScreenCursorPosition(); // flush the row and restore the cursor position, or publish a snapshot
+} //UpdateDisplayRow
+
 bool UpdateDisplay()
 {
     assert( g_use80xRowsMode );
+    if ( g_headless )
+        return false;
+
+    if ( 0 == g_videoTracking )
+        EnableVideoWriteTracking();
+
     uint8_t * pbuf = GetVideoMem( GetActiveDisplayPage() );
+    uint32_t first, last;
+    if ( !VideoPagesDirty( GetActiveDisplayPage(), first, last ) )
+        return false;
 
-    if ( DisplayUpdateRequired() )
+    if ( 1 == g_videoTracking )
+        ProtectVideoPages( first, last ); // the next write to these pages marks them dirty again
+
+    bool updated = false;
+    for ( uint32_t y = 0; y < GetScreenRows(); y++ )
     {
-        for ( uint32_t y = 0; y < GetScreenRows(); y++ )
+        uint32_t yoffset = y * ScreenColumns * 2;
+        if ( memcmp( g_bufferLastUpdate + yoffset, pbuf + yoffset, ScreenColumns * 2 ) )
         {
-            uint32_t yoffset = y * ScreenColumns * 2;
-            if ( memcmp( g_bufferLastUpdate + yoffset, pbuf + yoffset, ScreenColumns * 2 ) )
-                UpdateDisplayRow( y );
+            updated = true;
+            if ( g_renderThreadActive )
+                break; // the snapshot has every row
+
+            RenderDisplayRow( y, pbuf + yoffset, g_bufferLastUpdate + yoffset );
         }
+    }
+
+    if ( updated )
+        UpdateScreenCursorPosition(); // one flush for the whole frame, or publish a snapshot
 
 #if 0
-        if ( tracer.IsEnabled() )
-            traceDisplayBufferAsHex();
+    if ( updated && tracer.IsEnabled() )
+        traceDisplayBufferAsHex();
 #endif
 
-        return true;
-    }
-
-    return false;
+    return updated;
 } //UpdateDisplay
 
 bool throttled_UpdateDisplay( int64_t delay = 50 )
@@ -2118,53 +3053,310 @@ bool throttled_UpdateDisplay( int64_t delay = 50 )
     return false;
 } //throttled_UpdateDisplay
 
-void ClearDisplay()
+// CGA graphics modes 4 and 5 (320x200, 4 colors) and 6 (640x200, 2 colors) use 16k at b800:0000. Even scanlines
+// are in the first 8k and odd scanlines in the second. A terminal can't show pixels, so in these modes text output
+// goes to the terminal as in tty mode, -frames logs the pixels that change, and -headless captures the final frame.
+// Changed scanlines are found with the text page write tracking, so scanlines in pages not written aren't compared.
+// Frame log: "ntvdmfrm", then for each frame a little-endian uint32 milliseconds since start, uint8 mode, uint8 color
+// select, uint16 span count, and spans of uint16 y, uint16 x, uint16 pixel count, and a byte per pixel value.
+
+const uint32_t CgaHeight = 200;
+const uint32_t CgaBytesPerLine = 80;
+const uint32_t CgaOddLineOffset = 0x2000;
+static uint8_t g_cgaLastFrame[ VideoTrackedPages * VideoPageBytes ]; // the framebuffer as of the last logged frame
+static bool g_cgaFrameLogged = false;                // false until a frame is logged after a mode change
+static uint8_t g_cgaLastColorSelect = 0;             // g_cgaColorSelect as of the last logged frame
+static high_resolution_clock::time_point g_framesStart;
+
+static const uint8_t CgaRGB[ 16 ][ 3 ] =
+{
+    { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0xaa }, { 0x00, 0xaa, 0x00 }, { 0x00, 0xaa, 0xaa },
+    { 0xaa, 0x00, 0x00 }, { 0xaa, 0x00, 0xaa }, { 0xaa, 0x55, 0x00 }, { 0xaa, 0xaa, 0xaa },
+    { 0x55, 0x55, 0x55 }, { 0x55, 0x55, 0xff }, { 0x55, 0xff, 0x55 }, { 0x55, 0xff, 0xff },
+    { 0xff, 0x55, 0x55 }, { 0xff, 0x55, 0xff }, { 0xff, 0xff, 0x55 }, { 0xff, 0xff, 0xff },
+};
+
+bool IsGraphicsMode( uint8_t mode )
 {
-    assert( g_use80xRowsMode );
-    uint8_t * pbuf = GetVideoMem( GetActiveDisplayPage() );
-    init_blankline( DefaultVideoAttribute );
+    return ( mode >= 4 && mode <= 6 );
+} //IsGraphicsMode
 
-    for ( size_t y = 0; y < GetScreenRows(); y++ )
-        memcpy( pbuf + ( y * 2 * ScreenColumns ), blankLine, sizeof( blankLine ) );
-} //ClearDisplay
+bool IsGraphicsMode()
+{
+    return IsGraphicsMode( GetVideoMode() );
+} //IsGraphicsMode
 
-#ifdef _WIN32
-    BOOL WINAPI ControlHandlerProc( DWORD fdwCtrlType )
+uint32_t CgaWidth()
+{
+    return ( 6 == GetVideoMode() ) ? 640 : 320;
+} //CgaWidth
+
+uint8_t * CgaScanline( uint32_t y )
+{
+    return memory + ScreenBufferSegment * 16 + ( y & 1 ) * CgaOddLineOffset + ( y >> 1 ) * CgaBytesPerLine;
+} //CgaScanline
+
+uint8_t CgaPixel( const uint8_t * pline, uint32_t x )
+{
+    if ( 6 == GetVideoMode() )
+        return ( pline[ x / 8 ] >> ( 7 - ( x & 7 ) ) ) & 1;
+
+    return ( pline[ x / 4 ] >> ( 6 - 2 * ( x & 3 ) ) ) & 3;
+} //CgaPixel
+
+void SetCgaPixel( uint8_t * pline, uint32_t x, uint8_t val, bool xorPixel )
+{
+    uint8_t mask, shift;
+    if ( 6 == GetVideoMode() )
     {
-        // this happens in a third thread, which is implicitly created
+        shift = 7 - ( x & 7 );
+        mask = 1;
+        pline += x / 8;
+    }
+    else
+    {
+        shift = 6 - 2 * ( x & 3 );
+        mask = 3;
+        pline += x / 4;
+    }
 
-        if ( CTRL_C_EVENT == fdwCtrlType )
-        {
-            tracer.Trace( "ControlHandlerProc is incrementing the ^c count\n ");
-            InterlockedIncrement( &g_injectedControlC );
-            g_SendControlCInt = true;
-            return TRUE;
-        }
+    val = ( val & mask ) << shift;
+    if ( xorPixel )
+        *pline ^= val;
+    else
+        *pline = ( *pline & ~( mask << shift ) ) | val;
+} //SetCgaPixel
 
-        return FALSE;
-    } //ControlHandlerProc
-#else
-    void ControlHandlerProc( int signal ) {}
-#endif
+uint8_t CgaColor( uint8_t pixel )
+{
+    // map a pixel value to one of the 16 CGA colors using the color select register
 
-struct IntInfo
+    if ( 6 == GetVideoMode() )
+        return pixel ? ( g_cgaColorSelect & 0xf ) : 0;
+
+    if ( 0 == pixel )
+        return g_cgaColorSelect & 0xf; // background
+
+    static const uint8_t palettes[ 3 ][ 3 ] = { { 2, 4, 6 }, { 3, 5, 7 }, { 3, 4, 7 } }; // mode 5 is the third
+    uint8_t palette = ( 5 == GetVideoMode() ) ? 2 : ( ( g_cgaColorSelect >> 5 ) & 1 );
+    return palettes[ palette ][ pixel - 1 ] | ( ( g_cgaColorSelect & 0x10 ) ? 8 : 0 );
+} //CgaColor
+
+bool StartFrameLog( const char * path )
 {
-    uint8_t i;  // interrupt #
-    uint8_t c;  // ah command
-    const char * name;
-};
+    g_framesFile = fopen( path, "wb" );
+    if ( !g_framesFile )
+        return false;
 
-const IntInfo interrupt_list_no_ah[] =
+    g_framesStart = high_resolution_clock::now();
+    fwrite( "ntvdmfrm", 1, 8, g_framesFile );
+    return true;
+} //StartFrameLog
+
+static void AppendLE16( vector<uint8_t> & v, uint32_t x )
 {
-   { 0x00, 0, "divide by zero" },
-   { 0x01, 0, "trap / single-step" },
-   { 0x02, 0, "non-maskable interrupt" },
-   { 0x03, 0, "int3 / debug break" },
-   { 0x04, 0, "overflow" },
-   { 0x05, 0, "print-screen key" },
-   { 0x06, 0, "undefined opcode" },
-   { 0x08, 0, "hardware timer interrupt" },
-   { 0x09, 0, "keyboard interrupt" },
+    v.push_back( (uint8_t) x );
+    v.push_back( (uint8_t) ( x >> 8 ) );
+} //AppendLE16
+
+void LogGraphicsFrame()
+{
+    if ( !g_framesFile || !IsGraphicsMode() )
+        return;
+
+    if ( 0 == g_videoTracking )
+        EnableVideoWriteTracking();
+
+    uint32_t dirty = ( 1 == g_videoTracking ) ? g_videoDirty : ( ( 1u << VideoTrackedPages ) - 1 );
+    if ( g_cgaFrameLogged && ( 0 == dirty ) && ( g_cgaLastColorSelect == g_cgaColorSelect ) )
+        return;
+
+    if ( 1 == g_videoTracking )
+        ProtectVideoPages( 0, VideoTrackedPages - 1 ); // the next write marks pages dirty again
+
+    static vector<uint8_t> frame;
+    frame.resize( 8 );
+    uint32_t pixelsPerByte = CgaWidth() / CgaBytesPerLine;
+    uint32_t spans = 0;
+
+    for ( uint32_t y = 0; y < CgaHeight; y++ )
+    {
+        uint32_t offset = ( y & 1 ) * CgaOddLineOffset + ( y >> 1 ) * CgaBytesPerLine;
+        uint32_t pages = ( 1u << ( offset / VideoPageBytes ) ) | ( 1u << ( ( offset + CgaBytesPerLine - 1 ) / VideoPageBytes ) );
+        if ( g_cgaFrameLogged && ( 0 == ( dirty & pages ) ) )
+            continue;
+
+        const uint8_t * pline = CgaScanline( y );
+        uint8_t * plast = g_cgaLastFrame + offset;
+        uint32_t first = 0, last = CgaBytesPerLine;
+        if ( g_cgaFrameLogged )
+        {
+            while ( ( first < CgaBytesPerLine ) && ( pline[ first ] == plast[ first ] ) )
+                first++;
+            if ( CgaBytesPerLine == first )
+                continue;
+            while ( pline[ last - 1 ] == plast[ last - 1 ] )
+                last--;
+        }
+
+        memcpy( plast + first, pline + first, last - first );
+        AppendLE16( frame, y );
+        AppendLE16( frame, first * pixelsPerByte );
+        AppendLE16( frame, ( last - first ) * pixelsPerByte );
+        for ( uint32_t x = first * pixelsPerByte; x < last * pixelsPerByte; x++ )
+            frame.push_back( CgaPixel( pline, x ) );
+        spans++;
+    }
+
+    if ( 0 == spans && g_cgaFrameLogged && ( g_cgaLastColorSelect == g_cgaColorSelect ) )
+        return;
+
+    uint32_t ms = (uint32_t) duration_cast<std::chrono::milliseconds>( high_resolution_clock::now() - g_framesStart ).count();
+    for ( uint32_t i = 0; i < 4; i++ )
+        frame[ i ] = (uint8_t) ( ms >> ( 8 * i ) );
+    frame[ 4 ] = GetVideoMode();
+    frame[ 5 ] = g_cgaColorSelect;
+    frame[ 6 ] = (uint8_t) spans;
+    frame[ 7 ] = (uint8_t) ( spans >> 8 );
+    fwrite( frame.data(), 1, frame.size(), g_framesFile );
+    tracer.Trace( "  logged a graphics frame with %u changed spans, %zu bytes\n", spans, frame.size() );
+
+    g_cgaFrameLogged = true;
+    g_cgaLastColorSelect = g_cgaColorSelect;
+} //LogGraphicsFrame
+
+void throttled_LogGraphicsFrame()
+{
+    static CDuration _duration;
+    if ( _duration.HasTimeElapsedMS( 1000 / g_framesPerSecond ) )
+        LogGraphicsFrame();
+} //throttled_LogGraphicsFrame
+
+bool WriteGraphicsCapture( const char * path )
+{
+    // -headless in a graphics mode: write the frame as a binary PPM
+
+    FILE * fp = fopen( path, "wb" );
+    if ( !fp )
+        return false;
+
+    uint32_t width = CgaWidth();
+    fprintf( fp, "P6\n%u %u\n255\n", width, CgaHeight );
+    vector<uint8_t> row( width * 3 );
+    for ( uint32_t y = 0; y < CgaHeight; y++ )
+    {
+        const uint8_t * pline = CgaScanline( y );
+        for ( uint32_t x = 0; x < width; x++ )
+            memcpy( row.data() + x * 3, CgaRGB[ CgaColor( CgaPixel( pline, x ) ) ], 3 );
+        fwrite( row.data(), 1, row.size(), fp );
+    }
+
+    fclose( fp );
+    return true;
+} //WriteGraphicsCapture
+
+bool WriteScreenCapture( const char * path, bool ansi )
+{
+    // -headless: write the active text page as plain text, or as ANSI with colors and the cursor position
+
+    if ( IsGraphicsMode() )
+        return WriteGraphicsCapture( path );
+
+    FILE * fp = fopen( path, "w" );
+    if ( !fp )
+        return false;
+
+    uint8_t * pbuf = GetVideoMem( GetActiveDisplayPage() );
+    if ( ansi )
+        fprintf( fp, "\x1b[2J\x1b[H" );
+
+    for ( uint32_t y = 0; y < GetScreenRows(); y++ )
+    {
+        uint8_t * prow = pbuf + y * ScreenColumns * 2;
+        uint32_t columns = ScreenColumns;
+        if ( !ansi ) // trailing blanks matter when colored, but not as text
+            while ( ( columns > 0 ) && ( ' ' == CP437_to_Unicode[ prow[ 2 * ( columns - 1 ) ] ] ) )
+                columns--;
+
+        int lastAttribute = -1;
+        for ( uint32_t x = 0; x < columns; x++ )
+        {
+            uint8_t attribute = prow[ 2 * x + 1 ] & 0x7f;
+            if ( ansi && ( attribute != lastAttribute ) )
+            {
+                uint8_t fgRGB, bgRGB;
+                bool intense;
+                DecodeAttributes( attribute, fgRGB, bgRGB, intense );
+                fprintf( fp, "\x1b[%d;%d;%dm", intense ? 1 : 0, FGColorMap[ fgRGB ], BGColorMap[ bgRGB ] );
+                lastAttribute = attribute;
+            }
+
+            char ac[ 3 ];
+            fwrite( ac, 1, unicode_to_utf8( ac, CP437_to_Unicode[ prow[ 2 * x ] ] ), fp );
+        }
+
+        fprintf( fp, ansi ? "\x1b[0m\n" : "\n" );
+    }
+
+    if ( ansi )
+    {
+        uint8_t row, col;
+        GetCursorPosition( row, col, GetActiveDisplayPage() );
+        fprintf( fp, "\x1b[%d;%dH", row + 1, col + 1 );
+    }
+
+    bool ok = !ferror( fp );
+    fclose( fp );
+    return ok;
+} //WriteScreenCapture
+
+void ClearDisplay()
+{
+    assert( g_use80xRowsMode );
+    uint8_t * pbuf = GetVideoMem( GetActiveDisplayPage() );
+    init_blankline( DefaultVideoAttribute );
+
+    for ( size_t y = 0; y < GetScreenRows(); y++ )
+        memcpy( pbuf + ( y * 2 * ScreenColumns ), blankLine, sizeof( blankLine ) );
+} //ClearDisplay
+
+#ifdef _WIN32
+    BOOL WINAPI ControlHandlerProc( DWORD fdwCtrlType )
+    {
+        // this happens in a third thread, which is implicitly created
+
+        if ( CTRL_C_EVENT == fdwCtrlType )
+        {
+            tracer.Trace( "ControlHandlerProc is incrementing the ^c count\n ");
+            InterlockedIncrement( &g_injectedControlC );
+            g_SendControlCInt = true;
+            return TRUE;
+        }
+
+        return FALSE;
+    } //ControlHandlerProc
+#else
+    void ControlHandlerProc( int signal ) {}
+#endif
+
+struct IntInfo
+{
+    uint8_t i;  // interrupt #
+    uint8_t c;  // ah command
+    const char * name;
+};
+
+const IntInfo interrupt_list_no_ah[] =
+{
+   { 0x00, 0, "divide by zero" },
+   { 0x01, 0, "trap / single-step" },
+   { 0x02, 0, "non-maskable interrupt" },
+   { 0x03, 0, "int3 / debug break" },
+   { 0x04, 0, "overflow" },
+   { 0x05, 0, "print-screen key" },
+   { 0x06, 0, "undefined opcode" },
+   { 0x08, 0, "hardware timer interrupt" },
+   { 0x09, 0, "keyboard interrupt" },
    { 0x10, 0, "bios video" },
    { 0x11, 0, "bios equipment determination" },
    { 0x12, 0, "memory size determination" },
@@ -2192,7 +3384,9 @@ const IntInfo interrupt_list_no_ah[] =
    { 0x3d, 0, "turbo c / microsoft floating point emulation" },
    { 0x3e, 0, "turbo c / microsoft floating point emulation" },
    { 0x3f, 0, "overlay manager (microsoft link.exe)" },
+   { 0x67, 0, "expanded memory (EMS)" },
    { 0xf0, 0, "gwbasic interpreter" },
+   { 0xfe, 0, "extended memory (XMS) driver entry" },
 };
 
 const IntInfo interrupt_list[] =
@@ -2358,6 +3552,72 @@ const uint8_t ascii_to_scancode[ 128 ] =
      45,  21,  24,  26,  43,  27,  41,  14, // 120  x y z { | } ~ DEL
 };
 
+static bool TextAtScreenOffset( const uint8_t * pbuf, uint32_t offset, const char * text, size_t len )
+{
+    for ( size_t i = 0; i < len; i++ )
+        if ( pbuf[ 2 * ( offset + i ) ] != (uint8_t) text[ i ] )
+            return false;
+
+    return true;
+} //TextAtScreenOffset
+
+bool ScreenHasText( const char * text, int row, int col )
+{
+    // true if the active text page contains text anywhere (row -1) or at row, col. Rather than search on every
+    // check, the pages are write-protected like for display updates and only searched again once the app
+    // writes to them, and then at most 4 times per emulated timer tick, so an app runs at near full speed while
+    // a script waits for its output.
+
+    static const char * textMissing = 0;     // the text last searched for and not found
+    static uint8_t pageMissing = 0;           // the page it wasn't found on
+    static uint64_t searchCycles = 0;         // when it was searched
+
+    if ( IsGraphicsMode() )
+        return false;
+
+    if ( 0 == g_videoTracking )
+        EnableVideoWriteTracking();
+
+    uint8_t page = GetActiveDisplayPage();
+    uint32_t first, last;
+    uint64_t now = EmulatedCycles();
+    bool dirty = VideoPagesDirty( page, first, last, g_videoScriptDirty );
+    if ( ( text == textMissing ) && ( page == pageMissing ) && ( !dirty || ( ( now - searchCycles ) < ( g_keyStrokes.CyclesPerTick() / 4 ) ) ) )
+        return false;
+
+    if ( 1 == g_videoTracking )
+        ProtectVideoPages( first, last, g_videoScriptDirty ); // the next write to these pages marks them dirty again
+
+    size_t len = strlen( text );
+    const uint8_t * pbuf = GetVideoMem( page );
+    uint32_t rows = GetScreenRows();
+    bool found = false;
+
+    if ( row >= 0 )
+        found = ( (uint32_t) row < rows ) && ( ( col + len ) <= ScreenColumns ) && TextAtScreenOffset( pbuf, row * ScreenColumns + col, text, len );
+    else
+    {
+        for ( uint32_t y = 0; !found && y < rows; y++ )
+            for ( uint32_t x = 0; !found && ( x + len ) <= ScreenColumns; x++ )
+                found = TextAtScreenOffset( pbuf, y * ScreenColumns + x, text, len );
+    }
+
+    textMissing = found ? 0 : text;
+    pageMissing = page;
+    searchCycles = now;
+    return found;
+} //ScreenHasText
+
+bool ScriptKeystrokeAvailable( bool blocked )
+{
+    // -kr: the next keystroke from the script once the waits before it are complete
+
+    if ( !g_keyStrokes.StepsRemaining() )
+        return false;
+
+    return g_keyStrokes.Advance( EmulatedCycles(), blocked, ScreenHasText );
+} //ScriptKeystrokeAvailable
+
 #ifdef _WIN32
 // A small, host-side queue of raw hardware make/break scancode bytes (bit 7 clear = key down/make,
 // bit 7 set = key up/break), fed directly from Windows console key events -- including standalone
@@ -2637,7 +3897,7 @@ bool peek_keyboard( uint8_t & asciiChar, uint8_t & scancode )
     // this mutex is because I don't know if PeekConsoleInput and ReadConsoleInput are individually or mutually reenterant.
     lock_guard<mutex> lock( g_mtxEverything );
 
-    if ( g_keyStrokes.KeystrokeAvailable() )
+    if ( ScriptKeystrokeAvailable() )
     {
         uint16_t x = g_keyStrokes.Peek();
         asciiChar = x & 0xff;
@@ -2690,6 +3950,9 @@ bool peek_keyboard( bool throttle = false, bool sleep_on_throttle = false, bool
     static CDuration _durationLastPeek;
     static CDuration _durationLastUpdate;
 
+    if ( ScriptKeystrokeAvailable( sleep_on_throttle ) ) // sleeping callers block until a key arrives
+        return true;
+
     if ( throttle && !_durationLastPeek.HasTimeElapsedMS( 100 ) )
     {
         if ( update_display && g_use80xRowsMode && _durationLastUpdate.HasTimeElapsedMS( 333 ) )
@@ -2711,7 +3974,7 @@ bool peek_keyboard( bool throttle = false, bool sleep_on_throttle = false, bool
 void InjectKeystrokes()
 {
     CKbdBuffer kbd_buf;
-    while ( g_keyStrokes.KeystrokeAvailable() && !kbd_buf.IsFull() )
+    while ( ScriptKeystrokeAvailable() && !kbd_buf.IsFull() )
     {
         uint16_t x = g_keyStrokes.ConsumeNext();
         tracer.Trace( "injecting keystroke %04x from log file\n", x );
@@ -2734,6 +3997,13 @@ void InjectKeystrokes()
             tracer.Trace( "  adding redirected character %02x to keyboard buffer\n", ch );
             kbd_buf.Add( ch, ascii_to_scancode[ ch ] );
         }
+        else if ( g_batchIO )
+        {
+            // end of redirected input. return ^z like DOS does for files rather than leaving the app waiting forever
+
+            tracer.Trace( "  redirected input is at end of file; adding ^z to keyboard buffer\n" );
+            kbd_buf.Add( 0x1a, 0x2c );
+        }
     }
 } //InjectKeystrokes
 
@@ -2805,6 +4075,13 @@ void consume_keyboard()
 
 void InjectKeystrokes()
 {
+    CKbdBuffer kbd_buf;
+    while ( ScriptKeystrokeAvailable() && !kbd_buf.IsFull() )
+    {
+        uint16_t x = g_keyStrokes.ConsumeNext();
+        tracer.Trace( "injecting keystroke %04x from the script\n", x );
+        kbd_buf.Add( x & 0xff, x >> 8 );
+    }
 } //InjectKeystrokes
 
 // broken cases on Linux:
@@ -2823,6 +4100,7 @@ void consume_keyboard()
     const uint8_t ALT_DOWN = 51;
     const uint8_t SHIFT_DOWN = 50;
     const uint8_t MODIFIER_DOWN = 59;
+    InjectKeystrokes();
     CKbdBuffer kbd_buf;
     g_altPressedRecently = false;
 
@@ -3264,6 +4542,14 @@ void consume_keyboard()
 
 bool peek_keyboard( uint8_t & asciiChar, uint8_t & scancode )
 {
+    if ( ScriptKeystrokeAvailable() )
+    {
+        uint16_t x = g_keyStrokes.Peek();
+        asciiChar = x & 0xff;
+        scancode = x >> 8;
+        return true;
+    }
+
     if ( g_consoleConfig.portable_kbhit() )
     {
         if ( g_UseOneThread )
@@ -3281,6 +4567,9 @@ bool peek_keyboard( bool throttle = false, bool sleep_on_throttle = false, bool
     static CDuration _durationLastPeek;
     static CDuration _durationLastUpdate;
 
+    if ( ScriptKeystrokeAvailable( sleep_on_throttle ) ) // sleeping callers block until a key arrives
+        return true;
+
     if ( throttle && !_durationLastPeek.HasTimeElapsedMS( 100 ) )
     {
         if ( update_display && g_use80xRowsMode && _durationLastUpdate.HasTimeElapsedMS( 333 ) )
@@ -3303,6 +4592,7 @@ bool peek_keyboard( bool throttle = false, bool sleep_on_throttle = false, bool
 
 void i8086_hard_exit( const char * pcerror )
 {
+    flush_console_output();
     g_consoleConfig.RestoreConsole( false );
 
     tracer.Trace( "%s", pcerror );
@@ -3310,30 +4600,105 @@ void i8086_hard_exit( const char * pcerror )
     tracer.Trace( "  %s\n", build_string() );
     printf( "  %s\n", build_string() );
 
+#if USE_FORK
+    ReportForkServerExit( 1 );
+#endif
     exit( 1 );
 } //i8086_hard_exit
 
-uint8_t i8086_invoke_in_byte( uint16_t port )
+// The display status registers at 0x3da (CGA) and 0x3ba (MDA/Hercules) are modeled from emulated cycles using CGA
+// timing: 60 frames per second of 262 scanlines, 200 of them displayed, with vertical retrace for 16 scanlines.
+// Apps that wait for retrace spin on the register. When the code at cs:ip is such a loop -- in al,dx then test or
+// and al with a mask, or shr al,1, then a conditional jump back to the in or to a mov dx before it -- emulated time
+// jumps ahead to when the loop will exit, so the wait costs one port read rather than thousands of instructions.
+
+const uint64_t RetraceFrameLines = 262;
+const uint64_t RetraceDisplayLines = 200;
+const uint64_t RetraceVSyncLine = 224;
+const uint64_t RetraceVSyncLines = 16;
+static uint64_t g_retraceLineCycles = 4772727 / 60 / RetraceFrameLines; // -s changes this
+
+uint8_t DisplayStatusAt( uint16_t port, uint64_t cycles )
 {
-    static uint8_t port40 = 0;
-    //tracer.Trace( "invoke_in_byte port %#x\n", port );
+    uint64_t line = ( cycles / g_retraceLineCycles ) % RetraceFrameLines;
+    bool blank = ( line >= RetraceDisplayLines ) || ( ( cycles % g_retraceLineCycles ) >= ( g_retraceLineCycles * 3 / 4 ) );
+    bool vsync = ( line >= RetraceVSyncLine ) && ( line < ( RetraceVSyncLine + RetraceVSyncLines ) );
 
-    if ( 0x3da == port )
-    {
-        // toggle this or apps will spin waiting for the I/O port to work.
+    if ( 0x3ba == port )
+        return ( blank ? 1 : 0 ) | ( vsync ? 0 : 0x80 ); // Hercules bit 7 is clear during vertical retrace
 
-        static uint8_t cga_status = 9;
-        cga_status ^= 9;
-        return cga_status;
-    }
-    else if ( 0x3ba == port )
+    return ( blank ? 1 : 0 ) | ( vsync ? 8 : 0 );
+} //DisplayStatusAt
+
+uint64_t NextDisplayStatusChange( uint64_t cycles )
+{
+    // status bits change only at the start of a scanline or of its horizontal blanking
+
+    uint64_t lineStart = cycles - ( cycles % g_retraceLineCycles );
+    uint64_t blankStart = lineStart + g_retraceLineCycles * 3 / 4;
+    return ( cycles < blankStart ) ? blankStart : ( lineStart + g_retraceLineCycles );
+} //NextDisplayStatusChange
+
+bool IsDisplayStatusSpin( uint8_t & mask, bool & waitForSet )
+{
+    uint16_t ip = cpu.get_ip();
+    uint8_t * pcode = cpu.flat_address8( cpu.get_cs(), ip );
+    assert( 0xec == pcode[ 0 ] ); // in al, dx
+
+    if ( 0xa8 == pcode[ 1 ] || 0x24 == pcode[ 1 ] ) // test al, imm8 or and al, imm8
+        mask = pcode[ 2 ];
+    else if ( 0xd0 == pcode[ 1 ] && 0xe8 == pcode[ 2 ] ) // shr al, 1
+        mask = 1;
+    else
+        return false;
+
+    uint8_t jcc = pcode[ 3 ];
+    if ( 1 == mask && ( 0x72 == jcc || 0x73 == jcc ) && 0xd0 == pcode[ 1 ] ) // jc, jnc
+        waitForSet = ( 0x73 == jcc );
+    else if ( ( 0x74 == jcc || 0x75 == jcc ) && 0xd0 != pcode[ 1 ] ) // jz, jnz
+        waitForSet = ( 0x74 == jcc );
+    else
+        return false;
+
+    uint16_t target = ip + 5 + (int16_t) (int8_t) pcode[ 4 ];
+    if ( target == ip )
+        return true;
+
+    return ( ip >= 3 ) && ( target == ( ip - 3 ) ) && ( 0xba == pcode[ -3 ] ); // mov dx, imm16
+} //IsDisplayStatusSpin
+
+uint8_t ReadDisplayStatus( uint16_t port )
+{
+    uint64_t now = EmulatedCycles();
+    uint8_t status = DisplayStatusAt( port, now );
+    uint8_t mask;
+    bool waitForSet;
+
+    if ( IsDisplayStatusSpin( mask, waitForSet ) )
     {
-        // toggle this or apps will spin waiting for the I/O port to work.
+        uint64_t t = now;
+        for ( uint64_t i = 0; ( i <= 2 * RetraceFrameLines ) && ( waitForSet != ( 0 != ( status & mask ) ) ); i++ )
+        {
+            t = NextDisplayStatusChange( t );
+            status = DisplayStatusAt( port, t );
+        }
 
-        static uint8_t monochrome_status = 0x80;
-        monochrome_status ^= 0x80;
-        return monochrome_status;
+        if ( waitForSet == ( 0 != ( status & mask ) ) )
+            cpu.add_cycles( t - now ); // the loop exits on this read. account for the time it would have spun
+        else
+            status = DisplayStatusAt( port, now ); // a mask that never matches. let the app spin as on hardware
     }
+
+    return status;
+} //ReadDisplayStatus
+
+uint8_t i8086_invoke_in_byte( uint16_t port )
+{
+    static uint8_t port40 = 0;
+    //tracer.Trace( "invoke_in_byte port %#x\n", port );
+
+    if ( 0x3da == port || 0x3ba == port )
+        return ReadDisplayStatus( port );
     else if ( 0x3d5 == port )
     {
         return 0;
@@ -3406,6 +4771,8 @@ void i8086_invoke_out_byte( uint16_t port, uint8_t val )
 
     if ( 0x20 == port && 0x20 == val ) // End Of Interrupt to 8259A PIC. Enable subsequent interrupts
         g_int9_pending = false;
+    else if ( 0x3d9 == port ) // CGA color select
+        g_cgaColorSelect = val;
 
 #if 0 // this enables quickb2 to almost work; but it wants alt and other keystrokes as stand-alone scan codes
     if ( 0x61 == port && 0 == val )
@@ -3609,12 +4976,10 @@ bool starts_with( const char * str, const char * start )
             if ( 0 == *filename )
                 return false;
 
-            char fc = *filename;
-            char pc = *pattern;
-#ifdef __APPLE__ // by default, MacOS is case insensitive
-            fc = (char) tolower( (uint8_t) fc );
-            pc = (char) tolower( (uint8_t) pc );
-#endif
+            // DOS is case insensitive, so match host files regardless of case
+
+            char fc = (char) tolower( (uint8_t) *filename );
+            char pc = (char) tolower( (uint8_t) *pattern );
             if ( '?' != pc && fc != pc )
                 return false;
 
@@ -3964,7 +5329,8 @@ void PerhapsFlipTo80xRows()
         if ( !g_forceConsole )
         {
             g_use80xRowsMode = true;
-            g_consoleConfig.EstablishConsoleOutput( ScreenColumns, GetScreenRows() );
+            if ( !g_headless )
+                g_consoleConfig.EstablishConsoleOutput( ScreenColumns, GetScreenRows() );
             ClearDisplay();
         }
     }
@@ -3999,20 +5365,58 @@ void invoke_assembler_routine( uint16_t code_segment )
     cpu.set_cs( code_segment );
 } //invoke_assembler_routine
 
+bool is_console_input_request( uint8_t interrupt_num, uint8_t ah )
+{
+    if ( 0x16 == interrupt_num )
+        return true;
+
+    if ( 0x21 == interrupt_num )
+        return ( 1 == ah || 7 == ah || 8 == ah || 0xa == ah || 0xb == ah || 0xc == ah ||
+                 ( 6 == ah && 0xff == cpu.dl() ) || ( 0x3f == ah && 0 == cpu.get_bx() ) );
+
+    return false;
+} //is_console_input_request
+
+void RecordCharacters( const uint8_t * p, size_t len )
+{
+    // tty output is CP 437. recordings are utf-8. convert a chunk at a time to record it with one call
+
+    char ac[ 512 * 3 ];
+    while ( 0 != len )
+    {
+        size_t chunk = get_min( len, (size_t) 512 );
+        size_t out = 0;
+        for ( size_t i = 0; i < chunk; i++ )
+        {
+            if ( p[ i ] < 0x80 )
+                ac[ out++ ] = (char) p[ i ];
+            else
+                out += unicode_to_utf8( ac + out, CP437_to_Unicode[ p[ i ] ] );
+        }
+
+        RecordTerminalOutput( ac, out );
+        p += chunk;
+        len -= chunk;
+    }
+} //RecordCharacters
+
 void send_character( uint8_t c )
 {
     #if defined( _WIN32 ) || defined( WATCOM )
-        if ( 10 == c )
+        if ( 10 == c && !g_batchIO ) // batch mode leaves stdout in binary mode
         {
             fflush( stdout );
             _setmode( _fileno( stdout ), _O_BINARY ); // don't convert LF (10) to CR LF (13 10)
         }
     #endif
 
-    printf( "%c", c );
+    putchar( c );
+    g_consoleOutputPending = true;
+    if ( g_recordFile )
+        RecordCharacters( &c, 1 );
 
     #if defined( _WIN32 ) || defined( WATCOM )
-        if ( 10 == c )
+        if ( 10 == c && !g_batchIO )
         {
             fflush( stdout );
             _setmode( _fileno( stdout ), _O_TEXT ); // back in text mode
@@ -4020,6 +5424,59 @@ void send_character( uint8_t c )
     #endif
 } //send_character
 
+void send_characters( const uint8_t * p, size_t len )
+{
+    #if defined( _WIN32 ) || defined( WATCOM )
+        for ( size_t i = 0; i < len; i++ )
+            send_character( p[ i ] );
+    #else
+        fwrite( p, 1, len, stdout );
+        g_consoleOutputPending = true;
+        if ( g_recordFile )
+            RecordCharacters( p, len );
+    #endif
+} //send_characters
+
+static bool skip_output_character( uint8_t c )
+{
+    // intel c v4.5 generates apps where sprintf and printf insert a 0xf7 instead of the final digit of a floating point number
+
+    return ( 0x0b == c || 0xf7 == c );
+} //skip_output_character
+
+static void send_batch_run( uint16_t handle, const uint8_t * p, size_t len )
+{
+    if ( 0 == len )
+        return;
+
+    if ( 2 == handle )
+    {
+        flush_console_output(); // keep the two in order if they're redirected to the same place
+        fwrite( p, 1, len, stderr );
+    }
+    else
+    {
+        fwrite( p, 1, len, stdout );
+        g_consoleOutputPending = true;
+    }
+} //send_batch_run
+
+void send_batch_output( uint16_t handle, const uint8_t * p, size_t len )
+{
+    // batch mode: handle 1 and 2 output goes untranslated to stdout and stderr, less the bytes the tty path skips
+
+    size_t start = 0;
+    for ( size_t x = 0; x < len; x++ )
+    {
+        if ( skip_output_character( p[ x ] ) )
+        {
+            send_batch_run( handle, p + start, x - start );
+            start = x + 1;
+        }
+    }
+    send_batch_run( handle, p + start, len - start );
+} //send_batch_output
+
 void handle_int_10( uint8_t c )
 {
     uint8_t row, col;
@@ -4040,6 +5497,36 @@ void handle_int_10( uint8_t c )
             mode &= 0x7f; // strip the top bit which prevents ega/mcga/vga from clearing the display
             tracer.Trace( "  set video mode to %#x, options are %#x\n", mode, GetVideoModeOptions() );
 
+            if ( IsGraphicsMode( mode ) )
+            {
+                LogGraphicsFrame(); // the last frame of the prior graphics mode, if any
+                if ( !IsGraphicsMode() )
+                {
+                    g_textMode80xRows = g_use80xRowsMode;
+                    g_use80xRowsMode = false; // text goes to the terminal as tty output
+                }
+
+                SetVideoMode( mode );
+                g_cgaColorSelect = ( 6 == mode ) ? 0x3f : 0x30;
+                g_cgaFrameLogged = false;
+                if ( 0 == ( 0x80 & cpu.al() ) )
+                    memset( memory + ScreenBufferSegment * 16, 0, VideoTrackedPages * VideoPageBytes );
+                SetCursorPosition( 0, 0, 0 );
+                return;
+            }
+
+            if ( IsGraphicsMode() )
+            {
+                LogGraphicsFrame();
+                SetVideoMode( 3 );
+                g_use80xRowsMode = g_textMode80xRows;
+                if ( g_use80xRowsMode )
+                {
+                    ClearDisplay(); // the pixels aren't text
+                    ClearLastUpdateBuffer();
+                }
+            }
+
             if ( 2 == mode || 3 == mode ) // only 80x25 is supported with buffer address 0xb8000
                 SetVideoMode( 3 ); // it's all we support
 
@@ -4090,10 +5577,7 @@ void handle_int_10( uint8_t c )
             if ( !g_use80xRowsMode )
             {
                 if ( 0 == col && ( row == ( prevRow + 1 ) ) )
-                {
-                    printf( "\n" );
-                    fflush( stdout );
-                }
+                    send_character( '\n' );
             }
 
             return;
@@ -4304,10 +5788,7 @@ void handle_int_10( uint8_t c )
                     ch = ' ';
 
                 if ( 0 != ch ) // IBM BASIC v1 likes to output character 0
-                {
                     send_character( ch );
-                    fflush( stdout );
-                }
             }
 
             return;
@@ -4337,10 +5818,7 @@ void handle_int_10( uint8_t c )
                     UpdateDisplayRow( row );
             }
             else
-            {
                 send_character( ch );
-                fflush( stdout );
-            }
 
             return;
         }
@@ -4407,24 +5885,53 @@ void handle_int_10( uint8_t c )
                 }
             }
             else
-            {
                 send_character( ch );
-                fflush( stdout );
-            }
 
             return;
         }
-        case 0xf:
+        case 0xb:
         {
-            // get video mode / get video state
+            // set color palette. bh = 0: bl is the background color. bh = 1: bl is the 320x200 palette
 
-            //PerhapsFlipTo80xRows();  too aggressive for some apps
-
-            uint8_t mode = GetVideoMode();
-            uint8_t options = GetVideoModeOptions();
+            if ( 0 == cpu.bh() )
+                g_cgaColorSelect = ( g_cgaColorSelect & 0xe0 ) | ( cpu.bl() & 0x1f );
+            else if ( 1 == cpu.bh() )
+                g_cgaColorSelect = ( g_cgaColorSelect & 0xdf ) | ( ( cpu.bl() & 1 ) << 5 );
+
+            tracer.Trace( "  set color palette bh %u, bl %u, color select now %#x\n", cpu.bh(), cpu.bl(), g_cgaColorSelect );
+            return;
+        }
+        case 0xc:
+        {
+            // write graphics pixel. al = color (xor'ed with the pixel if bit 7 is set), cx = column, dx = row
+
+            if ( IsGraphicsMode() && ( cpu.get_dx() < CgaHeight ) && ( cpu.get_cx() < CgaWidth() ) )
+                SetCgaPixel( CgaScanline( cpu.get_dx() ), cpu.get_cx(), cpu.al(), 0 != ( 0x80 & cpu.al() ) );
+
+            return;
+        }
+        case 0xd:
+        {
+            // read graphics pixel. cx = column, dx = row. returns the color in al
+
+            if ( IsGraphicsMode() && ( cpu.get_dx() < CgaHeight ) && ( cpu.get_cx() < CgaWidth() ) )
+                cpu.set_al( CgaPixel( CgaScanline( cpu.get_dx() ), cpu.get_cx() ) );
+            else
+                cpu.set_al( 0 );
+
+            return;
+        }
+        case 0xf:
+        {
+            // get video mode / get video state
+
+            //PerhapsFlipTo80xRows();  too aggressive for some apps
+
+            uint8_t mode = GetVideoMode();
+            uint8_t options = GetVideoModeOptions();
 
             cpu.set_al( mode | ( options & 0x80 ) );
-            cpu.set_ah( ScreenColumns ); // columns
+            cpu.set_ah( ( 4 == mode || 5 == mode ) ? 40 : ScreenColumns ); // columns
             cpu.set_bh( GetActiveDisplayPage() ); // active display page
 
             tracer.Trace( "  returning video mode %u, columns %u, display page %u, options %#x\n", cpu.al(), cpu.ah(), cpu.bh(), GetVideoModeOptions() );
@@ -4768,7 +6275,7 @@ void HandleAppExit()
         if ( -1 == index )
             break;
         tracer.Trace( "  closing fcb file an app leaked: '%s'\n", g_fileEntriesFCB[ index ].path );
-        FILE * fp = RemoveFileEntryFCB( g_fileEntriesFCB[ index ].path );
+        FILE * fp = RemoveFileEntryFCB( index );
         fclose( fp );
     } while ( true );
 
@@ -4813,15 +6320,15 @@ void HandleAppExit()
 
     // free any allocations made by the app not already freed
 
-    do
+    for ( uint16_t seg = FirstMCB(); 0 != seg; seg = NextMCB( seg ) )
     {
-        size_t index = FindAllocationEntryByProcess( pspToDelete );
-        if ( -1 == index )
-            break;
-
-        tracer.Trace( "  freeing RAM an app leaked, segment %04x (MCB+1) para len %04x\n", g_allocEntries[ index ].segment, g_allocEntries[ index ].para_length );
-        FreeMemory( g_allocEntries[ index ].segment );
-    } while( true );
+        DOSMemoryControlBlock * pmcb = GetMCB( seg );
+        if ( pspToDelete == pmcb->psp )
+        {
+            tracer.Trace( "  freeing RAM an app leaked, segment %04x (MCB+1) paras %04x\n", seg + 1, (uint16_t) pmcb->paras );
+            FreeMemory( seg + 1 );
+        }
+    }
 
     cpu.set_carry( false ); // indicate to the parent process that the Create Process int x21 x4b (EXEC/Load and Execute Program) succeeded.
 } //HandleAppExit
@@ -4864,6 +6371,19 @@ void star_to_question( char * pstr, const int len )
     }
 } //star_to_question
 
+void HostAppPath( const char * pcApp, char * acApp )
+{
+    // acApp is MAX_PATH in length. command_exists() then finds the .com or .exe
+
+    strcpy( acApp, pcApp );
+#ifdef _WIN32
+    _strupr( acApp );
+#else
+    const char * pLinuxPath = DOSToHostPath( acApp );
+    strcpy( acApp, pLinuxPath );
+#endif
+} //HostAppPath
+
 bool command_exists( char * pc )
 {
     if ( file_exists( pc ) )
@@ -4875,17 +6395,23 @@ bool command_exists( char * pc )
     char ac[ MAX_PATH ];
     strcpy( ac, pc );
     strcat( ac, ".COM" );
+#ifndef _WIN32
+    g_caseResolver.Resolve( ac );
+#endif
     if ( file_exists( ac ) )
     {
-        strcat( pc, ".COM" );
+        strcpy( pc, ac );
         return true;
     }
 
     strcpy( ac, pc );
     strcat( ac, ".EXE" );
+#ifndef _WIN32
+    g_caseResolver.Resolve( ac );
+#endif
     if ( file_exists( ac ) )
     {
-        strcat( pc, ".EXE" );
+        strcpy( pc, ac );
         return true;
     }
 
@@ -5055,16 +6581,45 @@ void output_character( char ch )
     else
     {
         if ( 8 == ch )
-            printf( "%c ", ch );
+        {
+            send_character( ch );
+            send_character( ' ' );
+        }
         send_character( ch );
-        fflush( stdout );
     }
 } //output_character
 
 void output_string( char * p, size_t len )
 {
+    if ( g_use80xRowsMode )
+    {
+        for ( size_t i = 0; i < len; i++ )
+            output_character( p[ i ] );
+        return;
+    }
+
+    // translate the whole string then send it at once. backspace erases the prior character
+
+    char ac[ 256 ];
+    size_t cur = 0;
+
     for ( size_t i = 0; i < len; i++ )
-        output_character( p[ i ] );
+    {
+        if ( cur > ( sizeof( ac ) - 3 ) )
+        {
+            send_characters( (uint8_t *) ac, cur );
+            cur = 0;
+        }
+
+        if ( 8 == p[ i ] )
+        {
+            ac[ cur++ ] = 8;
+            ac[ cur++ ] = ' ';
+        }
+        ac[ cur++ ] = p[ i ];
+    }
+
+    send_characters( (uint8_t *) ac, cur );
 } //output_string
 
 void create_or_reset_file( const char * path  )
@@ -5072,6 +6627,7 @@ void create_or_reset_file( const char * path  )
     FILE * fp = fopen( path, "w+b" );
     if ( fp )
     {
+        InvalidateFCBCaches( path, fp ); // it may have been truncated
         FileEntry fe = {0};
         strcpy( fe.path, path );
         fe.fp = fp;
@@ -5079,8 +6635,7 @@ void create_or_reset_file( const char * path  )
         MarkBuiltInBusy( fe.handle );
         fe.mode = 2; // read / write
         fe.seg_process = g_currentPSP;
-        g_fileEntries.push_back( fe );
-        SortFileHandles();
+        AddFileEntry( fe );
         cpu.set_ax( fe.handle );
         cpu.set_carry( false );
         tracer.Trace( "  successfully created file and using new handle %04x\n", cpu.get_ax() );
@@ -5218,7 +6773,6 @@ void handle_int_21( uint8_t c )
                 char ch = cpu.dl();
                 tracer.Trace( "    direct console output %02x, '%c'\n", (uint8_t) ch, printable( (uint8_t) ch ) );
                 send_character( ch );
-                fflush( stdout );
             }
 
             return;
@@ -5387,13 +6941,11 @@ void handle_int_21( uint8_t c )
 
                 // if the file is already open then close it. Digital Research CB86.EXE does this.
 
-                FILE * fp = FindFileEntryFromFileFCB( filename );
+                FILE * fp = RemoveFileEntryFCB( pfcb, filename );
                 if ( 0 != fp )
-                {
-                    RemoveFileEntryFCB( filename );
                     fclose( fp );
-                }
 
+                FlushHandleWrites( filename );
                 fp = fopen( filename, "r+b" );
                 if ( fp )
                 {
@@ -5422,7 +6974,7 @@ void handle_int_21( uint8_t c )
                     fe.handle = 0; // FCB files don't have handles
                     fe.mode = 2;
                     fe.seg_process = g_currentPSP;
-                    g_fileEntriesFCB.push_back( fe );
+                    AddFileEntryFCB( pfcb, fe );
                     tracer.Trace( "  successfully opened file\n" );
                     trace_all_open_files_fcb();
 
@@ -5449,7 +7001,7 @@ void handle_int_21( uint8_t c )
             {
                 tracer.Trace( "  close file using FCB: '%s'\n", filename );
 
-                FILE * fp = RemoveFileEntryFCB( filename );
+                FILE * fp = RemoveFileEntryFCB( pfcb, filename );
                 if ( 0 != fp )
                 {
                     cpu.set_al( 0 );
@@ -5669,10 +7221,9 @@ void handle_int_21( uint8_t c )
 
                 // the file may be open (Digital Research's CB86 Basic Compiler does this). If so, close it.
 
-                FILE * fp = FindFileEntryFromFileFCB( filename );
+                FILE * fp = RemoveFileEntryFCB( pfcb, filename );
                 if ( 0 != fp )
                 {
-                    RemoveFileEntryFCB( filename );
                     tracer.Trace( "  closing an open file before deleting it\n" );
                     fclose( fp );
                     trace_all_open_files_fcb();
@@ -5709,39 +7260,28 @@ void handle_int_21( uint8_t c )
             DOSFCB * pfcb = (DOSFCB *) cpu.flat_address( cpu.get_ds(), cpu.get_dx() );
             pfcb->Trace();
 
-            if ( GetDOSFilenameFromFCB( *pfcb, filename ) )
+            FCBFileEntry * pentry = FindFileEntryFromFileFCB( pfcb );
+            if ( pentry )
             {
-                FILE * fp = FindFileEntryFromFileFCB( filename );
-                if ( fp )
+                uint32_t offset = pfcb->SequentialOffset();
+                tracer.Trace( "  file offset: %u\n", offset );
+                tracer.Trace( "  using disk transfer address %04x:%04x\n", g_diskTransferSegment, g_diskTransferOffset );
+                memset( GetDiskTransferAddress(), 0, pfcb->recSize );
+                uint32_t num_read = FCBRead( *pentry, offset, GetDiskTransferAddress(), pfcb->recSize );
+                if ( num_read )
                 {
-                    uint32_t seekOffset = pfcb->SequentialOffset();
-                    tracer.Trace( "  seek offset: %u\n", seekOffset );
-                    tracer.Trace( "  using disk transfer address %04x:%04x\n", g_diskTransferSegment, g_diskTransferOffset );
-                    bool ok = !fseek( fp, seekOffset, SEEK_SET );
-                    if ( ok )
-                    {
-                        memset( GetDiskTransferAddress(), 0, pfcb->recSize );
-                        size_t num_read = fread( GetDiskTransferAddress(), 1, pfcb->recSize, fp );
-                        if ( num_read )
-                        {
-                             tracer.Trace( "  read succeded: %u bytes. recsize %u bytes\n", num_read, (uint16_t) pfcb->recSize );
-                             if ( num_read == pfcb->recSize )
-                                 cpu.set_al( 0 );
-                             else
-                                 cpu.set_al( 3 );
-                             pfcb->curRecord++;
-                        }
-                        else
-                             tracer.Trace( "  read failed with error %d = %s\n", errno, strerror( errno ) );
-                    }
-                    else
-                        tracer.Trace( "  ERROR sequential read using FCB failed to seek, error %d = %s\n", errno, strerror( errno ) );
+                     tracer.Trace( "  read succeded: %u bytes. recsize %u bytes\n", num_read, (uint16_t) pfcb->recSize );
+                     if ( num_read == pfcb->recSize )
+                         cpu.set_al( 0 );
+                     else
+                         cpu.set_al( 3 );
+                     pfcb->curRecord++;
                 }
                 else
-                    tracer.Trace( "  ERROR sequential read using FCB doesn't have an open file\n" );
+                     tracer.Trace( "  read failed with error %d = %s\n", errno, strerror( errno ) );
             }
             else
-                tracer.Trace( "  ERROR sequential read using FCB can't parse filename\n" );
+                tracer.Trace( "  ERROR sequential read using FCB doesn't have an open file\n" );
 
             return;
         }
@@ -5759,35 +7299,24 @@ void handle_int_21( uint8_t c )
             DOSFCB * pfcb = (DOSFCB *) cpu.flat_address( cpu.get_ds(), cpu.get_dx() );
             pfcb->Trace();
 
-            if ( GetDOSFilenameFromFCB( *pfcb, filename ) )
+            FCBFileEntry * pentry = FindFileEntryFromFileFCB( pfcb );
+            if ( pentry )
             {
-                FILE * fp = FindFileEntryFromFileFCB( filename );
-                if ( fp )
+                uint32_t offset = pfcb->SequentialOffset();
+                tracer.Trace( "  file offset: %u\n", offset );
+                uint32_t num_written = FCBWrite( *pentry, offset, GetDiskTransferAddress(), pfcb->recSize );
+                if ( num_written )
                 {
-                    uint32_t seekOffset = pfcb->SequentialOffset();
-                    tracer.Trace( "  seek offset: %u\n", seekOffset );
-                    bool ok = !fseek( fp, seekOffset, SEEK_SET );
-                    if ( ok )
-                    {
-                        size_t num_written = fwrite( GetDiskTransferAddress(), 1, pfcb->recSize, fp );
-                        if ( num_written )
-                        {
-                             tracer.Trace( "  write succeded: %u bytes. recsize %u bytes\n", num_written, (uint16_t) pfcb->recSize );
-                             cpu.set_al( 0 );
-                             pfcb->curRecord++;
-                             tracer.TraceBinaryData( GetDiskTransferAddress(), (uint32_t) num_written, 4 );
-                        }
-                        else
-                             tracer.Trace( "  write failed with error %d = %s\n", errno, strerror( errno ) );
-                    }
-                    else
-                        tracer.Trace( "  ERROR sequential write using FCB failed to seek, error %d = %s\n", errno, strerror( errno ) );
+                     tracer.Trace( "  write succeded: %u bytes. recsize %u bytes\n", num_written, (uint16_t) pfcb->recSize );
+                     cpu.set_al( 0 );
+                     pfcb->curRecord++;
+                     tracer.TraceBinaryData( GetDiskTransferAddress(), num_written, 4 );
                 }
                 else
-                    tracer.Trace( "  ERROR sequential write using FCB doesn't have an open file\n" );
+                     tracer.Trace( "  write failed with error %d = %s\n", errno, strerror( errno ) );
             }
             else
-                tracer.Trace( "  ERROR sequential write using FCB can't parse filename\n" );
+                tracer.Trace( "  ERROR sequential write using FCB doesn't have an open file\n" );
 
             return;
         }
@@ -5814,6 +7343,7 @@ void handle_int_21( uint8_t c )
                 if ( fp )
                 {
                     tracer.Trace( "  file created successfully\n" );
+                    InvalidateFCBCaches( filename, fp ); // it may have been truncated
                     cpu.set_al( 0 );
 
                     pfcb->curBlock = 0;
@@ -5837,8 +7367,7 @@ void handle_int_21( uint8_t c )
                     fe.handle = 0;
                     fe.mode = 2;
                     fe.seg_process = g_currentPSP;
-                    g_fileEntriesFCB.push_back( fe );
-                    SortFileHandles();
+                    AddFileEntryFCB( pfcb, fe );
                     trace_all_open_files_fcb();
 
                     pfcb->Trace();
@@ -5963,41 +7492,30 @@ void handle_int_21( uint8_t c )
             DOSFCB * pfcb = (DOSFCB *) cpu.flat_address( cpu.get_ds(), cpu.get_dx() );
             pfcb->Trace();
 
-            if ( GetDOSFilenameFromFCB( *pfcb, filename ) )
+            FCBFileEntry * pentry = FindFileEntryFromFileFCB( pfcb );
+            if ( pentry )
             {
-                FILE * fp = FindFileEntryFromFileFCB( filename );
-                if ( fp )
-                {
-                    uint32_t seekOffset = pfcb->RandomOffset();
-                    tracer.Trace( "  seek offset: %u\n", seekOffset );
-                    pfcb->SetSequentialFromRandom(); // Digital Research PL/I compiler/linker depends on this
+                uint32_t offset = pfcb->RandomOffset();
+                tracer.Trace( "  file offset: %u\n", offset );
+                pfcb->SetSequentialFromRandom(); // Digital Research PL/I compiler/linker depends on this
 
-                    bool ok = !fseek( fp, seekOffset, SEEK_SET );
-                    if ( ok )
-                    {
-                        memset( GetDiskTransferAddress(), 0, pfcb->recSize );
-                        size_t num_read = fread( GetDiskTransferAddress(), 1, pfcb->recSize, fp );
-                        if ( num_read )
-                        {
-                             tracer.Trace( "  read succeded: %u bytes. recsize %u bytes\n", num_read, (uint16_t) pfcb->recSize );
-                             if ( num_read == pfcb->recSize )
-                                 cpu.set_al( 0 );
-                             else
-                                 cpu.set_al( 3 );
+                memset( GetDiskTransferAddress(), 0, pfcb->recSize );
+                uint32_t num_read = FCBRead( *pentry, offset, GetDiskTransferAddress(), pfcb->recSize );
+                if ( num_read )
+                {
+                     tracer.Trace( "  read succeded: %u bytes. recsize %u bytes\n", num_read, (uint16_t) pfcb->recSize );
+                     if ( num_read == pfcb->recSize )
+                         cpu.set_al( 0 );
+                     else
+                         cpu.set_al( 3 );
 
-                             // don't update the fcb's record number for this version of the API
-                        }
-                        else
-                             tracer.Trace( "  read failed with error %d = %s\n", errno, strerror( errno ) );
-                    }
-                    else
-                        tracer.Trace( "  ERROR random read using FCB failed to seek, error %d = %s\n", errno, strerror( errno ) );
+                     // don't update the fcb's record number for this version of the API
                 }
                 else
-                    tracer.Trace( "  ERROR random read using FCB doesn't have an open file\n" );
+                     tracer.Trace( "  read failed with error %d = %s\n", errno, strerror( errno ) );
             }
             else
-                tracer.Trace( "  ERROR random read using FCB can't parse filename\n" );
+                tracer.Trace( "  ERROR random read using FCB doesn't have an open file\n" );
 
             return;
         }
@@ -6011,37 +7529,26 @@ void handle_int_21( uint8_t c )
             DOSFCB * pfcb = (DOSFCB *) cpu.flat_address( cpu.get_ds(), cpu.get_dx() );
             pfcb->Trace();
 
-            if ( GetDOSFilenameFromFCB( *pfcb, filename ) )
+            FCBFileEntry * pentry = FindFileEntryFromFileFCB( pfcb );
+            if ( pentry )
             {
-                FILE * fp = FindFileEntryFromFileFCB( filename );
-                if ( fp )
-                {
-                    uint32_t seekOffset = pfcb->RandomOffset();
-                    tracer.Trace( "  seek offset: %u\n", seekOffset );
-                    pfcb->SetSequentialFromRandom(); // Digital Research PL/I compiler/linker depends on this
+                uint32_t offset = pfcb->RandomOffset();
+                tracer.Trace( "  file offset: %u\n", offset );
+                pfcb->SetSequentialFromRandom(); // Digital Research PL/I compiler/linker depends on this
 
-                    bool ok = !fseek( fp, seekOffset, SEEK_SET );
-                    if ( ok )
-                    {
-                        size_t num_written = fwrite( GetDiskTransferAddress(), 1, pfcb->recSize, fp );
-                        if ( num_written )
-                        {
-                             tracer.Trace( "  write succeded: %u bytes\n", (uint16_t) pfcb->recSize );
-                             cpu.set_al( 0 );
+                uint32_t num_written = FCBWrite( *pentry, offset, GetDiskTransferAddress(), pfcb->recSize );
+                if ( num_written )
+                {
+                     tracer.Trace( "  write succeded: %u bytes\n", (uint16_t) pfcb->recSize );
+                     cpu.set_al( 0 );
 
-                             // don't update the fcb's record number for this version of the API
-                        }
-                        else
-                             tracer.Trace( "  write failed with error %d = %s\n", errno, strerror( errno ) );
-                    }
-                    else
-                        tracer.Trace( "  ERROR random write using FCB failed to seek, error %d = %s\n", errno, strerror( errno ) );
+                     // don't update the fcb's record number for this version of the API
                 }
                 else
-                    tracer.Trace( "  ERROR random write using FCB doesn't have an open file\n" );
+                     tracer.Trace( "  write failed with error %d = %s\n", errno, strerror( errno ) );
             }
             else
-                tracer.Trace( "  ERROR random write using FCB can't parse filename\n" );
+                tracer.Trace( "  ERROR random write using FCB doesn't have an open file\n" );
 
             return;
         }
@@ -6100,59 +7607,50 @@ void handle_int_21( uint8_t c )
             pfcb->Trace();
             uint32_t seekOffset = pfcb->RandomOffset();
 
-            if ( GetDOSFilenameFromFCB( *pfcb, filename ) )
+            FCBFileEntry * pentry = FindFileEntryFromFileFCB( pfcb );
+            if ( pentry )
             {
-                FILE * fp = FindFileEntryFromFileFCB( filename );
-                if ( fp )
-                {
-                    pfcb->fileSize = portable_filelen( fp );
-                    tracer.Trace( "  file size: %u\n", (uint32_t) pfcb->fileSize );
+                pfcb->fileSize = pentry->fileSize;
+                tracer.Trace( "  file size: %u\n", (uint32_t) pfcb->fileSize );
 
-                    if ( seekOffset >= pfcb->fileSize )
-                    {
-                        tracer.Trace( "  ERROR: random read >= end of file offset %u, filesize %u\n", seekOffset, (uint32_t) pfcb->fileSize );
-                        cpu.set_al( 1 ); // eof
-                    }
-                    else
+                if ( seekOffset >= pfcb->fileSize )
+                {
+                    tracer.Trace( "  ERROR: random read >= end of file offset %u, filesize %u\n", seekOffset, (uint32_t) pfcb->fileSize );
+                    cpu.set_al( 1 ); // eof
+                }
+                else
+                {
+                    // all records are read with one host read straight into the DTA
+
+                    tracer.Trace( "  file offset: %u\n", seekOffset );
+                    uint32_t askedBytes = pfcb->recSize * cRecords;
+                    uint32_t bytesToRead = get_min( pfcb->fileSize - seekOffset, askedBytes );
+                    uint16_t recordsToRead = (uint16_t) round_up( bytesToRead, (uint32_t) pfcb->recSize ) / pfcb->recSize;
+                    tracer.Trace( "  bytesToRead: %u = %#04x, recordsToRead %u\n", bytesToRead, bytesToRead, recordsToRead );
+                    memset( GetDiskTransferAddress(), 0x1a, recordsToRead * pfcb->recSize ); // mimic CP/M; no documentation for this
+                    uint32_t bytesRead = FCBRead( *pentry, seekOffset, GetDiskTransferAddress(), bytesToRead );
+                    if ( 0 != bytesRead )
                     {
-                        tracer.Trace( "  seek offset: %u\n", seekOffset );
-                        bool ok = !fseek( fp, seekOffset, SEEK_SET );
-                        if ( ok )
-                        {
-                            uint32_t askedBytes = pfcb->recSize * cRecords;
-                            uint32_t bytesToRead = get_min( pfcb->fileSize - seekOffset, askedBytes );
-                            uint16_t recordsToRead = (uint16_t) round_up( bytesToRead, (uint32_t) pfcb->recSize ) / pfcb->recSize;
-                            tracer.Trace( "  bytesToRead: %u = %#04x, recordsToRead %u\n", bytesToRead, bytesToRead, recordsToRead );
-                            memset( GetDiskTransferAddress(), 0x1a, recordsToRead * pfcb->recSize ); // mimic CP/M; no documentation for this
-                            size_t bytesRead = fread( GetDiskTransferAddress(), 1, bytesToRead, fp );
-                            if ( 0 != bytesRead )
-                            {
-                                uint16_t recordsRead = (uint16_t) round_up( (uint32_t) bytesRead, (uint32_t) pfcb->recSize ) / pfcb->recSize;
-                                cpu.set_cx( (uint16_t) recordsRead );
-                                tracer.Trace( "  bytesRead: %zd, bytesToRead %zd, recordsRead %u\n", bytesRead, bytesToRead, recordsRead );
-
-                                if ( bytesRead == askedBytes )
-                                    cpu.set_al( 0 );
-                                else
-                                    cpu.set_al( 3 ); // eof encountered; not all requested records read or last record is partial
+                        uint16_t recordsRead = (uint16_t) round_up( bytesRead, (uint32_t) pfcb->recSize ) / pfcb->recSize;
+                        cpu.set_cx( (uint16_t) recordsRead );
+                        tracer.Trace( "  bytesRead: %u, bytesToRead %u, recordsRead %u\n", bytesRead, bytesToRead, recordsRead );
 
-                                tracer.Trace( "  used disk transfer address %04x:%04x\n", g_diskTransferSegment, g_diskTransferOffset );
-                                tracer.TraceBinaryData( GetDiskTransferAddress(), recordsRead * pfcb->recSize, 4 );
-                                pfcb->SetRandomRecordNumber( pfcb->RandomRecordNumber() + (uint32_t) cpu.get_cx() );
-                                pfcb->SetSequentialFromRandom(); // the next sequential I/O expects this to be set. Thanks DRI compilers and linkers.
-                            }
-                            else
-                                tracer.Trace( "  ERROR random block read using FCB failed to read, error %d = %s\n", errno, strerror( errno ) );
-                        }
+                        if ( bytesRead == askedBytes )
+                            cpu.set_al( 0 );
                         else
-                            tracer.Trace( "  ERROR random block read using FCB failed to seek, error %d= %s\n", errno, strerror( errno ) );
+                            cpu.set_al( 3 ); // eof encountered; not all requested records read or last record is partial
+
+                        tracer.Trace( "  used disk transfer address %04x:%04x\n", g_diskTransferSegment, g_diskTransferOffset );
+                        tracer.TraceBinaryData( GetDiskTransferAddress(), recordsRead * pfcb->recSize, 4 );
+                        pfcb->SetRandomRecordNumber( pfcb->RandomRecordNumber() + (uint32_t) cpu.get_cx() );
+                        pfcb->SetSequentialFromRandom(); // the next sequential I/O expects this to be set. Thanks DRI compilers and linkers.
                     }
+                    else
+                        tracer.Trace( "  ERROR random block read using FCB failed to read, error %d = %s\n", errno, strerror( errno ) );
                 }
-                else
-                    tracer.Trace( "  ERROR random block read using FCB doesn't have an open file\n" );
             }
             else
-                tracer.Trace( "  ERROR random block read using FCB can't parse filename\n" );
+                tracer.Trace( "  ERROR random block read using FCB doesn't have an open file\n" );
 
             return;
         }
@@ -6177,38 +7675,30 @@ void handle_int_21( uint8_t c )
                 return;
             }
 
-            if ( GetDOSFilenameFromFCB( *pfcb, filename ) )
+            FCBFileEntry * pentry = FindFileEntryFromFileFCB( pfcb );
+            if ( pentry )
             {
-                FILE * fp = FindFileEntryFromFileFCB( filename );
-                if ( fp )
-                {
-                    uint32_t seekOffset = pfcb->RandomOffset();
-                    tracer.Trace( "  seek offset: %u\n", seekOffset );
+                uint32_t seekOffset = pfcb->RandomOffset();
+                tracer.Trace( "  file offset: %u\n", seekOffset );
 
-                    bool ok = !fseek( fp, seekOffset, SEEK_SET );
-                    if ( ok )
-                    {
-                        size_t num_written = fwrite( GetDiskTransferAddress(), recsToWrite, pfcb->recSize, fp );
-                        if ( num_written )
-                        {
-                             tracer.Trace( "  write succeded: %u bytes\n", recsToWrite * pfcb->recSize );
-                             tracer.TraceBinaryData( GetDiskTransferAddress(), recsToWrite * pfcb->recSize, 4 );
-                             cpu.set_cx( recsToWrite );
-                             cpu.set_al( 0 );
-                             pfcb->SetRandomRecordNumber( pfcb->RandomRecordNumber() + (uint32_t) recsToWrite );
-                             pfcb->SetSequentialFromRandom(); // the next sequential I/O expects this to be set. Thanks DRI compilers and liners.
-                        }
-                        else
-                             tracer.Trace( "  write failed with error %d = %s\n", errno, strerror( errno ) );
-                    }
-                    else
-                        tracer.Trace( "  ERROR random block write using FCB failed to seek, error %d = %s\n", errno, strerror( errno ) );
+                // all records are written with one host write straight from the DTA
+
+                uint32_t bytesToWrite = (uint32_t) recsToWrite * pfcb->recSize;
+                uint32_t num_written = FCBWrite( *pentry, seekOffset, GetDiskTransferAddress(), bytesToWrite );
+                if ( num_written == bytesToWrite )
+                {
+                     tracer.Trace( "  write succeded: %u bytes\n", bytesToWrite );
+                     tracer.TraceBinaryData( GetDiskTransferAddress(), bytesToWrite, 4 );
+                     cpu.set_cx( recsToWrite );
+                     cpu.set_al( 0 );
+                     pfcb->SetRandomRecordNumber( pfcb->RandomRecordNumber() + (uint32_t) recsToWrite );
+                     pfcb->SetSequentialFromRandom(); // the next sequential I/O expects this to be set. Thanks DRI compilers and liners.
                 }
                 else
-                    tracer.Trace( "  ERROR random block write using FCB doesn't have an open file\n" );
+                     tracer.Trace( "  write failed with error %d = %s\n", errno, strerror( errno ) );
             }
             else
-                tracer.Trace( "  ERROR random block write using FCB can't parse filename\n" );
+                tracer.Trace( "  ERROR random block write using FCB doesn't have an open file\n" );
 
             return;
         }
@@ -6369,22 +7859,18 @@ void handle_int_21( uint8_t c )
             // DX: # of paragraphs to keep resident
             // AL == app return code
 
-            size_t entry = FindAllocationEntry( g_currentPSP );
-            if ( -1 == entry )
+            if ( 0 == FindAllocation( g_currentPSP ) )
             {
                 cpu.set_carry( true );
                 tracer.Trace( "  ERROR: attempt to terminate and stay resident with a bogus PSP\n" );
                 return;
             }
 
-            assert( 0 != g_allocEntries.size() ); // loading the app creates 1 that shouldn't be freed.
-            trace_all_allocations();
-
             uint16_t new_paragraphs = cpu.get_dx() & 0x7fff; // DOS discards the high bit of DX
             tracer.Trace( "  TSR and keep %#x paragraphs resident\n", new_paragraphs );
-            g_allocEntries[ entry ].para_length = new_paragraphs;
-            reset_mcb_tags();
-            trace_all_allocations();
+            uint16_t max_paragraphs = 0;
+            if ( !ResizeMemory( g_currentPSP, new_paragraphs, max_paragraphs ) )
+                tracer.Trace( "  can't grow the TSR's block; keeping %#x paragraphs resident\n", max_paragraphs );
 
             DOSPSP * psp = (DOSPSP *) cpu.flat_address( g_currentPSP, 0 );
             if ( psp && ( g_currentPSP != g_mainPSP ) )
@@ -6613,8 +8099,7 @@ void handle_int_21( uint8_t c )
                 MarkBuiltInBusy( fe.handle );
                 fe.mode = openmode;
                 fe.seg_process = g_currentPSP;
-                g_fileEntries.push_back( fe );
-                SortFileHandles();
+                AddFileEntry( fe );
                 cpu.set_ax( fe.handle );
                 cpu.set_carry( false );
                 tracer.Trace( "  successfully opened file, using new handle %04x\n", cpu.get_ax() );
@@ -6679,6 +8164,19 @@ void handle_int_21( uint8_t c )
 
                 if ( 0 == handle )
                 {
+                    if ( g_batchIO )
+                    {
+                        // batch mode: a blocking read straight from redirected stdin. 0 bytes means end of file.
+
+                        uint8_t * p = cpu.flat_address8( cpu.get_ds(), cpu.get_dx() );
+                        VideoMemoryWillChange( p, cpu.get_cx() );
+                        int numRead = ConsoleConfiguration::redirected_read( p, cpu.get_cx() );
+                        cpu.set_ax( (uint16_t) numRead );
+                        cpu.set_carry( false );
+                        tracer.Trace( "  batch read of stdin returned %d bytes\n", numRead );
+                        return;
+                    }
+
                     if ( g_use80xRowsMode )
                         UpdateDisplay();
 
@@ -6763,6 +8261,7 @@ void handle_int_21( uint8_t c )
                 if ( cur < size )
                 {
                     uint32_t toRead = get_min( (uint32_t) len, size - cur );
+                    VideoMemoryWillChange( p, toRead );
                     memset( p, 0, toRead );
                     tracer.Trace( "  attempting to read %u == %04x bytes \n", toRead, toRead );
                     size_t numRead = fread( p, 1, toRead, fp );
@@ -6821,7 +8320,9 @@ void handle_int_21( uint8_t c )
 
                 if ( 1 == handle || 2 == handle )
                 {
-                    if ( g_use80xRowsMode )
+                    if ( g_batchIO )
+                        send_batch_output( handle, p, cpu.get_cx() );
+                    else if ( g_use80xRowsMode )
                     {
                         uint8_t displayPage = GetActiveDisplayPage();
                         uint8_t * pbuf = GetVideoMem( displayPage );
@@ -6874,19 +8375,19 @@ void handle_int_21( uint8_t c )
                     else
                     {
                         tracer.TraceBinaryData( p, cpu.get_cx(), 4 );
-                        tracer.Trace( "  writing text to display: '" );
+
+                        // send runs of characters at once, skipping those that shouldn't be displayed.
+
+                        uint16_t start = 0;
                         for ( uint16_t x = 0; x < cpu.get_cx(); x++ )
                         {
-                            // intel c v4.5 generates apps where sprintf and printf insert a 0xf7 instead of the final digit of a floating point number
-
-                            if ( 0x0b != p[ x ] && 0xf7 != p[ x ] )
+                            if ( skip_output_character( p[ x ] ) )
                             {
-                                send_character( p[ x ] );
-                                tracer.Trace( "%c", printable( p[x] ) );
+                                send_characters( p + start, x - start );
+                                start = x + 1;
                             }
                         }
-                        tracer.Trace( "'\n" );
-                        fflush( 0 ); // Linux needs this or the output is cached
+                        send_characters( p + start, cpu.get_cx() - start );
                     }
                 }
                 else if ( 0 == handle )
@@ -6904,6 +8405,7 @@ void handle_int_21( uint8_t c )
                 cpu.set_ax( 0 );
 
                 size_t numWritten = fwrite( p, len, 1, fp );
+                InvalidateFCBCaches( g_fileEntries[ index ].path, fp );
                 if ( numWritten || ( 0 == len ) )
                 {
                     cpu.set_ax( len );
@@ -7227,8 +8729,7 @@ void handle_int_21( uint8_t c )
                     MarkBuiltInBusy( fe.handle );
                     fe.mode = entry.mode;
                     fe.seg_process = g_currentPSP;
-                    g_fileEntries.push_back( fe );
-                    SortFileHandles();
+                    AddFileEntry( fe );
                     cpu.set_ax( fe.handle );
                     cpu.set_carry( false );
                     tracer.Trace( "  successfully created duplicate handle of %04x as %04x\n", existing_handle, cpu.get_ax() );
@@ -7309,8 +8810,7 @@ void handle_int_21( uint8_t c )
                         MarkBuiltInBusy( fe.handle );
                         fe.mode = entry.mode;
                         fe.seg_process = g_currentPSP;
-                        g_fileEntries.push_back( fe );
-                        SortFileHandles();
+                        AddFileEntry( fe );
                         cpu.set_cx( fe.handle );
                         cpu.set_carry( false );
                         tracer.Trace( "  successfully created duplicate handle of %04x as %04x\n", hbx, cpu.get_cx() );
@@ -7453,8 +8953,8 @@ void handle_int_21( uint8_t c )
             // returns: carry = true on failure. ax = error code on failure. bx = maximum valid request on failure.
             // lots of opportunity for improvement here.
 
-            size_t entry = FindAllocationEntry( cpu.get_es() );
-            if ( -1 == entry )
+            DOSMemoryControlBlock * pmcb = FindAllocation( cpu.get_es() );
+            if ( 0 == pmcb )
             {
                 cpu.set_carry( true );
                 cpu.set_bx( 0 );
@@ -7462,23 +8962,11 @@ void handle_int_21( uint8_t c )
                 return;
             }
 
-            size_t cEntries = g_allocEntries.size();
-            assert( 0 != cEntries ); // loading the app creates 1 that shouldn't be freed.
             assert( 0 != cpu.get_bx() ); // not legal to allocate 0 bytes
-            trace_all_allocations();
-
-            uint16_t maxParas;
-            if ( entry == ( cEntries - 1 ) )
-                maxParas = g_segHardware - g_allocEntries[ entry ].segment;
-            else
-            {
-                maxParas = g_allocEntries[ entry + 1 ].segment - g_allocEntries[ entry ].segment;
-                if ( 0 != maxParas )
-                    maxParas--;        // reserve space for the MCB
-            }
 
             uint16_t requestedSize = cpu.get_bx();
-            tracer.Trace( "  maximum reallocation paragraphs: %04x, requested size %04x\n", maxParas, requestedSize );
+            uint16_t currentSize = pmcb->paras; // doesn't include the MCB
+            tracer.Trace( "  current paragraphs: %04x, requested size %04x\n", currentSize, requestedSize );
 
             if ( ends_with( g_acApp, "pc.exe" ) && ( requestedSize < 0x4000 ) )
             {
@@ -7486,7 +8974,8 @@ void handle_int_21( uint8_t c )
                 requestedSize = 0x4000;
             }
 
-            if ( requestedSize > maxParas )
+            uint16_t maxParas = 0;
+            if ( !ResizeMemory( cpu.get_es(), requestedSize, maxParas ) )
             {
                 cpu.set_carry( true );
                 cpu.set_ax( 8 ); // insufficient memory
@@ -7496,7 +8985,6 @@ void handle_int_21( uint8_t c )
             else
             {
                 cpu.set_carry( false );
-                uint16_t currentSize = g_allocEntries[ entry ].para_length - 1; // don't include the MCB
                 tracer.Trace( "  allocation length changed from %04x to %04x\n", currentSize, requestedSize );
 
                 if ( g_fillDOSMemoryBlocks )
@@ -7505,15 +8993,13 @@ void handle_int_21( uint8_t c )
                         memset( cpu.flat_address( cpu.get_es() + currentSize, 0 ), 'e', ( requestedSize - currentSize ) * 16 ); // extended
                     else if ( requestedSize < currentSize )
                     {
-                        uint32_t len = ( (uint32_t) currentSize - (uint32_t) requestedSize ) * 16;
-                        tracer.Trace( "setting mem to g/0x67 starting at para %04x, len %u = %05x\n", cpu.get_es() + requestedSize, len, len );
-                        memset( cpu.flat_address( cpu.get_es() + requestedSize, 0 ), 'g', len ); // gone (free due to reduction)
+                        // the first paragraph released now holds the MCB of the free block
+
+                        uint32_t len = ( (uint32_t) currentSize - (uint32_t) requestedSize - 1 ) * 16;
+                        tracer.Trace( "setting mem to g/0x67 starting at para %04x, len %u = %05x\n", cpu.get_es() + requestedSize + 1, len, len );
+                        memset( cpu.flat_address( cpu.get_es() + requestedSize + 1, 0 ), 'g', len ); // gone (free due to reduction)
                     }
                 }
-
-                g_allocEntries[ entry ].para_length = 1 + requestedSize; // para_length includes the MCB
-                reset_mcb_tags();
-                trace_all_allocations();
             }
 
             return;
@@ -7639,7 +9125,6 @@ void handle_int_21( uint8_t c )
                        cpu.setmword( pae->func1SS, pae->func1SP, 0xffff );
                     }
 
-                    strcpy( g_lastLoadedApp, acCommandPath );
                     DOSPSP * psp = (DOSPSP *) cpu.flat_address( seg_psp, 0 );
                     psp->segParent = g_currentPSP;
                     psp->parentSS = save_ss; // as a courtesy to sloppy apps that don't restore their stack and use the child process stack
@@ -8025,18 +9510,28 @@ void handle_int_21( uint8_t c )
         {
             // get/set memory allocation strategy
             // al = 0 for get, 1 for set
-            // bl = strategy in/out 0 == first fit, 1 = best fit, 2 = last fit (from top of memory down)
+            // bl = strategy in (set), ax and bl = strategy out (get). 0 == first fit, 1 = best fit, 2 = last fit (from top of memory down)
             // cf set on failure, clear on success
 
             if ( 0 == cpu.al() )
             {
-                cpu.set_bl( 0 );
+                cpu.set_ax( g_allocStrategy );
+                cpu.set_bl( g_allocStrategy );
                 cpu.set_carry( false );
             }
             else if ( 1 == cpu.al() )
             {
                 tracer.Trace( " set memory allocation strategy to %u\n", cpu.bl() );
-                cpu.set_carry( false );
+                if ( ( cpu.bl() & 3 ) > 2 )
+                {
+                    cpu.set_ax( 1 ); // invalid function
+                    cpu.set_carry( true );
+                }
+                else
+                {
+                    g_allocStrategy = cpu.bl();
+                    cpu.set_carry( false );
+                }
             }
             else
             {
@@ -8196,38 +9691,1448 @@ void handle_int_21( uint8_t c )
     }
 } //handle_int_21
 
-uint8_t toBCD( uint8_t x )
+// Machine snapshots. -save writes one the first time the app waits for keyboard input (the int 0x69
+// syscall hasn't been handled yet, so cs:ip is that instruction) and -load resumes there, skipping
+// however long the app took to get ready. Values are stored little-endian. DOS memory is stored in
+// pages; pages of zeros are elided and the rest are run-length encoded.
+
+const char SnapshotSignature[] = "NTVDMSS2";
+const uint32_t SnapshotPageSize = 4096;
+
+class CSnapshotWriter
 {
-    if ( x <= 9 )
-        return x;
+    public:
+        vector<uint8_t> data;
 
-    return ( ( x / 10 ) << 4 ) | ( x % 10 );
-} //toBCD
+        void U8( uint8_t x ) { data.push_back( x ); }
+        void U16( uint16_t x ) { U8( (uint8_t) x ); U8( (uint8_t) ( x >> 8 ) ); }
+        void U32( uint32_t x ) { U16( (uint16_t) x ); U16( (uint16_t) ( x >> 16 ) ); }
+        void Bytes( const void * p, size_t len ) { data.insert( data.end(), (const uint8_t *) p, (const uint8_t *) p + len ); }
+        void String( const char * p ) { uint16_t len = (uint16_t) strlen( p ); U16( len ); Bytes( p, len ); }
 
-void TrackInterruptsCalled( uint8_t interrupt_num, uint8_t ah, bool ah_used )
+        void CompressedPage( const uint8_t * p, size_t len )
+        {
+            // control byte c < 0x80: c + 1 literal bytes follow. c >= 0x80: the next byte repeats c - 0x7d times (3..130)
+
+            size_t i = 0;
+            while ( i < len )
+            {
+                size_t run = 1;
+                while ( ( i + run ) < len && run < 130 && p[ i + run ] == p[ i ] )
+                    run++;
+
+                if ( run >= 3 )
+                {
+                    U8( (uint8_t) ( run + 0x7d ) );
+                    U8( p[ i ] );
+                    i += run;
+                    continue;
+                }
+
+                size_t start = i;
+                while ( i < len && ( i - start ) < 128 )
+                {
+                    if ( ( i + 2 ) < len && p[ i ] == p[ i + 1 ] && p[ i ] == p[ i + 2 ] )
+                        break;
+                    i++;
+                }
+
+                U8( (uint8_t) ( i - start - 1 ) );
+                Bytes( p + start, i - start );
+            }
+        } //CompressedPage
+}; //CSnapshotWriter
+
+class CSnapshotReader
 {
-    bool found = false;
-    size_t cEntries = g_InterruptsCalled.size();
-    for ( size_t i = 0; i < cEntries; i++ )
+    private:
+        const vector<uint8_t> & data;
+        size_t offset;
+        bool ok;
+
+        bool Available( size_t len )
+        {
+            if ( ok && ( len <= ( data.size() - offset ) ) )
+                return true;
+
+            ok = false;
+            return false;
+        } //Available
+
+    public:
+        CSnapshotReader( const vector<uint8_t> & d ) : data( d ), offset( 0 ), ok( true ) {}
+
+        bool Ok() { return ok; }
+        uint8_t U8() { return Available( 1 ) ? data[ offset++ ] : 0; }
+        uint16_t U16() { uint16_t lo = U8(); return (uint16_t) ( lo | ( U8() << 8 ) ); }
+        uint32_t U32() { uint32_t lo = U16(); return lo | ( (uint32_t) U16() << 16 ); }
+
+        void Bytes( void * p, size_t len )
+        {
+            if ( Available( len ) )
+            {
+                memcpy( p, & data[ offset ], len );
+                offset += len;
+            }
+        } //Bytes
+
+        void String( char * p, size_t size )
+        {
+            size_t len = U16();
+            if ( len >= size )
+                ok = false;
+            else
+            {
+                Bytes( p, len );
+                p[ len ] = 0;
+            }
+        } //String
+
+        void CompressedPage( uint8_t * p, size_t len )
+        {
+            size_t i = 0;
+            while ( ok && i < len )
+            {
+                uint8_t c = U8();
+                if ( c >= 0x80 )
+                {
+                    size_t run = c - 0x7d;
+                    uint8_t x = U8();
+                    if ( run > ( len - i ) )
+                        ok = false;
+                    else
+                    {
+                        memset( p + i, x, run );
+                        i += run;
+                    }
+                }
+                else
+                {
+                    size_t count = 1 + (size_t) c;
+                    if ( count > ( len - i ) )
+                        ok = false;
+                    else
+                    {
+                        Bytes( p + i, count );
+                        i += count;
+                    }
+                }
+            }
+        } //CompressedPage
+}; //CSnapshotReader
+
+bool is_app_waiting_for_input( uint8_t interrupt_num, uint8_t ah )
+{
+    CKbdBuffer kbd_buf;
+    if ( !kbd_buf.IsEmpty() )
+        return false;
+
+    if ( 0x16 == interrupt_num )
+        return ( 0 == ah || 0x10 == ah || ( g_int16_1_loop && ( 1 == ah || 0x11 == ah ) ) );
+
+    if ( 0x21 == interrupt_num )
+        return ( 1 == ah || 7 == ah || 8 == ah || 0xa == ah || ( 0x3f == ah && 0 == cpu.get_bx() ) );
+
+    return false;
+} //is_app_waiting_for_input
+
+bool SaveMachineSnapshot( const char * pfile )
+{
+    CSnapshotWriter w;
+    w.Bytes( SnapshotSignature, 8 );
+
+    char acCurDir[ MAX_PATH ];
+    if ( !getcwd( acCurDir, sizeof( acCurDir ) ) )
+        acCurDir[ 0 ] = 0;
+
+    w.String( g_acApp );
+    w.String( g_acRoot );
+    w.String( acCurDir );
+    w.U8( g_use80xRowsMode );
+
+    uint16_t regs[] = { cpu.get_ax(), cpu.get_bx(), cpu.get_cx(), cpu.get_dx(), cpu.get_si(), cpu.get_di(), cpu.get_bp(),
+                        cpu.get_sp(), cpu.get_ip(), cpu.get_es(), cpu.get_cs(), cpu.get_ss(), cpu.get_ds(), cpu.get_flags() };
+    for ( size_t i = 0; i < _countof( regs ); i++ )
+        w.U16( regs[ i ] );
+
+    w.U16( g_diskTransferSegment );
+    w.U16( g_diskTransferOffset );
+    w.U16( g_currentPSP );
+    w.U16( g_mainPSP );
+    w.U16( g_segHardware );
+    for ( size_t i = 0; i < _countof( g_builtInHandles ); i++ )
+        w.U16( g_builtInHandles[ i ] );
+    w.U8( g_IsIntelC45App );
+    w.U8( g_PackedFileCorruptWorkaround );
+
+    w.U16( g_segFirstMCB ); // the MCB chain itself is in guest memory
+    w.U8( g_allocStrategy );
+
+    // open files are reopened by path on load, so make sure what's been written is on disk
+
+    uint32_t openFiles = 0;
+    for ( size_t i = 0; i < g_fileEntries.size(); i++ )
+        if ( g_fileEntries[ i ].fp )
+            openFiles++;
+
+    w.U32( openFiles );
+    for ( size_t i = 0; i < g_fileEntries.size(); i++ )
     {
-        IntCalled & ic = g_InterruptsCalled[ i ];
-        if ( ( interrupt_num == ic.i ) && ( ( !ah_used ) || ( ah == ic.c ) ) )
+        FileEntry & fe = g_fileEntries[ i ];
+        if ( fe.fp )
+        {
+            fflush( fe.fp );
+            w.U16( fe.handle );
+            w.U8( fe.mode );
+            w.U16( fe.seg_process );
+            w.U32( (uint32_t) ftell( fe.fp ) );
+            w.String( fe.path );
+        }
+    }
+
+    openFiles = 0;
+    for ( size_t i = 0; i < g_fileEntriesFCB.size(); i++ )
+        if ( g_fileEntriesFCB[ i ].fp )
+            openFiles++;
+
+    w.U32( openFiles );
+    for ( size_t i = 0; i < g_fileEntriesFCB.size(); i++ )
+    {
+        FCBFileEntry & fe = g_fileEntriesFCB[ i ];
+        if ( fe.fp )
+        {
+            fflush( fe.fp );
+            w.U32( (uint32_t) i );
+            w.U16( fe.handle );
+            w.U8( fe.mode );
+            w.U16( fe.seg_process );
+            w.Bytes( fe.dosName, sizeof( fe.dosName ) );
+            w.String( fe.path );
+        }
+    }
+
+    uint32_t zeroPages = 0;
+    w.U32( SnapshotPageSize );
+    w.U32( (uint32_t) sizeof( memory ) );
+    for ( size_t offset = 0; offset < sizeof( memory ); offset += SnapshotPageSize )
+    {
+        size_t len = get_min( (size_t) SnapshotPageSize, sizeof( memory ) - offset );
+        const uint8_t * p = memory + offset;
+        bool zero = ( 0 == p[ 0 ] ) && ( 0 == memcmp( p, p + 1, len - 1 ) );
+        w.U8( !zero );
+        if ( zero )
+            zeroPages++;
+        else
+            w.CompressedPage( p, len );
+    }
+
+    CFile file( fopen( pfile, "wb" ) );
+    if ( 0 == file.get() )
+    {
+        tracer.Trace( "  can't create snapshot file '%s', error %d\n", pfile, errno );
+        return false;
+    }
+
+    bool ok = ( w.data.size() == fwrite( w.data.data(), 1, w.data.size(), file.get() ) );
+    tracer.Trace( "  wrote snapshot '%s' at %04x:%04x, %zd bytes, %u zero pages elided, ok %d\n",
+                  pfile, cpu.get_cs(), cpu.get_ip(), w.data.size(), zeroPages, ok );
+    return ok;
+} //SaveMachineSnapshot
+
+bool ReadMachineSnapshot( const char * pfile, vector<uint8_t> & data, char * pApp, bool & use80xRows )
+{
+    // read the file and the fields main() needs before the snapshot can be applied
+
+    CFile file( fopen( pfile, "rb" ) );
+    if ( 0 == file.get() )
+        return false;
+
+    long len = portable_filelen( file.get() );
+    if ( len <= 8 )
+        return false;
+
+    data.resize( len );
+    if ( (size_t) len != fread( data.data(), 1, len, file.get() ) )
+        return false;
+
+    if ( memcmp( data.data(), SnapshotSignature, 8 ) )
+        return false;
+
+    CSnapshotReader r( data );
+    char acSignature[ 8 ];
+    r.Bytes( acSignature, sizeof( acSignature ) );
+    r.String( pApp, MAX_PATH );
+    char acSkip[ MAX_PATH ];
+    r.String( acSkip, sizeof( acSkip ) ); // last loaded app
+    r.String( acSkip, sizeof( acSkip ) ); // root
+    r.String( acSkip, sizeof( acSkip ) ); // current directory
+    use80xRows = ( 0 != r.U8() );
+    return r.Ok();
+} //ReadMachineSnapshot
+
+bool ApplyMachineSnapshot( const vector<uint8_t> & data )
+{
+    CSnapshotReader r( data );
+    char acSignature[ 8 ];
+    r.Bytes( acSignature, sizeof( acSignature ) );
+
+    char acCurDir[ MAX_PATH ];
+    r.String( g_acApp, sizeof( g_acApp ) );
+    r.String( g_acRoot, sizeof( g_acRoot ) );
+    r.String( acCurDir, sizeof( acCurDir ) );
+    r.U8(); // 80x rows mode was handled by main()
+
+    cpu.set_ax( r.U16() );
+    cpu.set_bx( r.U16() );
+    cpu.set_cx( r.U16() );
+    cpu.set_dx( r.U16() );
+    cpu.set_si( r.U16() );
+    cpu.set_di( r.U16() );
+    cpu.set_bp( r.U16() );
+    cpu.set_sp( r.U16() );
+    cpu.set_ip( r.U16() );
+    cpu.set_es( r.U16() );
+    cpu.set_cs( r.U16() );
+    cpu.set_ss( r.U16() );
+    cpu.set_ds( r.U16() );
+    cpu.set_flags( r.U16() );
+
+    g_diskTransferSegment = r.U16();
+    g_diskTransferOffset = r.U16();
+    g_currentPSP = r.U16();
+    g_mainPSP = r.U16();
+    g_segHardware = r.U16();
+    for ( size_t i = 0; i < _countof( g_builtInHandles ); i++ )
+        g_builtInHandles[ i ] = r.U16();
+    g_IsIntelC45App = ( 0 != r.U8() );
+    g_PackedFileCorruptWorkaround = ( 0 != r.U8() );
+
+    g_segFirstMCB = r.U16();
+    g_allocStrategy = r.U8();
+
+    if ( acCurDir[ 0 ] )
+    {
+#ifdef _WIN32
+        int ret = _chdir( acCurDir );
+#else
+        int ret = chdir( acCurDir );
+#endif
+        if ( 0 != ret )
+            tracer.Trace( "  can't change to snapshot directory '%s', error %d\n", acCurDir, errno );
+    }
+
+    uint32_t count = r.U32();
+    for ( uint32_t i = 0; r.Ok() && i < count; i++ )
+    {
+        FileEntry fe = {0};
+        fe.handle = r.U16();
+        fe.mode = r.U8();
+        fe.seg_process = r.U16();
+        uint32_t position = r.U32();
+        r.String( fe.path, sizeof( fe.path ) );
+        if ( !r.Ok() )
+            break;
+
+        fe.fp = fopen( fe.path, ( 0 != fe.mode ) ? "r+b" : "rb" );
+        if ( !fe.fp )
+        {
+            tracer.Trace( "  can't reopen snapshot file '%s', error %d\n", fe.path, errno );
+            return false;
+        }
+
+        fseek( fe.fp, position, SEEK_SET );
+        AddFileEntry( fe );
+    }
+
+    count = r.U32();
+    for ( uint32_t i = 0; r.Ok() && i < count; i++ )
+    {
+        uint32_t slot = r.U32();
+        if ( slot >= 0x10000 )
+            return false;
+
+        if ( slot >= g_fileEntriesFCB.size() )
+            g_fileEntriesFCB.resize( slot + 1 );
+
+        FCBFileEntry & fe = g_fileEntriesFCB[ slot ];
+        fe.handle = r.U16();
+        fe.mode = r.U8();
+        fe.seg_process = r.U16();
+        r.Bytes( fe.dosName, sizeof( fe.dosName ) );
+        r.String( fe.path, sizeof( fe.path ) );
+        if ( !r.Ok() )
+            break;
+
+        // FCB I/O positions come from the FCB itself, so the file position doesn't matter
+
+        fe.fp = fopen( fe.path, ( 0 != fe.mode ) ? "r+b" : "rb" );
+        if ( !fe.fp )
+        {
+            tracer.Trace( "  can't reopen snapshot FCB file '%s', error %d\n", fe.path, errno );
+            return false;
+        }
+
+        fe.hostOffset = 0;
+        fe.lastOp = 0;
+        fe.fileSize = (uint32_t) portable_filelen( fe.fp );
+        fe.bufOffset = 0;
+        fe.bufLength = 0;
+    }
+
+    uint32_t pageSize = r.U32();
+    uint32_t memorySize = r.U32();
+    if ( SnapshotPageSize != pageSize || sizeof( memory ) != memorySize )
+        return false;
+
+    for ( size_t offset = 0; r.Ok() && offset < sizeof( memory ); offset += SnapshotPageSize )
+    {
+        size_t len = get_min( (size_t) SnapshotPageSize, sizeof( memory ) - offset );
+        if ( r.U8() )
+            r.CompressedPage( memory + offset, len );
+        else
+            memset( memory + offset, 0, len );
+    }
+
+    ClearLastUpdateBuffer(); // redraw the whole display
+    tracer.Trace( "  applied snapshot; resuming at %04x:%04x, ok %d\n", cpu.get_cs(), cpu.get_ip(), r.Ok() );
+    return r.Ok();
+} //ApplyMachineSnapshot
+
+uint8_t toBCD( uint8_t x )
+{
+    if ( x <= 9 )
+        return x;
+
+    return ( ( x / 10 ) << 4 ) | ( x % 10 );
+} //toBCD
+
+void TrackInterruptsCalled( uint8_t interrupt_num, uint8_t ah, bool ah_used )
+{
+    bool found = false;
+    size_t cEntries = g_InterruptsCalled.size();
+    for ( size_t i = 0; i < cEntries; i++ )
+    {
+        IntCalled & ic = g_InterruptsCalled[ i ];
+        if ( ( interrupt_num == ic.i ) && ( ( !ah_used ) || ( ah == ic.c ) ) )
+        {
+            ic.calls++;
+            found = true;
+            break;
+        }
+    }
+
+    if ( !found )
+    {
+        IntCalled ic;
+        ic.i = interrupt_num;
+        ic.c = ah_used ? ah : 0xffff;
+        ic.calls = 1;
+        g_InterruptsCalled.push_back( ic );
+    }
+} //TrackInterruptsCalled
+
+// LIM EMS 4.0 expanded memory (-ems). Logical pages are 16k and live in a host-side store. The page frame
+// at EmsFrameSegment holds four physical pages. Where guest memory is mmap'd, mapping a logical page
+// remaps that page of the store into the frame, so the app and the store share the bytes and nothing is
+// copied. Elsewhere pages are copied into and out of the frame as mappings change, and while a page is
+// mapped the frame holds its current contents.
+
+const uint16_t EmsFrameSegment = 0xe000;
+const uint16_t EmsDriverSegment = 0x00f0;         // apps look for EMMXXXX0 at int 67h's segment:000a. must be < 0x1000 for int 69h
+const uint16_t EmsDriverEntry = 0x0012;           // int 67h handler offset in EmsDriverSegment
+const uint32_t EmsPageSize = 16 * 1024;
+const uint16_t EmsPhysicalPages = 4;
+const uint16_t EmsMaxHandles = 255;
+const uint16_t EmsUnmapped = 0xffff;
+
+struct EmsHandle
+{
+    bool inUse;
+    char name[ 8 ];                               // not null-terminated if 8 characters
+    vector<uint16_t> pages;                       // store page for each logical page
+    bool mapSaved;                                // true after 47h and before 48h
+    uint16_t savedMap[ EmsPhysicalPages ];        // saved g_emsMapped
+};
+
+static uint8_t * g_emsStore = 0;                  // host memory for all logical pages
+static uint16_t g_emsTotalPages = 0;              // 0 if EMS isn't enabled
+static vector<bool> g_emsPageUsed;                // which store pages are allocated to a handle
+static vector<EmsHandle> g_emsHandles;            // handle 0 is reserved for the OS
+static uint16_t g_emsMapped[ EmsPhysicalPages ];  // store page mapped in each physical page or EmsUnmapped
+static bool g_emsRemap = false;                   // true if mappings are done with mmap, not copies
+#if USE_MMAP
+static int g_emsFd = -1;                          // backs g_emsStore when remapping
+#endif
+
+static uint8_t * EmsFramePage( uint16_t physical )
+{
+    return cpu.flat_address8( EmsFrameSegment + physical * ( EmsPageSize / 16 ), 0 );
+} //EmsFramePage
+
+static uint8_t * EmsPagePointer( uint16_t storePage )
+{
+    // when copying, a mapped page's current contents are in the frame, not the store
+
+    if ( !g_emsRemap )
+        for ( uint16_t p = 0; p < EmsPhysicalPages; p++ )
+            if ( storePage == g_emsMapped[ p ] )
+                return EmsFramePage( p );
+
+    return g_emsStore + (size_t) storePage * EmsPageSize;
+} //EmsPagePointer
+
+static void EmsMapPhysical( uint16_t physical, uint16_t storePage )
+{
+    uint8_t * pframe = EmsFramePage( physical );
+
+#if USE_MMAP
+    if ( g_emsRemap )
+    {
+        if ( EmsUnmapped == storePage )
+            mmap( pframe, EmsPageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0 );
+        else
+            mmap( pframe, EmsPageSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, g_emsFd, (off_t) storePage * EmsPageSize );
+        g_emsMapped[ physical ] = storePage;
+        return;
+    }
+#endif
+
+    if ( EmsUnmapped != g_emsMapped[ physical ] )
+    {
+        memcpy( g_emsStore + (size_t) g_emsMapped[ physical ] * EmsPageSize, pframe, EmsPageSize );
+        g_emsMapped[ physical ] = EmsUnmapped;
+    }
+
+    if ( EmsUnmapped != storePage )
+    {
+        // aliases aren't supported when copying, so if the page is mapped elsewhere it moves here
+
+        uint8_t * pstore = g_emsStore + (size_t) storePage * EmsPageSize;
+        for ( uint16_t p = 0; p < EmsPhysicalPages; p++ )
+        {
+            if ( storePage == g_emsMapped[ p ] )
+            {
+                memcpy( pstore, EmsFramePage( p ), EmsPageSize );
+                g_emsMapped[ p ] = EmsUnmapped;
+            }
+        }
+
+        memcpy( pframe, pstore, EmsPageSize );
+    }
+
+    g_emsMapped[ physical ] = storePage;
+} //EmsMapPhysical
+
+bool InitializeEms( uint32_t megabytes )
+{
+    g_emsTotalPages = (uint16_t) ( megabytes * 1024 * 1024 / EmsPageSize );
+    size_t storeSize = (size_t) g_emsTotalPages * EmsPageSize;
+
+#if USE_MMAP
+    // the frame can be remapped if guest memory came from mmap, so it's page-aligned
+
+    long pageSize = sysconf( _SC_PAGESIZE );
+    if ( ( pageSize > 0 ) && ( 0 == ( EmsPageSize % pageSize ) ) && ( 0 == ( (size_t) memory % pageSize ) ) )
+    {
+#ifdef __linux__
+        g_emsFd = memfd_create( "ntvdm-ems", 0 );
+#else
+        FILE * fp = tmpfile();
+        g_emsFd = fp ? dup( fileno( fp ) ) : -1;
+        if ( fp )
+            fclose( fp );
+#endif
+        if ( -1 != g_emsFd && 0 == ftruncate( g_emsFd, storeSize ) )
+        {
+            void * p = mmap( 0, storeSize, PROT_READ | PROT_WRITE, MAP_SHARED, g_emsFd, 0 );
+            if ( MAP_FAILED != p )
+            {
+                g_emsStore = (uint8_t *) p;
+                g_emsRemap = true;
+            }
+        }
+    }
+#endif
+
+    if ( !g_emsRemap )
+        g_emsStore = (uint8_t *) calloc( storeSize, 1 );
+
+    if ( 0 == g_emsStore )
+    {
+        g_emsTotalPages = 0;
+        return false;
+    }
+
+    tracer.Trace( "EMS enabled with %u pages, mappings are %s\n", g_emsTotalPages, g_emsRemap ? "remapped" : "copied" );
+    g_emsPageUsed.assign( g_emsTotalPages, false );
+    g_emsHandles.resize( 1 );
+    memset( g_emsHandles[ 0 ].name, 0, sizeof( g_emsHandles[ 0 ].name ) );
+    g_emsHandles[ 0 ].inUse = true;
+    g_emsHandles[ 0 ].mapSaved = false;
+    for ( uint16_t p = 0; p < EmsPhysicalPages; p++ )
+        g_emsMapped[ p ] = EmsUnmapped;
+
+    // a character device header with the EMMXXXX0 name followed by the int 67h handler
+
+    uint8_t * pdriver = cpu.flat_address8( EmsDriverSegment, 0 );
+    memset( pdriver, 0, EmsDriverEntry );
+    * (le16_t *) ( pdriver + 0 ) = 0xffff;    // next driver offset
+    * (le16_t *) ( pdriver + 2 ) = 0xffff;    // next driver segment
+    * (le16_t *) ( pdriver + 4 ) = 0xc000;    // character device that supports ioctl
+    memcpy( pdriver + 0x0a, "EMMXXXX0", 8 );
+
+    uint8_t * routine = pdriver + EmsDriverEntry;
+    routine[ 0 ] = 0xcd; // int
+    routine[ 1 ] = i8086_interrupt_syscall;
+    routine[ 2 ] = 0x67;
+    routine[ 3 ] = 0xcf; // iret. status is returned in ah, not flags
+
+    le32_t * pVectors = (le32_t *) cpu.flat_address( 0, 0 );
+    pVectors[ 0x67 ] = ( EmsDriverSegment << 16 ) | EmsDriverEntry;
+    return true;
+} //InitializeEms
+
+static EmsHandle * EmsGetHandle( uint16_t handle )
+{
+    if ( handle < g_emsHandles.size() && g_emsHandles[ handle ].inUse )
+        return & g_emsHandles[ handle ];
+
+    return 0;
+} //EmsGetHandle
+
+static uint16_t EmsFreePages()
+{
+    uint16_t count = 0;
+    for ( uint16_t p = 0; p < g_emsTotalPages; p++ )
+        if ( !g_emsPageUsed[ p ] )
+            count++;
+
+    return count;
+} //EmsFreePages
+
+static void EmsAddPages( EmsHandle & h, uint16_t count )
+{
+    // the caller has checked that enough pages are free
+
+    for ( uint16_t p = 0; ( p < g_emsTotalPages ) && ( 0 != count ); p++ )
+    {
+        if ( !g_emsPageUsed[ p ] )
+        {
+            g_emsPageUsed[ p ] = true;
+            h.pages.push_back( p );
+            count--;
+        }
+    }
+} //EmsAddPages
+
+static void EmsTrimPages( EmsHandle & h, size_t keep )
+{
+    for ( size_t i = keep; i < h.pages.size(); i++ )
+    {
+        for ( uint16_t p = 0; p < EmsPhysicalPages; p++ )
+            if ( h.pages[ i ] == g_emsMapped[ p ] )
+                EmsMapPhysical( p, EmsUnmapped );
+
+        g_emsPageUsed[ h.pages[ i ] ] = false;
+    }
+
+    h.pages.resize( keep );
+} //EmsTrimPages
+
+static uint8_t EmsAllocate( uint16_t count, bool allowZero, uint16_t & handle )
+{
+    if ( 0 == count && !allowZero )
+        return 0x89; // attempt to allocate 0 pages
+    if ( count > g_emsTotalPages )
+        return 0x87; // more pages than exist
+    if ( count > EmsFreePages() )
+        return 0x88; // more pages than are available
+
+    for ( handle = 1; handle < EmsMaxHandles; handle++ )
+    {
+        if ( handle >= g_emsHandles.size() )
+            g_emsHandles.resize( handle + 1 );
+
+        EmsHandle & h = g_emsHandles[ handle ];
+        if ( !h.inUse )
+        {
+            h.inUse = true;
+            h.mapSaved = false;
+            memset( h.name, 0, sizeof( h.name ) );
+            h.pages.clear();
+            EmsAddPages( h, count );
+            tracer.Trace( "  allocated EMS handle %u with %u pages\n", handle, count );
+            return 0;
+        }
+    }
+
+    return 0x85; // no more handles
+} //EmsAllocate
+
+static uint8_t EmsMapLogical( EmsHandle & h, uint16_t physical, uint16_t logical )
+{
+    if ( physical >= EmsPhysicalPages )
+        return 0x8b; // physical page out of range
+
+    if ( 0xffff == logical )
+        EmsMapPhysical( physical, EmsUnmapped );
+    else if ( logical >= h.pages.size() )
+        return 0x8a; // logical page out of range
+    else
+        EmsMapPhysical( physical, h.pages[ logical ] );
+
+    return 0;
+} //EmsMapLogical
+
+static uint8_t EmsSetMap( const uint16_t * pmap )
+{
+    for ( uint16_t p = 0; p < EmsPhysicalPages; p++ )
+        if ( ( EmsUnmapped != pmap[ p ] ) && ( ( pmap[ p ] >= g_emsTotalPages ) || !g_emsPageUsed[ pmap[ p ] ] ) )
+            return 0xa3; // the saved map is corrupt
+
+    for ( uint16_t p = 0; p < EmsPhysicalPages; p++ )
+        if ( g_emsMapped[ p ] != pmap[ p ] )
+            EmsMapPhysical( p, pmap[ p ] );
+
+    return 0;
+} //EmsSetMap
+
+static uint8_t EmsRegionPointer( uint8_t type, uint16_t handle, uint16_t offset, uint16_t segpage, uint32_t length, vector<uint8_t *> & chunks )
+{
+    // resolve a 57h region to one host pointer per byte run. EMS regions may span non-contiguous store pages
+
+    chunks.clear();
+    if ( 0 == type )
+    {
+        uint32_t flat = ( (uint32_t) segpage << 4 ) + offset;
+        if ( ( flat + length ) > 0x100000 )
+            return 0xa2; // wraps around 1MB
+        chunks.push_back( memory + flat );
+        return 0;
+    }
+
+    if ( 1 != type )
+        return 0x98; // unsupported memory type
+
+    EmsHandle * ph = EmsGetHandle( handle );
+    if ( !ph )
+        return 0x83; // invalid handle
+    if ( offset >= EmsPageSize )
+        return 0x95; // offset beyond the page
+    if ( ( (uint32_t) segpage * EmsPageSize + offset + length ) > ( ph->pages.size() * EmsPageSize ) )
+        return 0x93; // region is bigger than the handle's pages
+
+    for ( uint32_t page = segpage; ( page * EmsPageSize ) < ( (uint32_t) segpage * EmsPageSize + offset + length ); page++ )
+        chunks.push_back( EmsPagePointer( ph->pages[ page ] ) );
+
+    return 0;
+} //EmsRegionPointer
+
+static void EmsRegionCopy( vector<uint8_t *> & chunks, uint8_t type, uint16_t offset, uint8_t * pbuf, uint32_t length, bool toRegion )
+{
+    if ( 0 == type )
+    {
+        if ( toRegion )
+            memcpy( chunks[ 0 ], pbuf, length );
+        else
+            memcpy( pbuf, chunks[ 0 ], length );
+        return;
+    }
+
+    uint32_t done = 0;
+    for ( size_t c = 0; done < length; c++ )
+    {
+        uint32_t start = ( 0 == c ) ? offset : 0;
+        uint32_t len = get_min( EmsPageSize - start, length - done );
+        if ( toRegion )
+            memcpy( chunks[ c ] + start, pbuf + done, len );
+        else
+            memcpy( pbuf + done, chunks[ c ] + start, len );
+        done += len;
+    }
+} //EmsRegionCopy
+
+static uint8_t EmsMoveRegion( bool exchange )
+{
+    // ds:si: length dword, then source and dest each with type byte, handle, offset, and segment or logical page words.
+    // overlapping moves behave as if done through a buffer, so read the whole source before writing.
+
+    uint8_t * pdesc = cpu.flat_address8( cpu.get_ds(), cpu.get_si() );
+    uint32_t length = * (le32_t *) pdesc;
+    uint8_t srcType = pdesc[ 4 ];
+    uint16_t srcHandle = * (le16_t *) ( pdesc + 5 );
+    uint16_t srcOffset = * (le16_t *) ( pdesc + 7 );
+    uint16_t srcSegPage = * (le16_t *) ( pdesc + 9 );
+    uint8_t dstType = pdesc[ 0xb ];
+    uint16_t dstHandle = * (le16_t *) ( pdesc + 0xc );
+    uint16_t dstOffset = * (le16_t *) ( pdesc + 0xe );
+    uint16_t dstSegPage = * (le16_t *) ( pdesc + 0x10 );
+    tracer.Trace( "  EMS %s %u bytes from type %u handle %u %04x:%04x to type %u handle %u %04x:%04x\n", exchange ? "exchange" : "move",
+                  length, srcType, srcHandle, srcSegPage, srcOffset, dstType, dstHandle, dstSegPage, dstOffset );
+
+    if ( length > 0x100000 )
+        return 0x96; // region is too big
+
+    vector<uint8_t *> src, dst;
+    uint8_t result = EmsRegionPointer( srcType, srcHandle, srcOffset, srcSegPage, length, src );
+    if ( 0 == result )
+        result = EmsRegionPointer( dstType, dstHandle, dstOffset, dstSegPage, length, dst );
+    if ( 0 != result )
+        return result;
+
+    vector<uint8_t> srcData( length );
+    EmsRegionCopy( src, srcType, srcOffset, srcData.data(), length, false );
+
+    if ( exchange )
+    {
+        vector<uint8_t> dstData( length );
+        EmsRegionCopy( dst, dstType, dstOffset, dstData.data(), length, false );
+        EmsRegionCopy( src, srcType, srcOffset, dstData.data(), length, true );
+    }
+
+    EmsRegionCopy( dst, dstType, dstOffset, srcData.data(), length, true );
+    return 0;
+} //EmsMoveRegion
+
+void handle_int_67( uint8_t c )
+{
+    // all functions return status in ah. 0 is success
+
+    uint8_t status = 0;
+    EmsHandle * ph = EmsGetHandle( cpu.get_dx() );
+
+    switch ( c )
+    {
+        case 0x40: // get status
+            break;
+        case 0x41: // get page frame segment
+            cpu.set_bx( EmsFrameSegment );
+            break;
+        case 0x42: // get unallocated page count
+            cpu.set_bx( EmsFreePages() );
+            cpu.set_dx( g_emsTotalPages );
+            break;
+        case 0x43: // allocate pages
+        case 0x5a: // allocate standard (al 0) or raw (al 1) pages. 4.0 allows 0 pages
+        {
+            uint16_t handle = 0;
+            status = EmsAllocate( cpu.get_bx(), ( 0x5a == c ), handle );
+            if ( 0 == status )
+                cpu.set_dx( handle );
+            break;
+        }
+        case 0x44: // map/unmap handle page. al physical page, bx logical page, dx handle
+            status = ph ? EmsMapLogical( *ph, cpu.al(), cpu.get_bx() ) : 0x83;
+            break;
+        case 0x45: // deallocate pages
+        {
+            if ( !ph )
+                status = 0x83;
+            else if ( ph->mapSaved )
+                status = 0x86; // a saved page map exists for the handle
+            else
+            {
+                EmsTrimPages( *ph, 0 );
+                if ( 0 != cpu.get_dx() ) // the OS handle is never freed
+                    ph->inUse = false;
+                memset( ph->name, 0, sizeof( ph->name ) );
+            }
+            break;
+        }
+        case 0x46: // get version
+            cpu.set_al( 0x40 );
+            break;
+        case 0x47: // save page map
+        {
+            if ( !ph )
+                status = 0x83;
+            else if ( ph->mapSaved )
+                status = 0x8d; // already saved
+            else
+            {
+                memcpy( ph->savedMap, g_emsMapped, sizeof( g_emsMapped ) );
+                ph->mapSaved = true;
+            }
+            break;
+        }
+        case 0x48: // restore page map
+        {
+            if ( !ph )
+                status = 0x83;
+            else if ( !ph->mapSaved )
+                status = 0x8e; // nothing saved
+            else
+            {
+                status = EmsSetMap( ph->savedMap );
+                ph->mapSaved = false;
+            }
+            break;
+        }
+        case 0x4b: // get handle count
+        {
+            uint16_t count = 0;
+            for ( size_t h = 0; h < g_emsHandles.size(); h++ )
+                if ( g_emsHandles[ h ].inUse )
+                    count++;
+            cpu.set_bx( count );
+            break;
+        }
+        case 0x4c: // get handle pages
+            if ( ph )
+                cpu.set_bx( (uint16_t) ph->pages.size() );
+            else
+                status = 0x83;
+            break;
+        case 0x4d: // get all handle pages. es:di array of handle, pages words
+        {
+            uint16_t count = 0;
+            le16_t * parray = (le16_t *) cpu.flat_address( cpu.get_es(), cpu.get_di() );
+            for ( size_t h = 0; h < g_emsHandles.size(); h++ )
+            {
+                if ( g_emsHandles[ h ].inUse )
+                {
+                    parray[ count * 2 ] = (uint16_t) h;
+                    parray[ count * 2 + 1 ] = (uint16_t) g_emsHandles[ h ].pages.size();
+                    count++;
+                }
+            }
+            cpu.set_bx( count );
+            break;
+        }
+        case 0x4e: // get/set page map. the map is opaque to apps: one store page word per physical page
+        {
+            if ( cpu.al() > 3 )
+                status = 0x8f;
+            else if ( 3 == cpu.al() )
+                cpu.set_al( (uint8_t) sizeof( g_emsMapped ) );
+            else
+            {
+                if ( 0 == cpu.al() || 2 == cpu.al() )
+                {
+                    le16_t * pmap = (le16_t *) cpu.flat_address( cpu.get_es(), cpu.get_di() );
+                    for ( uint16_t p = 0; p < EmsPhysicalPages; p++ )
+                        pmap[ p ] = g_emsMapped[ p ];
+                }
+
+                if ( 1 == cpu.al() || 2 == cpu.al() )
+                {
+                    le16_t * pmap = (le16_t *) cpu.flat_address( cpu.get_ds(), cpu.get_si() );
+                    uint16_t map[ EmsPhysicalPages ];
+                    for ( uint16_t p = 0; p < EmsPhysicalPages; p++ )
+                        map[ p ] = pmap[ p ];
+                    status = EmsSetMap( map );
+                }
+            }
+            break;
+        }
+        case 0x50: // map/unmap multiple pages. al 0 physical page numbers, al 1 segments. ds:si cx entries of logical, physical words
+        {
+            if ( !ph )
+                status = 0x83;
+            else if ( cpu.al() > 1 )
+                status = 0x8f;
+            else
+            {
+                le16_t * pentries = (le16_t *) cpu.flat_address( cpu.get_ds(), cpu.get_si() );
+                for ( uint16_t i = 0; ( 0 == status ) && ( i < cpu.get_cx() ); i++ )
+                {
+                    uint16_t physical = pentries[ i * 2 + 1 ];
+                    if ( 1 == cpu.al() )
+                        physical = (uint16_t) ( physical - EmsFrameSegment ) / (uint16_t) ( EmsPageSize / 16 );
+                    status = EmsMapLogical( *ph, physical, pentries[ i * 2 ] );
+                }
+            }
+            break;
+        }
+        case 0x51: // reallocate pages. bx new count
+        {
+            if ( !ph )
+                status = 0x83;
+            else if ( cpu.get_bx() > g_emsTotalPages )
+                status = 0x87;
+            else if ( cpu.get_bx() > ph->pages.size() && ( cpu.get_bx() - ph->pages.size() ) > EmsFreePages() )
+                status = 0x88;
+            else if ( cpu.get_bx() > ph->pages.size() )
+                EmsAddPages( *ph, (uint16_t) ( cpu.get_bx() - ph->pages.size() ) );
+            else
+                EmsTrimPages( *ph, cpu.get_bx() );
+
+            if ( ph )
+                cpu.set_bx( (uint16_t) ph->pages.size() );
+            break;
+        }
+        case 0x52: // get/set handle attribute. only volatile handles are supported
+        {
+            if ( 0 == cpu.al() || 2 == cpu.al() )
+                cpu.set_al( 0 );
+            else if ( 1 == cpu.al() )
+                status = ( 0 == cpu.bl() ) ? 0 : 0x91; // feature not supported
+            else
+                status = 0x8f;
+            break;
+        }
+        case 0x53: // get (al 0, es:di) or set (al 1, ds:si) handle name
+        {
+            if ( !ph )
+                status = 0x83;
+            else if ( 0 == cpu.al() )
+                memcpy( cpu.flat_address( cpu.get_es(), cpu.get_di() ), ph->name, sizeof( ph->name ) );
+            else if ( 1 == cpu.al() )
+            {
+                char * pname = (char *) cpu.flat_address( cpu.get_ds(), cpu.get_si() );
+                bool blank = true;
+                for ( size_t i = 0; i < sizeof( ph->name ); i++ )
+                    if ( 0 != pname[ i ] )
+                        blank = false;
+
+                for ( size_t h = 0; !blank && h < g_emsHandles.size(); h++ )
+                    if ( g_emsHandles[ h ].inUse && ( & g_emsHandles[ h ] != ph ) && !memcmp( g_emsHandles[ h ].name, pname, sizeof( ph->name ) ) )
+                        status = 0xa1; // name already exists
+
+                if ( 0 == status )
+                    memcpy( ph->name, pname, sizeof( ph->name ) );
+            }
+            else
+                status = 0x8f;
+            break;
+        }
+        case 0x54: // get handle directory (al 0), search for named handle (al 1), get total handles (al 2)
+        {
+            if ( 0 == cpu.al() )
+            {
+                uint8_t * pdir = cpu.flat_address8( cpu.get_es(), cpu.get_di() );
+                uint8_t count = 0;
+                for ( size_t h = 0; h < g_emsHandles.size(); h++ )
+                {
+                    if ( g_emsHandles[ h ].inUse )
+                    {
+                        * (le16_t *) ( pdir + count * 10 ) = (uint16_t) h;
+                        memcpy( pdir + count * 10 + 2, g_emsHandles[ h ].name, 8 );
+                        count++;
+                    }
+                }
+                cpu.set_al( count );
+            }
+            else if ( 1 == cpu.al() )
+            {
+                char * pname = (char *) cpu.flat_address( cpu.get_ds(), cpu.get_si() );
+                status = 0xa0; // not found
+                for ( size_t h = 0; h < g_emsHandles.size(); h++ )
+                {
+                    if ( g_emsHandles[ h ].inUse && !memcmp( g_emsHandles[ h ].name, pname, 8 ) )
+                    {
+                        cpu.set_dx( (uint16_t) h );
+                        status = 0;
+                        break;
+                    }
+                }
+            }
+            else if ( 2 == cpu.al() )
+                cpu.set_bx( EmsMaxHandles );
+            else
+                status = 0x8f;
+            break;
+        }
+        case 0x57: // move (al 0) or exchange (al 1) memory region
+            status = ( cpu.al() > 1 ) ? 0x8f : EmsMoveRegion( 1 == cpu.al() );
+            break;
+        case 0x58: // get mappable physical address array (al 0, es:di) or its entry count (al 1)
+        {
+            if ( 0 == cpu.al() )
+            {
+                le16_t * parray = (le16_t *) cpu.flat_address( cpu.get_es(), cpu.get_di() );
+                for ( uint16_t p = 0; p < EmsPhysicalPages; p++ )
+                {
+                    parray[ p * 2 ] = (uint16_t) ( EmsFrameSegment + p * ( EmsPageSize / 16 ) );
+                    parray[ p * 2 + 1 ] = p;
+                }
+            }
+            else if ( 1 != cpu.al() )
+                status = 0x8f;
+
+            if ( 0 == status )
+                cpu.set_cx( EmsPhysicalPages );
+            break;
+        }
+        case 0x59: // get hardware configuration (al 0, denied to apps) or raw page counts (al 1)
+        {
+            if ( 1 == cpu.al() )
+            {
+                cpu.set_bx( EmsFreePages() );
+                cpu.set_dx( g_emsTotalPages );
+            }
+            else
+                status = ( 0 == cpu.al() ) ? 0xa4 : 0x8f;
+            break;
+        }
+        default:
+            tracer.Trace( "  unimplemented EMS function %02x\n", c );
+            status = 0x84; // function not defined
+    }
+
+    if ( 0 != status )
+        tracer.Trace( "  EMS function %02x failed with status %02x\n", c, status );
+    cpu.set_ah( status );
+} //handle_int_67
+
+// XMS 3.0 extended memory (-xms). Apps find the driver with int 2fh ax 4300h and get its entry point with
+// ax 4310h. Far calls to the entry point run a stub that traps to XmsSyscall. Extended memory blocks live
+// in a host-side arena, so function 0bh moves are a memcpy between memory[] and the arena. There is no
+// HMA because flatten() always wraps addresses at 1MB, so the A20 line can't be enabled.
+
+const uint16_t XmsDriverSegment = 0x00f2;         // must be < 0x1000 for int 69h
+const uint8_t XmsSyscall = 0xfe;                  // not a real interrupt; passed to i8086_invoke_syscall by the stub
+const uint16_t XmsMaxHandles = 64;
+const uint32_t XmsLinearBase = 0x110000;          // lock returns addresses as if blocks were above the HMA
+
+struct XmsHandle
+{
+    bool inUse;
+    uint8_t locks;
+    uint32_t offset;                              // in kilobytes from the start of g_xmsArena
+    uint32_t sizeKB;
+};
+
+static uint8_t * g_xmsArena = 0;                  // host memory for all extended memory blocks
+static uint32_t g_xmsTotalKB = 0;                 // 0 if XMS isn't enabled
+static XmsHandle g_xmsHandles[ XmsMaxHandles ];   // handle n is g_xmsHandles[ n - 1 ]. handle 0 is conventional memory
+
+bool InitializeXms( uint32_t megabytes )
+{
+    g_xmsTotalKB = megabytes * 1024;
+    g_xmsArena = (uint8_t *) calloc( (size_t) g_xmsTotalKB * 1024, 1 );
+    if ( 0 == g_xmsArena )
+    {
+        g_xmsTotalKB = 0;
+        return false;
+    }
+
+    tracer.Trace( "XMS enabled with %u kilobytes\n", g_xmsTotalKB );
+    memset( g_xmsHandles, 0, sizeof( g_xmsHandles ) );
+
+    uint8_t * routine = cpu.flat_address8( XmsDriverSegment, 0 );
+    routine[ 0 ] = 0xcd; // int
+    routine[ 1 ] = i8086_interrupt_syscall;
+    routine[ 2 ] = XmsSyscall;
+    routine[ 3 ] = 0xcb; // retf. apps far call the driver
+    return true;
+} //InitializeXms
+
+static XmsHandle * XmsGetHandle( uint16_t handle )
+{
+    if ( handle >= 1 && handle <= XmsMaxHandles && g_xmsHandles[ handle - 1 ].inUse )
+        return & g_xmsHandles[ handle - 1 ];
+
+    return 0;
+} //XmsGetHandle
+
+static uint32_t XmsFindGap( uint32_t sizeKB, const XmsHandle * pignore, uint32_t & largestKB )
+{
+    // first fit in the arena. returns the offset of the gap or g_xmsTotalKB if there isn't room.
+    // pignore's block is treated as free so reallocation can consider growing in place.
+
+    uint32_t found = g_xmsTotalKB;
+    uint32_t start = 0;
+    largestKB = 0;
+
+    do
+    {
+        // find the block with the lowest offset at or after start
+
+        uint32_t next = g_xmsTotalKB;
+        const XmsHandle * pnext = 0;
+        for ( uint16_t h = 0; h < XmsMaxHandles; h++ )
+        {
+            const XmsHandle & x = g_xmsHandles[ h ];
+            if ( x.inUse && ( & x != pignore ) && ( 0 != x.sizeKB ) && ( x.offset >= start ) && ( x.offset < next ) )
+            {
+                next = x.offset;
+                pnext = & x;
+            }
+        }
+
+        uint32_t gap = next - start;
+        if ( gap > largestKB )
+            largestKB = gap;
+        if ( ( g_xmsTotalKB == found ) && ( gap >= sizeKB ) )
+            found = start;
+
+        start = pnext ? ( pnext->offset + pnext->sizeKB ) : g_xmsTotalKB;
+    } while ( start < g_xmsTotalKB );
+
+    return found;
+} //XmsFindGap
+
+static uint32_t XmsFreeKB()
+{
+    uint32_t used = 0;
+    for ( uint16_t h = 0; h < XmsMaxHandles; h++ )
+        if ( g_xmsHandles[ h ].inUse )
+            used += g_xmsHandles[ h ].sizeKB;
+
+    return g_xmsTotalKB - used;
+} //XmsFreeKB
+
+static uint8_t XmsBlockPointer( uint16_t handle, uint32_t offset, uint32_t length, bool source, uint8_t * & p )
+{
+    // handle 0 means offset is a segment:offset pointer to conventional memory
+
+    if ( 0 == handle )
+    {
+        uint32_t flat = ( ( offset >> 16 ) << 4 ) + ( offset & 0xffff );
+        if ( ( length > 0x100000 ) || ( flat > ( 0x100000 - length ) ) ) // check length first so the sum can't wrap
+            return source ? 0xa4 : 0xa6; // invalid offset
+        p = memory + flat;
+        return 0;
+    }
+
+    XmsHandle * ph = XmsGetHandle( handle );
+    if ( !ph )
+        return source ? 0xa3 : 0xa5; // invalid handle
+    if ( ( offset > ( ph->sizeKB * 1024 ) ) || ( length > ( ph->sizeKB * 1024 - offset ) ) )
+        return source ? 0xa4 : 0xa6; // invalid offset
+
+    p = g_xmsArena + (size_t) ph->offset * 1024 + offset;
+    return 0;
+} //XmsBlockPointer
+
+#pragma pack( push, 1 )
+struct XmsMove
+{
+    le32_t length;
+    le16_t sourceHandle;
+    le32_t sourceOffset;
+    le16_t destHandle;
+    le32_t destOffset;
+};
+#pragma pack(pop)
+
+static uint8_t XmsMoveBlock()
+{
+    XmsMove * pmove = (XmsMove *) cpu.flat_address( cpu.get_ds(), cpu.get_si() );
+    uint32_t length = pmove->length;
+    tracer.Trace( "  XMS move %u bytes from %04x:%08x to %04x:%08x\n", length, (uint16_t) pmove->sourceHandle,
+                  (uint32_t) pmove->sourceOffset, (uint16_t) pmove->destHandle, (uint32_t) pmove->destOffset );
+
+    if ( length & 1 )
+        return 0xa7; // the length must be even
+
+    uint8_t * psource = 0;
+    uint8_t * pdest = 0;
+    uint8_t status = XmsBlockPointer( pmove->sourceHandle, pmove->sourceOffset, length, true, psource );
+    if ( 0 == status )
+        status = XmsBlockPointer( pmove->destHandle, pmove->destOffset, length, false, pdest );
+    if ( 0 == status )
+        memmove( pdest, psource, length );
+
+    return status;
+} //XmsMoveBlock
+
+static uint8_t XmsReallocate( XmsHandle & h, uint32_t sizeKB )
+{
+    if ( 0 != h.locks )
+        return 0xab; // block is locked
+
+    if ( sizeKB <= h.sizeKB )
+    {
+        h.sizeKB = sizeKB;
+        return 0;
+    }
+
+    // grow in place if the following space is free, otherwise move the block
+
+    uint32_t largest;
+    uint32_t inPlace = XmsFindGap( sizeKB, & h, largest );
+    uint32_t offset = ( ( h.offset + sizeKB ) > g_xmsTotalKB ) ? inPlace : h.offset;
+    for ( uint16_t x = 0; ( x < XmsMaxHandles ) && ( offset == h.offset ); x++ )
+    {
+        const XmsHandle & o = g_xmsHandles[ x ];
+        if ( o.inUse && ( & o != & h ) && ( 0 != o.sizeKB ) && ( o.offset >= h.offset ) && ( o.offset < ( h.offset + sizeKB ) ) )
+        {
+            offset = inPlace;
+            break;
+        }
+    }
+
+    if ( ( offset + sizeKB ) > g_xmsTotalKB )
+        return 0xa0; // all extended memory is allocated
+
+    if ( offset != h.offset )
+        memmove( g_xmsArena + (size_t) offset * 1024, g_xmsArena + (size_t) h.offset * 1024, (size_t) h.sizeKB * 1024 );
+
+    h.offset = offset;
+    h.sizeKB = sizeKB;
+    return 0;
+} //XmsReallocate
+
+void handle_xms( uint8_t c )
+{
+    // functions return ax 1 for success or ax 0 and an error code in bl
+
+    uint8_t status = 0;
+    XmsHandle * ph = XmsGetHandle( cpu.get_dx() );
+
+    switch ( c )
+    {
+        case 0x00: // get version
+        {
+            cpu.set_ax( 0x0300 ); // XMS version 3.00
+            cpu.set_bx( 0x0300 ); // driver revision
+            cpu.set_dx( 0 );      // no HMA
+            break;
+        }
+        case 0x01: // request HMA
+        case 0x02: // release HMA
+        {
+            status = 0x90; // HMA does not exist
+            break;
+        }
+        case 0x03: // global enable A20
+        case 0x05: // local enable A20
+        {
+            status = 0x82; // A20 error. addresses always wrap at 1MB
+            break;
+        }
+        case 0x04: // global disable A20
+        case 0x06: // local disable A20
+            break;
+        case 0x07: // query A20
+        {
+            cpu.set_ax( 0 ); // disabled
+            cpu.set_bl( 0 );
+            return;
+        }
+        case 0x08: // query free extended memory
+        {
+            uint32_t largest;
+            XmsFindGap( g_xmsTotalKB + 1, 0, largest );
+            cpu.set_ax( (uint16_t) largest );
+            cpu.set_dx( (uint16_t) XmsFreeKB() );
+            cpu.set_bl( ( 0 == largest ) ? 0xa0 : 0 );
+            return;
+        }
+        case 0x09: // allocate extended memory block
+        {
+            uint32_t sizeKB = cpu.get_dx();
+            uint32_t largest;
+            uint32_t offset = XmsFindGap( sizeKB, 0, largest );
+            if ( ( offset + sizeKB ) > g_xmsTotalKB )
+            {
+                status = 0xa0; // all extended memory is allocated
+                break;
+            }
+
+            status = 0xa1; // all handles are in use
+            for ( uint16_t h = 0; h < XmsMaxHandles; h++ )
+            {
+                XmsHandle & x = g_xmsHandles[ h ];
+                if ( !x.inUse )
+                {
+                    x.inUse = true;
+                    x.locks = 0;
+                    x.offset = offset;
+                    x.sizeKB = sizeKB;
+                    cpu.set_dx( h + 1 );
+                    status = 0;
+                    break;
+                }
+            }
+            break;
+        }
+        case 0x0a: // free extended memory block
+        {
+            if ( !ph )
+                status = 0xa2; // invalid handle
+            else if ( 0 != ph->locks )
+                status = 0xab; // block is locked
+            else
+                ph->inUse = false;
+            break;
+        }
+        case 0x0b: // move extended memory block
+        {
+            status = XmsMoveBlock();
+            break;
+        }
+        case 0x0c: // lock extended memory block
+        {
+            if ( !ph )
+                status = 0xa2; // invalid handle
+            else if ( 0xff == ph->locks )
+                status = 0xac; // lock count overflow
+            else
+            {
+                ph->locks++;
+                uint32_t linear = XmsLinearBase + ph->offset * 1024;
+                cpu.set_dx( (uint16_t) ( linear >> 16 ) );
+                cpu.set_bx( (uint16_t) linear );
+            }
+            break;
+        }
+        case 0x0d: // unlock extended memory block
+        {
+            if ( !ph )
+                status = 0xa2; // invalid handle
+            else if ( 0 == ph->locks )
+                status = 0xaa; // block is not locked
+            else
+                ph->locks--;
+            break;
+        }
+        case 0x0e: // get handle information
+        {
+            if ( !ph )
+                status = 0xa2; // invalid handle
+            else
+            {
+                uint8_t freeHandles = 0;
+                for ( uint16_t h = 0; h < XmsMaxHandles; h++ )
+                    if ( !g_xmsHandles[ h ].inUse )
+                        freeHandles++;
+                cpu.set_bh( ph->locks );
+                cpu.set_bl( freeHandles );
+                cpu.set_dx( (uint16_t) ph->sizeKB );
+            }
+            break;
+        }
+        case 0x0f: // reallocate extended memory block
+        {
+            if ( !ph )
+                status = 0xa2; // invalid handle
+            else
+                status = XmsReallocate( * ph, cpu.get_bx() );
+            break;
+        }
+        case 0x10: // request upper memory block
         {
-            ic.calls++;
-            found = true;
+            cpu.set_dx( 0 ); // largest available
+            status = 0xb1;   // no UMBs are available
+            break;
+        }
+        case 0x11: // release upper memory block
+        case 0x12: // reallocate upper memory block
+        {
+            status = 0xb2; // invalid UMB segment
             break;
         }
+        default:
+        {
+            // the 3.0 functions 88h, 89h, 8eh, and 8fh take 32-bit registers an 8086 doesn't have
+
+            tracer.Trace( "  unimplemented XMS function %02x\n", c );
+            status = 0x80; // function not implemented
+        }
     }
 
-    if ( !found )
+    if ( 0 != status )
     {
-        IntCalled ic;
-        ic.i = interrupt_num;
-        ic.c = ah_used ? ah : 0xffff;
-        ic.calls = 1;
-        g_InterruptsCalled.push_back( ic );
+        tracer.Trace( "  XMS function %02x failed with status %02x\n", c, status );
+        cpu.set_ax( 0 );
+        cpu.set_bl( status );
     }
-} //TrackInterruptsCalled
+    else if ( 0x00 != c )
+        cpu.set_ax( 1 );
+} //handle_xms
 
 void i8086_invoke_syscall( uint8_t interrupt_num )
 {
@@ -8241,6 +11146,18 @@ void i8086_invoke_syscall( uint8_t interrupt_num )
 
     TrackInterruptsCalled( interrupt_num, c, ah_used );
 
+#if USE_FORK
+    if ( g_pcForkServer && ( 0x21 == interrupt_num ) && ( c == g_forkServerFunction ) )
+        RunForkServer();
+#endif
+
+    if ( g_pcSaveSnapshot && is_app_waiting_for_input( interrupt_num, c ) )
+    {
+        if ( !SaveMachineSnapshot( g_pcSaveSnapshot ) )
+            printf( "unable to write snapshot file %s\n", g_pcSaveSnapshot );
+        g_pcSaveSnapshot = 0;
+    }
+
     // restore interrupts since we won't exit with an iret because Carry and Zero in flags must be preserved as a return code
 
     cpu.set_interrupt( true );
@@ -8251,6 +11168,9 @@ void i8086_invoke_syscall( uint8_t interrupt_num )
              ( ( 0x16 == interrupt_num ) && ( 1 == c || 2 == c || 0x11 == c ) ) ) )
         g_int16_1_loop = false;
 
+    if ( g_consoleOutputPending && is_console_input_request( interrupt_num, c ) )
+        flush_console_output();
+
     if ( 0 == interrupt_num )
     {
         tracer.Trace( "    divide by zero interrupt 0\n" );
@@ -8475,11 +11395,28 @@ void i8086_invoke_syscall( uint8_t interrupt_num )
         }
         else if ( 0x1687 == cpu.get_ax() ) // undocumented, used by cobol
             cpu.set_ax( 0 );
+        else if ( 0x4300 == cpu.get_ax() && g_xmsTotalKB ) // XMS installation check
+            cpu.set_al( 0x80 );
+        else if ( 0x4310 == cpu.get_ax() && g_xmsTotalKB ) // get XMS driver entry point
+        {
+            cpu.set_es( XmsDriverSegment );
+            cpu.set_bx( 0 );
+        }
         else
             cpu.set_al( 0x01 ); // not installed, do NOT install
 
         return;
     }
+    else if ( 0x67 == interrupt_num && g_emsTotalPages )
+    {
+        handle_int_67( c );
+        return;
+    }
+    else if ( XmsSyscall == interrupt_num && g_xmsTotalKB )
+    {
+        handle_xms( c );
+        return;
+    }
     else if ( 0x33 == interrupt_num )
     {
         // mouse
@@ -8499,8 +11436,7 @@ void InitializePSP( uint16_t segment, const char * acAppArgs, uint8_t lenAppArgs
     psp->int20Code = 0x20cd;                  // int 20 instruction to terminate app like CP/M
 
     // in segment (paragraph) form. one byte beyond what's allocated to the program.
-    DosAllocation & da = g_allocEntries[ FindAllocationEntry( segment ) ];
-    psp->topOfMemory = segment + da.para_length - 1; // -1 to account for MCB
+    psp->topOfMemory = segment + GetMCB( segment - 1 )->paras;
 
     psp->comAvailable = 0xfeff;               // .com programs bytes available in segment. reserve 0x100 for the stack by convention
 
@@ -8592,6 +11528,314 @@ bool IsBinaryCOM( const char * app, FILE * fp )
     return isCOM;
 } //IsBinaryCOM
 
+bool CheckForIntelC45App( FILE * fp )
+{
+    bool isIntel = false;
+    uint32_t file_size = (uint32_t) portable_filelen( fp );
+
+    if ( file_size > 1000 )
+    {
+        if ( -1 != fseek( fp, file_size - 16, SEEK_SET ) )
+        {
+            char ac8[ 16 ] = {0};
+            if ( fread( ac8, 1, 8, fp ) )
+                isIntel = ( !memcmp( ac8, " instruction\n\r$", 8 ) );
+            fseek( fp, 0, SEEK_SET );
+        }
+    }
+
+    return isIntel;
+} //CheckForIntelC45App
+
+// Programs are run many times in a session: compilers exec their passes with 4Bh, QBX and CL re-exec
+// children, and overlay managers load the same overlay on every swap. Parsed images are cached by path
+// and validated with the file's size and modification time, so reloading is a memcpy plus the fixups.
+
+struct ExeImage
+{
+    uint64_t mtime;                   // modification time of the file when it was read
+    uint64_t host_size;               // size of the file when it was read
+    uint64_t file_size;               // size of file below, which differs from host_size if it was unpacked
+    bool isCOM;                       // a .com file that isn't an MZ exe named .com
+    bool isIntelC45;                  // result of CheckForIntelC45App
+    bool relocsOK;                    // false if the relocation table couldn't be read
+    ExeHeader head;                   // only valid if !isCOM
+    vector<uint8_t> file;             // the whole file, header included
+    vector<ExeRelocation> relocations;
+};
+
+static unordered_map<string, ExeImage> g_exeImageCache; // key is the host path of the executable
+static uint64_t g_exeImageCacheBytes = 0;               // total of the cached files' sizes
+const uint64_t MaxExeImageCacheBytes = 16 * 1024 * 1024; // flush the cache if it gets bigger than this
+
+static bool ExeImageFileInfo( const char * app, uint64_t & mtime, uint64_t & file_size )
+{
+    struct stat statbuf;
+    if ( 0 != stat( app, & statbuf ) )
+        return false;
+
+    file_size = (uint64_t) statbuf.st_size;
+#ifdef __APPLE__
+    mtime = ( (uint64_t) statbuf.st_mtimespec.tv_sec * 1000000000 ) + statbuf.st_mtimespec.tv_nsec;
+#elif defined( _WIN32 ) || defined( WATCOM ) || defined( __mc68000__ )
+    mtime = (uint64_t) statbuf.st_mtime;
+#else
+    mtime = ( (uint64_t) statbuf.st_mtim.tv_sec * 1000000000 ) + statbuf.st_mtim.tv_nsec;
+#endif
+    return true;
+} //ExeImageFileInfo
+
+static bool UnpackExePack( ExeImage & image )
+{
+    // Microsoft EXEPACK images start at a stub that unpacks the app in place, backwards from the end of the
+    // image, then applies the packed relocation table and jumps to the app. The stub fails with "Packed file
+    // is corrupt" when loaded in the first 64k due to reliance on address wrapping, so do the work natively
+    // and replace the image with the unpacked app. Returns false and leaves the image alone if it isn't
+    // EXEPACKed or if anything is inconsistent.
+
+    const ExeHeader & head = image.head;
+    uint32_t codeStart = 16 * (uint32_t) head.header_paragraphs;
+    uint32_t imageSize = (uint32_t) head.blocks_in_file * 512;
+    if ( 0 != head.bytes_in_last_block )
+        imageSize -= ( 512 - head.bytes_in_last_block );
+    if ( ( imageSize <= codeStart ) || ( imageSize > image.file.size() ) )
+        return false;
+    imageSize -= codeStart;
+
+    uint32_t exepackOffset = 16 * (uint32_t) head.relative_cs;
+    uint32_t exepackHeaderLen = head.ip;
+    if ( ( ( 16 != exepackHeaderLen ) && ( 18 != exepackHeaderLen ) ) || ( ( exepackOffset + exepackHeaderLen ) > imageSize ) )
+        return false;
+
+    const uint8_t * pimage = image.file.data() + codeStart;
+    const uint8_t * pexepack = pimage + exepackOffset;
+    if ( 'R' != pexepack[ exepackHeaderLen - 2 ] || 'B' != pexepack[ exepackHeaderLen - 1 ] )
+        return false;
+
+    const le16_t * pfields = (const le16_t *) pexepack;
+    uint16_t real_ip = pfields[ 0 ];
+    uint16_t real_cs = pfields[ 1 ];
+    uint16_t exepack_size = pfields[ 3 ];
+    uint16_t real_sp = pfields[ 4 ];
+    uint16_t real_ss = pfields[ 5 ];
+    uint16_t dest_len = pfields[ 6 ];
+    uint16_t skip_len = ( 18 == exepackHeaderLen ) ? (uint16_t) pfields[ 7 ] : 1;
+    tracer.Trace( "  EXEPACK header: cs:ip %04x:%04x, ss:sp %04x:%04x, unpacked paragraphs %04x, skip %u\n",
+                  real_cs, real_ip, real_ss, real_sp, dest_len, skip_len );
+
+    uint32_t skipBytes = 16 * (uint32_t) ( skip_len ? skip_len - 1 : 0 );
+    if ( ( skipBytes > exepackOffset ) || ( ( exepackOffset + exepack_size ) > imageSize ) )
+        return false;
+
+    // unpack in place like the stub does. copies move data up, so memmove matches the stub's backwards rep movsb
+
+    uint32_t src = exepackOffset - skipBytes;
+    uint32_t dst = 16 * (uint32_t) dest_len;
+    vector<uint8_t> unpacked( get_max( dst, exepackOffset ) );
+    memcpy( unpacked.data(), pimage, exepackOffset );
+
+    while ( src > 0 && 0xff == unpacked[ src - 1 ] )
+        src--;
+
+    for ( ;; )
+    {
+        if ( src < 3 )
+            return false;
+
+        uint8_t command = unpacked[ src - 1 ];
+        uint32_t length = (uint32_t) unpacked[ src - 3 ] | ( (uint32_t) unpacked[ src - 2 ] << 8 );
+        src -= 3;
+
+        if ( 0xb0 == ( command & 0xfe ) )
+        {
+            if ( src < 1 || dst < length )
+                return false;
+            uint8_t fill = unpacked[ --src ];
+            dst -= length;
+            memset( unpacked.data() + dst, fill, length );
+        }
+        else if ( 0xb2 == ( command & 0xfe ) )
+        {
+            if ( src < length || dst < length )
+                return false;
+            src -= length;
+            dst -= length;
+            memmove( unpacked.data() + dst, unpacked.data() + src, length );
+        }
+        else
+        {
+            tracer.Trace( "  invalid EXEPACK command %02x\n", command );
+            return false;
+        }
+
+        if ( command & 1 )
+            break;
+    }
+
+    unpacked.resize( 16 * (uint32_t) dest_len );
+
+    // the packed relocation table follows the stub's error message: for each 64k of the image a count then offsets
+
+    static const char acCorrupt[] = "Packed file is corrupt";
+    const uint8_t * pblock = pexepack + exepackHeaderLen;
+    const uint8_t * pblockEnd = pexepack + exepack_size;
+    const uint8_t * prelocs = 0;
+    for ( const uint8_t * p = pblock; p + sizeof( acCorrupt ) - 1 <= pblockEnd; p++ )
+    {
+        if ( !memcmp( p, acCorrupt, sizeof( acCorrupt ) - 1 ) )
+        {
+            prelocs = p + sizeof( acCorrupt ) - 1;
+            break;
+        }
+    }
+
+    if ( 0 == prelocs )
+        return false;
+
+    vector<ExeRelocation> relocations;
+    for ( uint16_t section = 0; section < 16; section++ )
+    {
+        if ( prelocs + 2 > pblockEnd )
+            return false;
+        uint16_t count = * (const le16_t *) prelocs;
+        prelocs += 2;
+
+        if ( prelocs + 2 * (uint32_t) count > pblockEnd )
+            return false;
+
+        for ( uint16_t i = 0; i < count; i++ )
+        {
+            ExeRelocation reloc;
+            reloc.offset = * (const le16_t *) ( prelocs + 2 * i );
+            reloc.segment = (uint16_t) ( section * 0x1000 );
+            relocations.push_back( reloc );
+        }
+        prelocs += 2 * (uint32_t) count;
+    }
+
+    // the packed image's memory requirements include room for the unpacked image
+
+    uint32_t packedParagraphs = round_up( imageSize, (uint32_t) 16 ) / 16;
+    uint32_t minTotal = packedParagraphs + head.min_extra_paragraphs;
+    uint32_t maxTotal = packedParagraphs + head.max_extra_paragraphs;
+
+    ExeHeader unpackedHead = head;
+    const uint32_t UnpackedHeaderSize = 32;
+    uint32_t unpackedFileSize = UnpackedHeaderSize + (uint32_t) unpacked.size();
+    unpackedHead.bytes_in_last_block = (uint16_t) ( unpackedFileSize % 512 );
+    unpackedHead.blocks_in_file = (uint16_t) ( round_up( unpackedFileSize, (uint32_t) 512 ) / 512 );
+    unpackedHead.num_relocs = (uint16_t) relocations.size();
+    unpackedHead.header_paragraphs = UnpackedHeaderSize / 16;
+    unpackedHead.min_extra_paragraphs = (uint16_t) ( ( minTotal > dest_len ) ? minTotal - dest_len : 0 );
+    if ( 0xffff != head.max_extra_paragraphs )
+        unpackedHead.max_extra_paragraphs = (uint16_t) get_max( ( maxTotal > dest_len ) ? maxTotal - dest_len : 0, (uint32_t) unpackedHead.min_extra_paragraphs );
+    unpackedHead.relative_ss = real_ss;
+    unpackedHead.sp = real_sp;
+    unpackedHead.ip = real_ip;
+    unpackedHead.relative_cs = real_cs;
+    unpackedHead.reloc_table_offset = sizeof( ExeHeader ); // the relocations are kept in the ExeImage, not the file
+
+    vector<uint8_t> file( UnpackedHeaderSize, 0 );
+    memcpy( file.data(), & unpackedHead, sizeof( unpackedHead ) );
+    file.insert( file.end(), unpacked.begin(), unpacked.end() );
+
+    tracer.Trace( "  unpacked EXEPACK image from %u to %u bytes with %zu relocations\n", imageSize, (uint32_t) unpacked.size(), relocations.size() );
+    image.head = unpackedHead;
+    image.file.swap( file );
+    image.file_size = image.file.size();
+    image.relocations.swap( relocations );
+    image.relocsOK = true;
+    return true;
+} //UnpackExePack
+
+const ExeImage * GetExeImage( const char * app )
+{
+    uint64_t mtime = 0, file_size = 0;
+    if ( !ExeImageFileInfo( app, mtime, file_size ) )
+    {
+        tracer.Trace( "  can't stat executable '%s', error %d\n", app, errno );
+        return 0;
+    }
+
+    string key( app );
+    unordered_map<string, ExeImage>::iterator it = g_exeImageCache.find( key );
+    if ( it != g_exeImageCache.end() )
+    {
+        if ( ( it->second.mtime == mtime ) && ( it->second.host_size == file_size ) )
+        {
+            tracer.Trace( "  using the cached image of '%s'\n", app );
+            return & it->second;
+        }
+
+        g_exeImageCacheBytes -= it->second.file_size;
+        g_exeImageCache.erase( it );
+    }
+
+    CFile file( fopen( app, "rb" ) );
+    if ( 0 == file.get() )
+    {
+        tracer.Trace( "  can't open executable '%s', error %d\n", app, errno );
+        return 0;
+    }
+
+    ExeImage image;
+    image.mtime = mtime;
+    image.file_size = (uint64_t) portable_filelen( file.get() );
+    image.host_size = file_size;
+    image.isCOM = IsBinaryCOM( app, file.get() );
+    image.isIntelC45 = !image.isCOM && CheckForIntelC45App( file.get() );
+    image.relocsOK = true;
+    memset( & image.head, 0, sizeof( image.head ) );
+
+    image.file.resize( (size_t) image.file_size );
+    fseek( file.get(), 0, SEEK_SET );
+    if ( image.file_size && ( 1 != fread( image.file.data(), image.file.size(), 1, file.get() ) ) )
+    {
+        tracer.Trace( "  can't read executable '%s', error %d\n", app, errno );
+        return 0;
+    }
+
+    if ( !image.isCOM && ( image.file.size() >= sizeof( ExeHeader ) ) )
+    {
+        memcpy( & image.head, image.file.data(), sizeof( ExeHeader ) );
+        uint32_t relocsEnd = (uint32_t) image.head.reloc_table_offset + (uint32_t) image.head.num_relocs * sizeof( ExeRelocation );
+        if ( relocsEnd <= image.file.size() )
+        {
+            image.relocations.resize( image.head.num_relocs );
+            if ( image.head.num_relocs )
+                memcpy( image.relocations.data(), image.file.data() + image.head.reloc_table_offset, image.head.num_relocs * sizeof( ExeRelocation ) );
+        }
+        else
+            image.relocsOK = false;
+
+        if ( image.relocsOK )
+            UnpackExePack( image );
+    }
+
+    if ( ( g_exeImageCacheBytes + image.file_size ) > MaxExeImageCacheBytes )
+    {
+        tracer.Trace( "  flushing the executable image cache\n" );
+        g_exeImageCache.clear();
+        g_exeImageCacheBytes = 0;
+    }
+
+    g_exeImageCacheBytes += image.file_size;
+    ExeImage & cached = g_exeImageCache[ key ];
+    cached = std::move( image );
+    return & cached;
+} //GetExeImage
+
+static void RelocateExeImage( const ExeImage & image, uint8_t * pcode, uint16_t segRelocationFactor )
+{
+    for ( size_t r = 0; r < image.relocations.size(); r++ )
+    {
+        uint32_t offset = (uint32_t) image.relocations[ r ].offset + (uint32_t) image.relocations[ r ].segment * 16;
+        le16_t * target = (le16_t *) ( pcode + offset );
+        //tracer.TraceQuiet( "  relocation %u offset %u, update %#02x to %#02x\n", r, offset, (uint16_t) *target, (uint16_t) *target + segRelocationFactor );
+        *target += segRelocationFactor;
+    }
+} //RelocateExeImage
+
 uint16_t LoadOverlay( const char * app, uint16_t CodeSegment, uint16_t segRelocationFactor )
 {
     // Used by int21, 4b mode 3: Load Overlay and don't execute.
@@ -8599,39 +11843,30 @@ uint16_t LoadOverlay( const char * app, uint16_t CodeSegment, uint16_t segReloca
     // QuickPascal v1.0 uses this to run child process apps it built (with or without the debugger)
 
     tracer.Trace( "  in LoadOverlay\n" );
-    CFile file( fopen( app, "rb" ) );
-    if ( 0 == file.get() )
-    {
-        tracer.Trace( "can't open executable file, error %d\n", errno );
+    const ExeImage * pimage = GetExeImage( app );
+    if ( 0 == pimage )
         return 1;
-    }
 
-    if ( IsBinaryCOM( app, file.get() ) )
+    if ( pimage->isCOM )
     {
-        long file_size = portable_filelen( file.get() );
+        uint64_t file_size = pimage->file_size;
         if ( file_size > ( 65536 - 0x100) )
         {
             tracer.Trace( "can't read .com file into RAM -- it's too big!\n" );
             return 1;
         }
 
-        size_t blocks_read = fread( cpu.flat_address( CodeSegment, 0 ), file_size, 1, file.get() );
-        if ( 1 != blocks_read )
-        {
-            tracer.Trace( "can't read .com file into RAM, error %d\n", errno );
-            return 1;
-        }
+        memcpy( cpu.flat_address( CodeSegment, 0 ), pimage->file.data(), (size_t) file_size );
     }
     else // EXE
     {
-        ExeHeader head = { 0 };
-        size_t blocks_read = fread( & head, sizeof( head ), 1, file.get() );
-        if ( 1 != blocks_read )
+        if ( pimage->file_size < sizeof( ExeHeader ) )
         {
-            tracer.Trace( "  can't read input executable head '%s', error %d\n", app, errno );
+            tracer.Trace( "  can't read input executable head '%s'\n", app );
             return 1;
         }
 
+        const ExeHeader & head = pimage->head;
         head.Trace();
 
         if ( ( 0x5a4d != head.signature ) && ( 0x4d5a != head.signature ) )
@@ -8654,36 +11889,24 @@ uint16_t LoadOverlay( const char * app, uint16_t CodeSegment, uint16_t segReloca
         tracer.Trace( "  image size of code and initialized data: %u, code starts at %u\n", imageSize, codeStart );
 
         uint8_t * pcode = cpu.flat_address8( CodeSegment, 0 );
-        fseek( file.get(), codeStart, SEEK_SET );
-        blocks_read = fread( pcode, imageSize, 1, file.get() );
-        if ( 1 != blocks_read )
+        if ( ( (uint64_t) codeStart + imageSize ) > pimage->file_size )
         {
-            tracer.Trace( "  can't read input exe file image, error %d", errno );
+            tracer.Trace( "  can't read input exe file image; it's truncated" );
             return 1;
         }
 
+        memcpy( pcode, pimage->file.data() + codeStart, imageSize );
+
         tracer.Trace( "  start of the code:\n" );
         tracer.TraceBinaryData( pcode, get_min( imageSize, (uint32_t) 0x100 ), 4 );
 
-        if ( 0 != head.num_relocs )
+        if ( !pimage->relocsOK )
         {
-            vector<ExeRelocation> relocations( head.num_relocs );
-            fseek( file.get(), head.reloc_table_offset, SEEK_SET );
-            blocks_read = fread( relocations.data(), head.num_relocs * sizeof( ExeRelocation ), 1, file.get() );
-            if ( 1 != blocks_read )
-            {
-                tracer.Trace( "  can't read input exe file relocation data, error %d", errno );
-                return 1;
-            }
-
-            for ( uint16_t r = 0; r < head.num_relocs; r++ )
-            {
-                uint32_t offset = (uint32_t) relocations[ r ].offset + (uint32_t) relocations[ r ].segment * 16;
-                le16_t * target = (le16_t *) ( pcode + offset );
-                //tracer.TraceQuiet( "  relocation %u offset %u, update %#02x to %#02x\n", r, offset, (uint16_t) *target, (uint16_t) *target + segRelocationFactor );
-                *target += segRelocationFactor;
-            }
+            tracer.Trace( "  can't read input exe file relocation data" );
+            return 1;
         }
+
+        RelocateExeImage( *pimage, pcode, segRelocationFactor );
     }
 
     return 0;
@@ -8740,40 +11963,18 @@ uint16_t LoadAsBootSector( const char * acApp, const char * acAppArgs, uint8_t l
     return BSSegment;
 } //LoadAsBootSector
 
-bool CheckForIntelC45App( FILE * fp )
-{
-    bool isIntel = false;
-    uint32_t file_size = (uint32_t) portable_filelen( fp );
-
-    if ( file_size > 1000 )
-    {
-        if ( -1 != fseek( fp, file_size - 16, SEEK_SET ) )
-        {
-            char ac8[ 16 ] = {0};
-            if ( fread( ac8, 1, 8, fp ) )
-                isIntel = ( !memcmp( ac8, " instruction\n\r$", 8 ) );
-            fseek( fp, 0, SEEK_SET );
-        }
-    }
-
-    return isIntel;
-} //CheckForIntelC45App
-
 uint16_t LoadBinary( const char * acApp, const char * acAppArgs, uint8_t lenAppArgs, uint16_t segEnvironment, bool setupRegs,
                      le16_t * reg_ss, le16_t * reg_sp, le16_t * reg_cs, le16_t * reg_ip, bool bootSectorLoad )
 {
     if ( bootSectorLoad )
         return LoadAsBootSector( acApp, acAppArgs, lenAppArgs, segEnvironment );
 
-    CFile file( fopen( acApp, "rb" ) );
-    if ( 0 == file.get() )
-    {
-        tracer.Trace( "  can't open input executable '%s', error %d\n", acApp, errno );
+    const ExeImage * pimage = GetExeImage( acApp );
+    if ( 0 == pimage )
         return 0;
-    }
 
     uint16_t psp = 0;
-    if ( IsBinaryCOM( acApp, file.get() ) )
+    if ( pimage->isCOM )
     {
         // allocate all available RAM for the .COM file
 
@@ -8793,7 +11994,7 @@ uint16_t LoadBinary( const char * acApp, const char * acAppArgs, uint8_t lenAppA
         InitializePSP( ComSegment, acAppArgs, lenAppArgs, segEnvironment );
         tracer.Trace( "  loading com, ComSegment is %04x\n", ComSegment );
 
-        long file_size = portable_filelen( file.get() );
+        uint64_t file_size = pimage->file_size;
         if ( file_size > ( 65536 - 0x100) )
         {
             tracer.Trace( "can't read .com file into RAM -- it's too big!\n" );
@@ -8801,13 +12002,7 @@ uint16_t LoadBinary( const char * acApp, const char * acAppArgs, uint8_t lenAppA
             return 0;
         }
 
-        size_t blocks_read = fread( cpu.flat_address( ComSegment, 0x100 ), file_size, 1, file.get() );
-        if ( 1 != blocks_read )
-        {
-            tracer.Trace( "can't read .com file into RAM, error %d\n", errno );
-            FreeMemory( ComSegment );
-            return 0;
-        }
+        memcpy( cpu.flat_address( ComSegment, 0x100 ), pimage->file.data(), (size_t) file_size );
 
         // ensure the last two bytes (the top of the stack) are 0 so ret at app end exits the app via cp/m legacy mode
 
@@ -8840,19 +12035,17 @@ uint16_t LoadBinary( const char * acApp, const char * acAppArgs, uint8_t lenAppA
     }
     else // EXE
     {
-        g_IsIntelC45App = CheckForIntelC45App( file.get() );
+        g_IsIntelC45App = pimage->isIntelC45;
         tracer.Trace( "  is this probably an Intel C 4.5 app? %s\n", g_IsIntelC45App ? "yes" : "no" );
 
-        uint32_t file_size = (uint32_t) portable_filelen( file.get() );
-
-        ExeHeader head = { 0 };
-        size_t blocks_read = fread( & head, sizeof( head ), 1, file.get() );
-        if ( 1 != blocks_read )
+        uint32_t file_size = (uint32_t) pimage->file_size;
+        if ( file_size < sizeof( ExeHeader ) )
         {
-            tracer.Trace( "  can't read input executable head '%s', error %d\n", acApp, errno );
+            tracer.Trace( "  can't read input executable head '%s'\n", acApp );
             return 0;
         }
 
+        const ExeHeader & head = pimage->head;
         head.Trace();
 
         // IBM Pascal v1 pas1.exe and pas2.exe files start with ZM, not MZ and DOS loads them. Apparently it signifies real mode for some apps?
@@ -8945,36 +12138,24 @@ uint16_t LoadBinary( const char * acApp, const char * acAppArgs, uint8_t lenAppA
 
         const uint16_t CodeSegment = DataSegment + 16; //  data segment + 256 bytes (16 paragraphs) for the psp
         uint8_t * pcode = cpu.flat_address8( CodeSegment, 0 );
-        fseek( file.get(), codeStart, SEEK_SET );
-        blocks_read = fread( pcode, imageSize, 1, file.get() );
-        if ( 1 != blocks_read )
+        if ( ( (uint64_t) codeStart + imageSize ) > pimage->file_size )
         {
-            tracer.Trace( "  can't read input exe file image, error %d", errno );
+            tracer.Trace( "  can't read input exe file image; it's truncated" );
             FreeMemory( DataSegment );
             return 0;
         }
 
-        if ( 0 != head.num_relocs )
-        {
-            vector<ExeRelocation> relocations( head.num_relocs );
-            fseek( file.get(), head.reloc_table_offset, SEEK_SET );
-            blocks_read = fread( relocations.data(), head.num_relocs * sizeof( ExeRelocation ), 1, file.get() );
-            if ( 1 != blocks_read )
-            {
-                tracer.Trace( "  can't read input exe file relocation data, error %d", errno );
-                FreeMemory( DataSegment );
-                return 0;
-            }
+        memcpy( pcode, pimage->file.data() + codeStart, imageSize );
 
-            for ( uint16_t r = 0; r < head.num_relocs; r++ )
-            {
-                uint32_t offset = (uint32_t) relocations[ r ].offset + (uint32_t) relocations[ r ].segment * 16;
-                le16_t * target = (le16_t *) ( pcode + offset );
-                //tracer.TraceQuiet( "  relocation %u offset %u, update %#02x to %#02x\n", r, offset, (uint16_t) *target, (uint16_t) *target + CodeSegment );
-                *target += CodeSegment;
-            }
+        if ( !pimage->relocsOK )
+        {
+            tracer.Trace( "  can't read input exe file relocation data" );
+            FreeMemory( DataSegment );
+            return 0;
         }
 
+        RelocateExeImage( *pimage, pcode, CodeSegment );
+
         tracer.Trace( "  start of the code:\n" );
         tracer.TraceBinaryData( pcode, get_min( imageSize, (uint32_t) 0x100 ), 4 );
 
@@ -9016,46 +12197,169 @@ uint16_t LoadBinary( const char * acApp, const char * acAppArgs, uint8_t lenAppA
 
         do
         {
-            DWORD ret = WaitForMultipleObjects( 2, aHandles, FALSE, 20 );
-            if ( WAIT_OBJECT_0 == ret )
-                break;
+            DWORD ret = WaitForMultipleObjects( 2, aHandles, FALSE, 20 );
+            if ( WAIT_OBJECT_0 == ret )
+                break;
+
+            if ( !g_KbdPeekAvailable )
+            {
+                bool keystrokeAvailable = false;
+                uint8_t asciiChar = 0, scancode = 0;
+
+                if ( !isatty( fileno( stdin ) ) )
+                {
+                    CKbdBuffer kbd_buf;
+                    if  ( kbd_buf.IsEmpty() )
+                        keystrokeAvailable = ( !feof( stdin ) );
+                }
+                else
+                    keystrokeAvailable = peek_keyboard( asciiChar, scancode );
+
+                if ( keystrokeAvailable )
+                {
+                    tracer.Trace( "%llu async thread (woken via %s) noticed that a keystroke is available\n",
+                                  time_since_last(), ( 1 == ret ) ? "console input" : "timeout" );
+                    g_KbdPeekAvailable = true; // make sure an int9 gets scheduled
+                    SetEvent( g_heventKeyStroke ); // if the main thread is sleeping waiting for input, wake it.
+                    cpu.exit_emulate_early(); // no time to lose processing the keystroke
+                }
+            }
+        } while( true );
+
+        return 0;
+    } //PeekKeyboardThreadProc
+#elif defined( sparc ) || defined( __mc68000__ )
+    // never actually invoked -- g_UseOneThread is always true on these targets (see main()), so
+    // CSimpleThread's constructor never runs. This stub exists only so & PeekKeyboardThreadProc
+    // has something valid to take the address of without pulling in any pthread symbols.
+    void * PeekKeyboardThreadProc( void * param )
+    {
+        return 0;
+    } //PeekKeyboardThreadProc
+#else
+#if USE_EVENTFD
+    // stdin is watched with epoll so keystrokes are noticed when they arrive rather than on the next 20ms poll.
+    // Once a keystroke is signaled, stdin is ignored until the main thread schedules an int 9 for it. If input
+    // is still unread at that point, as when the app isn't reading keys, it's signaled again 20ms later.
+    // At the end of piped input epoll reports stdin as readable forever, so it's no longer watched.
+
+    bool SetupKeyboardEvents()
+    {
+        int ep = epoll_create1( EPOLL_CLOEXEC );
+        if ( -1 == ep )
+            return false;
+
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.fd = 0;
+        if ( epoll_ctl( ep, EPOLL_CTL_ADD, 0, &ev ) ) // fails for regular files, which are always readable
+        {
+            close( ep );
+            return false;
+        }
+
+        close( ep );
+        g_keystrokeEventFd = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+        g_keyboardRearmFd = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+        g_keyboardStopFd = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+        return true;
+    } //SetupKeyboardEvents
+
+    void SignalKeyboardEvent( int fd )
+    {
+        if ( -1 != fd )
+        {
+            uint64_t one = 1;
+            if ( write( fd, &one, sizeof( one ) ) ) {}
+        }
+    } //SignalKeyboardEvent
+
+    void * KeyboardEventThreadProc( void * param )
+    {
+        tracer.Trace( "keyboardeventthreadproc: started threadproc\n" );
+
+        int ep = epoll_create1( EPOLL_CLOEXEC );
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.fd = g_keyboardStopFd;
+        epoll_ctl( ep, EPOLL_CTL_ADD, g_keyboardStopFd, &ev );
+        ev.data.fd = g_keyboardRearmFd;
+        epoll_ctl( ep, EPOLL_CTL_ADD, g_keyboardRearmFd, &ev );
+        ev.data.fd = 0;
+        epoll_ctl( ep, EPOLL_CTL_ADD, 0, &ev );
+
+        bool watchingStdin = true;
+        bool stdinEnded = false;  // piped input hit eof
+        bool signaled = false;    // waiting for the main thread to schedule an int 9
+        bool unread = false;      // input was left unread after the last int 9
+        bool stop = false;
+
+        do
+        {
+            bool watch = !signaled && !unread;
+            if ( !stdinEnded && ( watch != watchingStdin ) )
+            {
+                ev.events = watch ? EPOLLIN : 0;
+                ev.data.fd = 0;
+                epoll_ctl( ep, EPOLL_CTL_MOD, 0, &ev );
+                watchingStdin = watch;
+            }
 
-            if ( !g_KbdPeekAvailable )
+            struct epoll_event events[ 3 ];
+            int n = epoll_wait( ep, events, 3, unread ? 20 : -1 );
+            if ( -1 == n && EINTR != errno )
             {
-                bool keystrokeAvailable = false;
-                uint8_t asciiChar = 0, scancode = 0;
+                tracer.Trace( "keyboardeventthreadproc: epoll_wait failed, error %d\n", errno );
+                break;
+            }
 
-                if ( !isatty( fileno( stdin ) ) )
+            bool input = ( 0 == n ); // the 20ms wait for unread input ended
+            bool hangup = false;
+            unread = false;
+
+            for ( int i = 0; i < n; i++ )
+            {
+                uint64_t count;
+                if ( g_keyboardStopFd == events[ i ].data.fd )
+                    stop = true;
+                else if ( g_keyboardRearmFd == events[ i ].data.fd )
                 {
-                    CKbdBuffer kbd_buf;
-                    if  ( kbd_buf.IsEmpty() )
-                        keystrokeAvailable = ( !feof( stdin ) );
+                    if ( read( g_keyboardRearmFd, &count, sizeof( count ) ) ) {} // reset the event
+                    signaled = false;
+                    unread = g_consoleConfig.portable_kbhit();
                 }
                 else
-                    keystrokeAvailable = peek_keyboard( asciiChar, scancode );
+                {
+                    input = true;
+                    hangup = ( 0 != ( events[ i ].events & ( EPOLLHUP | EPOLLERR ) ) );
+                }
+            }
 
-                if ( keystrokeAvailable )
+            if ( input && !signaled && !stop )
+            {
+                if ( g_consoleConfig.portable_kbhit() )
                 {
-                    tracer.Trace( "%llu async thread (woken via %s) noticed that a keystroke is available\n",
-                                  time_since_last(), ( 1 == ret ) ? "console input" : "timeout" );
+                    tracer.Trace( "keyboardeventthreadproc: async thread noticed that a keystroke is available\n" );
+                    signaled = true;
                     g_KbdPeekAvailable = true; // make sure an int9 gets scheduled
-                    SetEvent( g_heventKeyStroke ); // if the main thread is sleeping waiting for input, wake it.
-                    cpu.exit_emulate_early(); // no time to lose processing the keystroke
+                    SignalKeyboardEvent( g_keystrokeEventFd ); // if the main thread is sleeping waiting for input, wake it.
+                    cpu.exit_emulate_early();  // no time to lose processing the keystroke
+                }
+                else if ( hangup || !isatty( 0 ) )
+                {
+                    tracer.Trace( "keyboardeventthreadproc: stdin has no more input\n" );
+                    epoll_ctl( ep, EPOLL_CTL_DEL, 0, &ev );
+                    stdinEnded = true;
                 }
             }
-        } while( true );
+        } while ( !stop );
 
+        close( ep );
+        tracer.Trace( "keyboardeventthreadproc: falling out of threadproc\n" );
         return 0;
-    } //PeekKeyboardThreadProc
-#elif defined( sparc ) || defined( __mc68000__ )
-    // never actually invoked -- g_UseOneThread is always true on these targets (see main()), so
-    // CSimpleThread's constructor never runs. This stub exists only so & PeekKeyboardThreadProc
-    // has something valid to take the address of without pulling in any pthread symbols.
-    void * PeekKeyboardThreadProc( void * param )
-    {
-        return 0;
-    } //PeekKeyboardThreadProc
-#else
+    } //KeyboardEventThreadProc
+#endif
+
     void * PeekKeyboardThreadProc( void * param )
     {
         tracer.Trace( "peekkeyboardthreadproc: started threadproc\n" );
@@ -9176,6 +12480,39 @@ void SquashDOSFullPathToRoot( char * fullPath )
     tracer.Trace( "  squash ending with '%s'\n", fullPath );
 } //SquashDOSFullPathToRoot
 
+static void BuildEnvironmentBlock( vector<char> & env, const char * pStartVars, size_t startLen, const char * fullPath, const char * pcmdLineEnv )
+{
+    // an environment block is variables, an extra 0, a count of 1 more item per DOS 3.0+, then the program's full path.
+    // pStartVars is a parent's variables. Without them, COMSPEC is set; apps need it or they can't load themselves.
+    // pcmdLineEnv is -e style: comma-separated variables.
+
+    if ( pStartVars )
+        env.insert( env.end(), pStartVars, pStartVars + startLen );
+    else
+    {
+        const char * pComSpec = "COMSPEC=COMMAND.COM";
+        env.insert( env.end(), pComSpec, pComSpec + strlen( pComSpec ) + 1 );
+    }
+
+    if ( ends_with( fullPath, "B.EXE" ) )
+    {
+        const char * pBriefFlags = "BFLAGS=-kzr -mDJL"; // Brief: keyboard compat, no ^z at end, fast screen updates, my macros
+        env.insert( env.end(), pBriefFlags, pBriefFlags + strlen( pBriefFlags ) + 1 );
+    }
+
+    if ( pcmdLineEnv && *pcmdLineEnv )
+    {
+        for ( const char * p = pcmdLineEnv; *p; p++ )
+            env.push_back( ( ',' == *p ) ? 0 : (char) toupper( *p ) );
+        env.push_back( 0 );
+    }
+
+    env.push_back( 0 ); // extra 0 to indicate there are no more environment variables
+    env.push_back( 1 ); // le16 0x0001
+    env.push_back( 0 );
+    env.insert( env.end(), fullPath, fullPath + strlen( fullPath ) + 1 );
+} //BuildEnvironmentBlock
+
 uint16_t AllocateEnvironment( uint16_t segStartingEnv, const char * pathToExecute, const char * pcmdLineEnv )
 {
     char fullPath[ MAX_PATH ];
@@ -9198,39 +12535,28 @@ uint16_t AllocateEnvironment( uint16_t segStartingEnv, const char * pathToExecut
     SquashDOSFullPathToRoot( fullPath );
     tracer.Trace( "  full path of binary: '%s'\n", fullPath );
 
-    const char * pComSpec = "COMSPEC=COMMAND.COM";
-    const char * pBriefFlags = "BFLAGS=-kzr -mDJL";
-    uint16_t bytesNeeded = (uint16_t) strlen( fullPath );
-    uint16_t startLen = 0;
-    char * pEnvStart = (char *) cpu.flat_address( segStartingEnv, 0 );
-    uint16_t cmdLineEnvLen = 0;
+    // a child process starts with a copy of its parent's variables
 
+    const char * pStartVars = 0;
+    size_t startLen = 0;
     if ( 0 != segStartingEnv )
     {
-        char * pe = pEnvStart;
+        pStartVars = (const char *) cpu.flat_address( segStartingEnv, 0 );
+        const char * pe = pStartVars;
         do
         {
             size_t l = 1 + strlen( pe );
-            startLen += (uint16_t) l;
+            startLen += l;
             pe += l;
         } while ( 0 != *pe );
-
-        bytesNeeded += startLen;
     }
-    else
-    {
-        bytesNeeded += (uint16_t) 2 + (uint16_t) ( strlen( pComSpec ) + strlen( pBriefFlags ) );
 
-        if ( pcmdLineEnv )
-        {
-            cmdLineEnvLen = 1 + (uint16_t) strlen( pcmdLineEnv );
-            bytesNeeded += cmdLineEnvLen;
-        }
-    }
+    vector<char> env;
+    BuildEnvironmentBlock( env, pStartVars, startLen, fullPath, pcmdLineEnv );
 
     // apps assume there is space at the end to write to. It should be at least 160 bytes in size
 
-    bytesNeeded += (uint16_t) 512;
+    uint16_t bytesNeeded = (uint16_t) env.size() + (uint16_t) 512;
 
     uint16_t remaining;
     uint16_t segEnvironment = AllocateMemory( round_up( bytesNeeded, (uint16_t) 16 ) / 16, remaining );
@@ -9241,48 +12567,9 @@ uint16_t AllocateEnvironment( uint16_t segStartingEnv, const char * pathToExecut
     }
 
     char * penvdata = (char *) cpu.flat_address( segEnvironment, 0 );
-    char * penv = penvdata;
-
     memset( penvdata, 0, bytesNeeded );
-
-    if ( 0 == segStartingEnv )
-    {
-        strcpy( penv, pComSpec ); // it needs this or it can't load itself
-        penv += 1 + strlen( penv );
-    }
-    else
-    {
-        memcpy( penv, pEnvStart, startLen );
-        penv += startLen;
-    }
-
-    if ( ends_with( fullPath, "B.EXE" ) )
-    {
-        strcpy( penv, pBriefFlags ); // Brief: keyboard compat, no ^z at end, fast screen updates, my macros
-        penv += 1 + strlen( penv );
-    }
-
-    if ( pcmdLineEnv )
-    {
-        strcpy( penv, pcmdLineEnv );
-        _strupr( penv );
-        char * p = penv;
-        while ( *p )
-        {
-            if ( ',' == *p )
-                *p = 0;
-            p++;
-        }
-
-        penv += cmdLineEnvLen;
-    }
-
-    *penv++ = 0; // extra 0 to indicate there are no more environment variables
-    * (le16_t *) ( penv ) = 0x0001; // one more additional item per DOS 3.0+
-    penv += 2;
-
-    strcpy( penv, fullPath );
-    tracer.Trace( "  wrote full path to the environment: '%s'\n", penv );
+    memcpy( penvdata, env.data(), env.size() );
+    tracer.Trace( "  wrote full path to the environment: '%s'\n", fullPath );
     tracer.TraceBinaryData( (uint8_t *) penvdata, bytesNeeded, 4 );
 
     return segEnvironment;
@@ -9324,14 +12611,17 @@ void ValidateStateLooksOK()
     DOSPSP * psp = (DOSPSP *) cpu.flat_address( g_currentPSP, 0 );
     uint16_t segParent = psp->segParent;
 
-    for ( size_t i = 0; i < g_allocEntries.size(); i++ )
+    for ( uint16_t seg = FirstMCB(); 0 != seg; seg = NextMCB( seg ) )
     {
-        DosAllocation & da = g_allocEntries[i];
+        DOSMemoryControlBlock * pmcb = GetMCB( seg );
+        if ( 0 == pmcb->psp )
+            continue;
+
         // too aggressive since the initial process may have hooked interrupts. if ( da.seg_process == g_currentPSP || da.seg_process == segParent )
         // for example: the Microsoft Cobol compiler v3, v4.5, and v5
         {
-            uint32_t lo = flat_address( da.segment, 0 );
-            uint32_t hi = flat_address( da.segment + da.para_length, 0 );
+            uint32_t lo = flat_address( seg + 1, 0 );
+            uint32_t hi = flat_address( seg + 1 + pmcb->paras, 0 );
             if ( curCode >= lo && curCode < hi )
                 codeInRange = true;
             if ( curStack >= lo && curStack < hi )
@@ -9349,41 +12639,576 @@ void ValidateStateLooksOK()
         tracer.Trace( "g_currentPSP %04x, parent psp %04x\n", g_currentPSP, segParent );
         printf( "  cs %04x, ip %04x\n", cpu.get_cs(), cpu.get_ip() );
 
-        for ( size_t i = 0; i < g_allocEntries.size(); i++ )
-        {
-            DosAllocation & da = g_allocEntries[i];
-            printf( "  da %zd: process %04x, seg %04x, length %04x\n", i, da.seg_process, da.segment, da.para_length );
+        for ( uint16_t seg = FirstMCB(); 0 != seg; seg = NextMCB( seg ) )
+        {
+            DOSMemoryControlBlock * pmcb = GetMCB( seg );
+            printf( "  mcb %04x: process %04x, seg %04x, paras %04x\n", seg, (uint16_t) pmcb->psp, seg + 1, (uint16_t) pmcb->paras );
+        }
+
+        i8086_hard_exit( "ERROR: instruction pointer isn't in the OS or the app's memory\n" );
+    }
+
+    // stacks can be incorrect while interrupts are disabled since it's two instructions to update sp and ss
+
+    if ( !stackInRange && cpu.get_interrupt() )
+    {
+        trace_all_allocations();
+        cpu.trace_state();
+        tracer.Trace( "curStack %04x\n", curStack );
+        i8086_hard_exit( "ERROR: stack pointer isn't in the app's memory\n" );
+    }
+
+#if 0
+    le32_t * pVectors = (le32_t *) cpu.flat_address( 0, 0 );
+    for ( uint8_t intx = 0; intx < 0x40; intx++ )
+    {
+        if ( ( pVectors[ intx ] >> 16 ) != InterruptRoutineSegment )
+            tracer.Trace( "interrupt vector %02x was overridden, code is at %04x:%04x\n", intx,
+                          ( pVectors[ intx ] >> 16 ), pVectors[ intx ] & 0xffff );
+    }
+#endif
+} //ValidateStateLooksOK
+
+bool InterruptHookedByApp( uint8_t i )
+{
+    uint16_t seg = cpu.mword( 0, 4 * i + 2 ); // lower word has offset, upper has segment
+    return ( InterruptRoutineSegment != seg );
+} //InterruptHookedByApp
+
+#if USE_FORK
+
+// Fork server. -server:socket loads the app and runs it to the fork point (the app's first instruction, or
+// the first int 21h call with the given ah), then accepts jobs on a UNIX socket. Each job runs in a
+// copy-on-write fork() of that machine. A client (ntvdm -connect:socket PROGRAM ...) sends 4 lines:
+// the program, the current directory, the command tail, and the -e environment variables, along with its
+// stdin, stdout, and stderr. The job uses those descriptors directly and replies "exit N" at the end.
+
+const size_t ForkServerRequestMax = 4096;
+
+static bool ForkServerSend( int fd, const char * p )
+{
+    size_t len = strlen( p );
+    while ( len > 0 )
+    {
+        ssize_t written = write( fd, p, len );
+        if ( written <= 0 )
+            return false;
+        p += written;
+        len -= written;
+    }
+    return true;
+} //ForkServerSend
+
+void ReportForkServerExit( int code )
+{
+    if ( -1 != g_forkServerConnection )
+    {
+        char ac[ 32 ];
+        snprintf( ac, sizeof( ac ), "exit %d\n", code );
+        ForkServerSend( g_forkServerConnection, ac );
+        close( g_forkServerConnection );
+        g_forkServerConnection = -1;
+    }
+} //ReportForkServerExit
+
+static void ForkServerJobFailed( const char * perror )
+{
+    tracer.Trace( "  fork server job failed: %s\n", perror );
+    char ac[ 300 ];
+    snprintf( ac, sizeof( ac ), "error %s\n", perror );
+    ForkServerSend( g_forkServerConnection, ac );
+    exit( 1 );
+} //ForkServerJobFailed
+
+static const char * ProgramBaseName( const char * p, size_t & len )
+{
+    // the name without a path or extension, for comparing the job's program with the server's
+
+    const char * pslash = strrchr( p, '/' );
+    const char * pback = strrchr( p, '\\' );
+    if ( pback > pslash )
+        pslash = pback;
+    if ( pslash )
+        p = pslash + 1;
+
+    const char * pdot = strchr( p, '.' );
+    len = pdot ? ( pdot - p ) : strlen( p );
+    return p;
+} //ProgramBaseName
+
+bool RewriteEnvironment( uint16_t segEnvironment, const char * pcmdLineEnv )
+{
+    // replace the variables in an existing environment block, keeping the program path at the end
+
+    DOSMemoryControlBlock * pmcb = FindAllocation( segEnvironment );
+    if ( 0 == pmcb )
+        return false;
+
+    char * penvdata = (char *) cpu.flat_address( segEnvironment, 0 );
+    char * pe = penvdata;
+    while ( 0 != *pe )
+        pe += 1 + strlen( pe );
+    string path( pe + 3 ); // skip the 0 that ends the variables and the 0x0001 count
+
+    vector<char> env;
+    BuildEnvironmentBlock( env, 0, 0, path.c_str(), pcmdLineEnv );
+
+    size_t capacity = (size_t) pmcb->paras * 16;
+    if ( env.size() > capacity )
+        return false;
+
+    memmove( penvdata, env.data(), env.size() );
+    memset( penvdata + env.size(), 0, capacity - env.size() );
+    return true;
+} //RewriteEnvironment
+
+static void StartForkServerJob( int conn )
+{
+    // runs in the forked child. read the request and make the machine look like it was started for this job
+
+    g_forkServerConnection = conn;
+    char request[ ForkServerRequestMax ];
+    int fds[ 3 ];
+    struct iovec iov;
+    iov.iov_base = request;
+    iov.iov_len = sizeof( request ) - 1;
+    union { struct cmsghdr align; char buf[ CMSG_SPACE( sizeof( fds ) ) ]; } control;
+    struct msghdr msg;
+    memset( &msg, 0, sizeof( msg ) );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof( control.buf );
+
+    ssize_t len = recvmsg( conn, &msg, 0 );
+    struct cmsghdr * pcmsg = ( len > 0 ) ? CMSG_FIRSTHDR( &msg ) : 0;
+    if ( !pcmsg || SOL_SOCKET != pcmsg->cmsg_level || SCM_RIGHTS != pcmsg->cmsg_type || CMSG_LEN( sizeof( fds ) ) != pcmsg->cmsg_len )
+        ForkServerJobFailed( "request didn't include stdin, stdout, and stderr" );
+    memcpy( fds, CMSG_DATA( pcmsg ), sizeof( fds ) );
+
+    // the rest of the lines may arrive separately
+
+    size_t total = len;
+    size_t lines = 0;
+    for ( size_t i = 0; i < total; i++ )
+        lines += ( '\n' == request[ i ] );
+
+    while ( lines < 4 && total < ( sizeof( request ) - 1 ) )
+    {
+        len = read( conn, request + total, sizeof( request ) - 1 - total );
+        if ( len <= 0 )
+            break;
+        for ( ssize_t i = 0; i < len; i++ )
+            lines += ( '\n' == request[ total + i ] );
+        total += len;
+    }
+
+    request[ total ] = 0;
+    char * aLines[ 4 ];
+    char * p = request;
+    for ( size_t i = 0; i < _countof( aLines ); i++ )
+    {
+        char * pnl = strchr( p, '\n' );
+        if ( !pnl )
+            ForkServerJobFailed( "incomplete request" );
+        *pnl = 0;
+        aLines[ i ] = p;
+        p = pnl + 1;
+    }
+
+    const char * pProgram = aLines[ 0 ];
+    const char * pCwd = aLines[ 1 ];
+    const char * pArgs = aLines[ 2 ];
+    const char * pEnv = aLines[ 3 ];
+    tracer.Trace( "fork server job: program '%s', cwd '%s', args '%s', env '%s'\n", pProgram, pCwd, pArgs, pEnv );
+
+    size_t lenJob, lenServer;
+    const char * pJob = ProgramBaseName( pProgram, lenJob );
+    const char * pServer = ProgramBaseName( g_acApp, lenServer );
+    if ( lenJob != lenServer || _strnicmp( pJob, pServer, lenJob ) )
+        ForkServerJobFailed( "the server is running a different program" );
+
+    if ( 0 != chdir( pCwd ) )
+        ForkServerJobFailed( "can't change to the job's current directory" );
+
+    size_t lenArgs = strlen( pArgs );
+    if ( lenArgs > 126 )
+        ForkServerJobFailed( "command tail is too long" );
+
+    DOSPSP * psp = (DOSPSP *) cpu.flat_address( g_currentPSP, 0 );
+    if ( *pEnv && !RewriteEnvironment( psp->segEnvironment, pEnv ) )
+        ForkServerJobFailed( "environment is too large" );
+
+    if ( -1 == g_forkServerFunction )
+        InitializePSP( g_currentPSP, pArgs, (uint8_t) lenArgs, psp->segEnvironment );
+    else
+    {
+        // the app is already running, so just replace the command tail
+
+        psp->countCommandTail = (uint8_t) lenArgs;
+        memcpy( psp->commandTail, pArgs, lenArgs );
+        psp->commandTail[ lenArgs ] = 0x0d;
+    }
+
+    for ( int i = 0; i < 3; i++ )
+    {
+        dup2( fds[ i ], i );
+        close( fds[ i ] );
+    }
+
+    signal( SIGCHLD, SIG_DFL );
+    g_batchIO = !isatty( fileno( stdin ) ) && !isatty( fileno( stdout ) );
+    g_tAppStart = high_resolution_clock::now();
+} //StartForkServerJob
+
+void RunForkServer()
+{
+    // returns only in forked children, each of which runs one job
+
+    const char * pcPath = g_pcForkServer;
+    g_pcForkServer = 0;
+
+    int listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+    struct sockaddr_un addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sun_family = AF_UNIX;
+    if ( -1 == listener || strlen( pcPath ) >= sizeof( addr.sun_path ) )
+        i8086_hard_exit( "can't create the -server socket\n" );
+
+    strcpy( addr.sun_path, pcPath );
+    unlink( pcPath );
+    if ( 0 != bind( listener, (struct sockaddr *) &addr, sizeof( addr ) ) || 0 != listen( listener, 64 ) )
+        i8086_hard_exit( "can't listen on the -server socket\n" );
+
+    signal( SIGCHLD, SIG_IGN ); // no zombies; jobs report their exit codes to their clients
+    tracer.Trace( "fork server listening on '%s' at %04x:%04x\n", pcPath, cpu.get_cs(), cpu.get_ip() );
+    fflush( 0 );
+
+    do
+    {
+        int conn = accept( listener, 0, 0 );
+        if ( -1 == conn )
+        {
+            if ( EINTR == errno )
+                continue;
+            i8086_hard_exit( "accept failed on the -server socket\n" );
+        }
+
+        pid_t pid = fork();
+        if ( 0 == pid )
+        {
+            close( listener );
+            StartForkServerJob( conn );
+            return;
+        }
+
+        if ( -1 == pid )
+        {
+            tracer.Trace( "fork failed, error %d\n", errno );
+            ForkServerSend( conn, "error fork failed\n" );
+        }
+
+        close( conn );
+    } while ( true );
+} //RunForkServer
+
+int RunForkServerClient( const char * pcPath, const char * pProgram, const char * pArgs, const char * pEnv )
+{
+    int conn = socket( AF_UNIX, SOCK_STREAM, 0 );
+    struct sockaddr_un addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sun_family = AF_UNIX;
+    if ( -1 == conn || strlen( pcPath ) >= sizeof( addr.sun_path ) )
+    {
+        fprintf( stderr, "can't create a socket for %s\n", pcPath );
+        return 1;
+    }
+
+    strcpy( addr.sun_path, pcPath );
+    if ( 0 != connect( conn, (struct sockaddr *) &addr, sizeof( addr ) ) )
+    {
+        fprintf( stderr, "can't connect to the ntvdm server at %s\n", pcPath );
+        return 1;
+    }
+
+    char acCwd[ MAX_PATH ];
+    if ( !getcwd( acCwd, sizeof( acCwd ) ) )
+        acCwd[ 0 ] = 0;
+
+    string request = string( pProgram ) + "\n" + acCwd + "\n" + pArgs + "\n" + pEnv + "\n";
+    int fds[ 3 ] = { 0, 1, 2 };
+    struct iovec iov;
+    iov.iov_base = (void *) request.c_str();
+    iov.iov_len = request.length();
+    union { struct cmsghdr align; char buf[ CMSG_SPACE( sizeof( fds ) ) ]; } control;
+    memset( &control, 0, sizeof( control ) );
+    struct msghdr msg;
+    memset( &msg, 0, sizeof( msg ) );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof( control.buf );
+    struct cmsghdr * pcmsg = CMSG_FIRSTHDR( &msg );
+    pcmsg->cmsg_level = SOL_SOCKET;
+    pcmsg->cmsg_type = SCM_RIGHTS;
+    pcmsg->cmsg_len = CMSG_LEN( sizeof( fds ) );
+    memcpy( CMSG_DATA( pcmsg ), fds, sizeof( fds ) );
+
+    if ( (ssize_t) request.length() != sendmsg( conn, &msg, 0 ) )
+    {
+        fprintf( stderr, "can't send the job to the ntvdm server\n" );
+        return 1;
+    }
+
+    char reply[ 300 ];
+    size_t total = 0;
+    ssize_t len;
+    while ( total < ( sizeof( reply ) - 1 ) && ( len = read( conn, reply + total, sizeof( reply ) - 1 - total ) ) > 0 )
+        total += len;
+    reply[ total ] = 0;
+    close( conn );
+
+    if ( !strncmp( reply, "exit ", 5 ) )
+        return atoi( reply + 5 );
+
+    fprintf( stderr, "ntvdm server: %s", total ? reply : "job ended without an exit code\n" );
+    return 1;
+} //RunForkServerClient
+
+// -jobs:manifest[,workers] runs the jobs listed in the manifest, one per line, in forked children of this
+// process. Fields are separated with | and all but the first are optional:
+//     PROGRAM [ARGUMENTS] | ENV=VALUE,... | ROOT | EXPECTED EXIT CODE | SECONDS | 8086 CYCLES
+// Blank lines and lines starting with # are ignored. Job N's stdout and stderr are written to
+// manifest.N.out and manifest.N.err. A summary with each job's result and timing goes to stdout.
+// The children are forked once the machine is set up and each job's executable is cached, so they
+// share that work copy-on-write. A job that runs past its cycle budget exits with JobCyclesExitCode.
+
+struct ManifestJob
+{
+    size_t number;                 // 1-based job number, used for the output file names
+    string program;                // program and arguments
+    string env;                    // -e style environment variables
+    string root;                   // -r style root folder
+    int expected;                  // expected exit code
+    uint32_t seconds;              // time budget. 0 for none
+    uint64_t cycles;               // 8086 cycle budget. 0 for none
+    pid_t pid;                     // while running
+    high_resolution_clock::time_point tStart;
+    long long ms;                  // elapsed milliseconds
+    string result;                 // ok, failed, timeout, cycles, or a signal
+    int exitCode;
+};
+
+static string TrimJobField( string s )
+{
+    size_t start = s.find_first_not_of( " \t\r\n" );
+    if ( string::npos == start )
+        return string();
+    size_t end = s.find_last_not_of( " \t\r\n" );
+    return s.substr( start, end - start + 1 );
+} //TrimJobField
+
+static bool ReadJobManifest( const char * pcManifest, vector<ManifestJob> & jobs )
+{
+    CFile file( fopen( pcManifest, "r" ) );
+    if ( 0 == file.get() )
+        return false;
+
+    char acLine[ 1024 ];
+    size_t lineNumber = 0;
+    while ( fgets( acLine, sizeof( acLine ), file.get() ) )
+    {
+        lineNumber++;
+        string line = TrimJobField( acLine );
+        if ( line.empty() || '#' == line[ 0 ] )
+            continue;
+
+        vector<string> fields;
+        size_t start = 0;
+        do
+        {
+            size_t bar = line.find( '|', start );
+            fields.push_back( TrimJobField( line.substr( start, ( string::npos == bar ) ? string::npos : bar - start ) ) );
+            start = ( string::npos == bar ) ? string::npos : bar + 1;
+        } while ( string::npos != start );
+        fields.resize( 6 );
+
+        ManifestJob job;
+        job.number = jobs.size() + 1;
+        job.program = fields[ 0 ];
+        job.env = fields[ 1 ];
+        job.root = fields[ 2 ];
+        job.expected = fields[ 3 ].empty() ? 0 : atoi( fields[ 3 ].c_str() );
+        job.seconds = (uint32_t) strtoul( fields[ 4 ].c_str(), 0, 10 );
+        job.cycles = strtoull( fields[ 5 ].c_str(), 0, 10 );
+        job.pid = 0;
+        job.ms = 0;
+        job.exitCode = 0;
+        if ( job.program.empty() )
+            return false;
+
+        size_t space = job.program.find( ' ' );
+        if ( ( string::npos != space ) && ( TrimJobField( job.program.substr( space + 1 ) ).length() > 125 ) )
+        {
+            printf( "job manifest line %zu: arguments are longer than the 126 character DOS command tail\n", lineNumber );
+            return false;
+        }
+
+        jobs.push_back( job );
+    }
+
+    return true;
+} //ReadJobManifest
+
+static void StartManifestJob( const char * pcManifest, ManifestJob & job, char ** ppcApp, char * acAppArgs, char ** ppenvVars, char * acRootArg )
+{
+    // runs in the forked child. set up the arguments main() would otherwise have parsed, then return to run the job
+
+    char acPath[ MAX_PATH + 32 ];
+    snprintf( acPath, sizeof( acPath ), "%s.%zu.out", pcManifest, job.number );
+    int fdOut = open( acPath, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    snprintf( acPath, sizeof( acPath ), "%s.%zu.err", pcManifest, job.number );
+    int fdErr = open( acPath, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    int fdIn = open( "/dev/null", O_RDONLY );
+    if ( -1 == fdOut || -1 == fdErr || -1 == fdIn )
+        exit( 1 );
+
+    dup2( fdIn, 0 );
+    dup2( fdOut, 1 );
+    dup2( fdErr, 2 );
+    close( fdIn );
+    close( fdOut );
+    close( fdErr );
+
+    // the strings live in the child's copy of the jobs vector, which is never freed
+
+    char * pprogram = (char *) job.program.c_str();
+    char * pspace = strchr( pprogram, ' ' );
+    acAppArgs[ 0 ] = 0;
+    if ( pspace )
+    {
+        *pspace = 0;
+        snprintf( acAppArgs, 127, " %s", TrimJobField( pspace + 1 ).c_str() ); // DOS puts a space before the first argument. length checked when read
+    }
+
+    *ppcApp = pprogram;
+    if ( !job.env.empty() )
+        *ppenvVars = (char *) job.env.c_str();
+    if ( !job.root.empty() )
+        strcpy( acRootArg, job.root.c_str() );
+
+    g_cycleBudget = job.cycles;
+    if ( job.seconds )
+        alarm( job.seconds );
+} //StartManifestJob
+
+int RunJobManifest( const char * pcManifest, size_t workers, char ** ppcApp, char * acAppArgs, char ** ppenvVars, char * acRootArg )
+{
+    // returns -1 in the forked children, which then run their job. otherwise returns the runner's exit code
+
+    static vector<ManifestJob> jobs;
+    if ( !ReadJobManifest( pcManifest, jobs ) )
+    {
+        printf( "can't read job manifest %s\n", pcManifest );
+        return 1;
+    }
+
+    if ( 0 == workers )
+    {
+        long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+        workers = ( cpus > 0 ) ? cpus : 1;
+    }
+
+    // parse each distinct executable once here so the children find it in the image cache
+
+    for ( size_t i = 0; i < jobs.size(); i++ )
+    {
+        char acApp[ MAX_PATH ];
+        string program = jobs[ i ].program.substr( 0, jobs[ i ].program.find( ' ' ) );
+        HostAppPath( program.c_str(), acApp );
+        if ( command_exists( acApp ) )
+            GetExeImage( acApp );
+    }
+
+    high_resolution_clock::time_point tStart = high_resolution_clock::now();
+    size_t next = 0, running = 0;
+    fflush( 0 );
+
+    while ( next < jobs.size() || running > 0 )
+    {
+        while ( next < jobs.size() && running < workers )
+        {
+            ManifestJob & job = jobs[ next++ ];
+            job.tStart = high_resolution_clock::now();
+            job.pid = fork();
+            if ( 0 == job.pid )
+            {
+                StartManifestJob( pcManifest, job, ppcApp, acAppArgs, ppenvVars, acRootArg );
+                return -1;
+            }
+
+            if ( -1 == job.pid )
+            {
+                job.pid = 0;
+                job.result = "no fork";
+                job.exitCode = -1;
+            }
+            else
+                running++;
         }
 
-        i8086_hard_exit( "ERROR: instruction pointer isn't in the OS or the app's memory\n" );
-    }
+        int status = 0;
+        pid_t pid = wait( &status );
+        if ( -1 == pid )
+        {
+            if ( EINTR == errno )
+                continue;
+            break;
+        }
 
-    // stacks can be incorrect while interrupts are disabled since it's two instructions to update sp and ss
+        for ( size_t i = 0; i < jobs.size(); i++ )
+        {
+            ManifestJob & job = jobs[ i ];
+            if ( pid != job.pid )
+                continue;
 
-    if ( !stackInRange && cpu.get_interrupt() )
-    {
-        trace_all_allocations();
-        cpu.trace_state();
-        tracer.Trace( "curStack %04x\n", curStack );
-        i8086_hard_exit( "ERROR: stack pointer isn't in the app's memory\n" );
+            running--;
+            job.pid = 0;
+            job.ms = duration_cast<std::chrono::milliseconds>( high_resolution_clock::now() - job.tStart ).count();
+            if ( WIFEXITED( status ) )
+            {
+                job.exitCode = WEXITSTATUS( status );
+                if ( job.exitCode == job.expected )
+                    job.result = "ok";
+                else
+                    job.result = ( job.cycles && ( JobCyclesExitCode == job.exitCode ) ) ? "cycles" : "failed";
+            }
+            else
+            {
+                job.exitCode = -1;
+                int sig = WTERMSIG( status );
+                job.result = ( SIGALRM == sig ) ? "timeout" : "signal " + to_string( sig );
+            }
+            break;
+        }
     }
 
-#if 0
-    le32_t * pVectors = (le32_t *) cpu.flat_address( 0, 0 );
-    for ( uint8_t intx = 0; intx < 0x40; intx++ )
+    size_t passed = 0;
+    printf( "  job  result      exit  expected         ms  program\n" );
+    for ( size_t i = 0; i < jobs.size(); i++ )
     {
-        if ( ( pVectors[ intx ] >> 16 ) != InterruptRoutineSegment )
-            tracer.Trace( "interrupt vector %02x was overridden, code is at %04x:%04x\n", intx,
-                          ( pVectors[ intx ] >> 16 ), pVectors[ intx ] & 0xffff );
+        ManifestJob & job = jobs[ i ];
+        if ( "ok" == job.result )
+            passed++;
+        printf( "%5zu  %-10s %5d %9d %10lld  %s\n", job.number, job.result.c_str(), job.exitCode, job.expected, job.ms, job.program.c_str() );
     }
-#endif
-} //ValidateStateLooksOK
 
-bool InterruptHookedByApp( uint8_t i )
-{
-    uint16_t seg = cpu.mword( 0, 4 * i + 2 ); // lower word has offset, upper has segment
-    return ( InterruptRoutineSegment != seg );
-} //InterruptHookedByApp
+    long long totalTime = duration_cast<std::chrono::milliseconds>( high_resolution_clock::now() - tStart ).count();
+    printf( "%zu of %zu jobs ok, %zu workers, %lld ms\n", passed, jobs.size(), workers, totalTime );
+    return ( passed == jobs.size() ) ? 0 : 1;
+} //RunJobManifest
+
+#endif // USE_FORK
 
 uint32_t GetBiosDailyTimer()
 {
@@ -9445,6 +13270,13 @@ int main( int argc, char * argv[] )
         setlocale( LC_CTYPE, "en_US.UTF-8" );            // these are needed for printf of utf-8 to work
         setlocale( LC_COLLATE, "en_US.UTF-8" );
 
+#ifndef _WIN32
+        // tty output is flushed explicitly (see flush_console_output), so don't let stdio flush on every line
+
+        static char acStdoutBuffer[ 64 * 1024 ];
+        setvbuf( stdout, acStdoutBuffer, _IOFBF, sizeof( acStdoutBuffer ) );
+#endif
+
         init_blankline( DefaultVideoAttribute );
 
         char * pcAPP = 0;
@@ -9458,7 +13290,17 @@ int main( int argc, char * argv[] )
         bool clearDisplayOnExit = true;
         bool bootSectorLoad = false;
         bool printVideoMemory = false;
+        const char * pcScreenCapture = 0;
+        bool screenCaptureANSI = false;
         char * penvVars = 0;
+        char * pcLoadSnapshot = 0;
+        uint32_t emsMegabytes = 0;
+        uint32_t xmsMegabytes = 0;
+        char * pcConnect = 0;
+        char * pcJobs = 0;
+        size_t jobWorkers = 0;
+        char * pcRecord = 0;
+        const char * pcFrames = 0;
         static char acRootArg[ MAX_PATH ];
 #ifdef _WIN32
         strcpy( acRootArg, "\\" );
@@ -9468,6 +13310,7 @@ int main( int argc, char * argv[] )
 #endif
 
         CKeyStrokes::KeystrokeMode keystroke_mode = CKeyStrokes::ksm_None; //CKeyStrokes::KeystrokeMode::ksm_None;
+        const char * pcKeystrokeFile = 0;
 
         for ( int i = 1; i < argc; i++ )
         {
@@ -9484,6 +13327,34 @@ int main( int argc, char * argv[] )
 
                 if ( 'b' == ca )
                     bootSectorLoad = true;
+                else if ( !_strnicmp( parg + 1, "save:", 5 ) )
+                    g_pcSaveSnapshot = parg + 6;
+                else if ( !_strnicmp( parg + 1, "load:", 5 ) )
+                    pcLoadSnapshot = parg + 6;
+#if USE_FORK
+                else if ( !_strnicmp( parg + 1, "server:", 7 ) )
+                {
+                    g_pcForkServer = parg + 8;
+                    char * pcomma = strchr( parg + 8, ',' );
+                    if ( pcomma )
+                    {
+                        *pcomma = 0;
+                        g_forkServerFunction = (int) strtoul( pcomma + 1, 0, 16 ) & 0xff;
+                    }
+                }
+                else if ( !_strnicmp( parg + 1, "connect:", 8 ) )
+                    pcConnect = parg + 9;
+                else if ( !_strnicmp( parg + 1, "jobs:", 5 ) )
+                {
+                    pcJobs = parg + 6;
+                    char * pcomma = strchr( parg + 6, ',' );
+                    if ( pcomma )
+                    {
+                        *pcomma = 0;
+                        jobWorkers = strtoul( pcomma + 1, 0, 10 );
+                    }
+                }
+#endif
                 else if ( 's' == ca )
                 {
                     if ( ':' == parg[2] )
@@ -9517,6 +13388,18 @@ int main( int argc, char * argv[] )
                 else if ( 'l' == ca )
                     g_forcePathsLower = true;
 #endif
+                else if ( !_strnicmp( parg + 1, "ems", 3 ) )
+                {
+                    emsMegabytes = ( ':' == parg[ 4 ] ) ? atoi( parg + 5 ) : 4;
+                    if ( emsMegabytes < 1 || emsMegabytes > 32 )
+                        usage( "EMS size must be 1 to 32 megabytes" );
+                }
+                else if ( !_strnicmp( parg + 1, "xms", 3 ) )
+                {
+                    xmsMegabytes = ( ':' == parg[ 4 ] ) ? atoi( parg + 5 ) : 16;
+                    if ( xmsMegabytes < 1 || xmsMegabytes > 63 )
+                        usage( "XMS size must be 1 to 63 megabytes" );
+                }
                 else if ( 'e' == ca )
                 {
                     if ( penvVars )
@@ -9527,8 +13410,35 @@ int main( int argc, char * argv[] )
                     else
                         usage( "colon required after e argument" );
                 }
+                else if ( !_strnicmp( parg + 1, "frames:", 7 ) )
+                    pcFrames = parg + 8;
+                else if ( !_strnicmp( parg + 1, "fps:", 4 ) )
+                {
+                    g_framesPerSecond = atoi( parg + 5 );
+                    if ( g_framesPerSecond < 1 || g_framesPerSecond > 1000 )
+                        usage( "frames per second must be 1 to 1000" );
+                }
                 else if ( 'f' == ca )
                     g_fillDOSMemoryBlocks = true;
+                else if ( !_strnicmp( parg + 1, "headless", 8 ) )
+                {
+                    g_headless = true;
+                    if ( ':' == parg[ 9 ] )
+                    {
+                        pcScreenCapture = parg + 10;
+                        char * pcomma = (char *) strchr( pcScreenCapture, ',' );
+                        if ( pcomma )
+                        {
+                            if ( _stricmp( pcomma + 1, "ansi" ) )
+                                usage( "the -headless capture format must be ansi" );
+                            * pcomma = 0;
+                            screenCaptureANSI = true;
+                        }
+
+                        if ( 0 == pcScreenCapture[ 0 ] )
+                            usage( "-headless: requires a capture file name" );
+                    }
+                }
                 else if ( 'h' == ca )
                     g_PackedFileCorruptWorkaround = true;
                 else if ( 'j' == ca )
@@ -9542,9 +13452,18 @@ int main( int argc, char * argv[] )
                         keystroke_mode = CKeyStrokes::ksm_Read;
                     else
                         usage( "invalid keystroke mode" );
+
+                    if ( ':' == parg[ 3 ] )
+                        pcKeystrokeFile = parg + 4;
+                    else if ( 0 != parg[ 3 ] )
+                        usage( "colon required after -kr and -kw" );
                 }
                 else if ( 'm' == ca )
                     printVideoMemory = true;
+#if USE_RENDER_THREAD
+                else if ( !_strnicmp( parg + 1, "record:", 7 ) )
+                    pcRecord = parg + 8;
+#endif
                 else if ( 'r' == ca )
                 {
                     if ( ':' != parg[2] )
@@ -9581,105 +13500,57 @@ int main( int argc, char * argv[] )
             }
         }
 
-        static char logFile[ MAX_PATH + 10 ];
-        snprintf( logFile, sizeof( logFile ), "%s.log", g_thisApp );
-        tracer.Enable( trace, logFile, true );
-        tracer.SetQuiet( true );
-        cpu.trace_instructions( traceInstructions );
+        // snapshots don't include the EMS store, and forked jobs would share its remapped pages
 
-        tracer.Trace( "Use one thread: %d\n", g_UseOneThread );
+        if ( emsMegabytes && ( pcLoadSnapshot || g_pcSaveSnapshot || g_pcForkServer ) )
+            usage( "-ems can't be used with -save, -load, or -server" );
 
-#ifdef _WIN32
-        GetFullPathNameA( acRootArg, _countof( g_acRoot ), g_acRoot, 0 );
-        DWORD attr = GetFileAttributesA( g_acRoot );
-        if ( ( INVALID_FILE_ATTRIBUTES == attr ) || ( 0 == ( attr & FILE_ATTRIBUTE_DIRECTORY ) ) )
-            usage( "/r root argument isn't a folder" );
-        size_t len = strlen( g_acRoot );
-        if ( 0 == len )
-            usage( "error parsing /r argument. does the folder exist?" );
-        if ( '\\' != g_acRoot[ len - 1 ] )
-            strcat( g_acRoot, "\\" );
-#else
-        char * fpath = realpath( acRootArg, 0 );
-        if ( !fpath )
-            usage( "error parsing /r argument" );
-        strcpy( g_acRoot, fpath );
-        free( fpath );
-        size_t len = strlen( g_acRoot );
-        if ( 0 == len )
-            usage( "error parsing /r argument. does the folder exist?" );
-        if ( '/' != g_acRoot[ len - 1 ] )
-            strcat( g_acRoot, "/" );
-        struct stat statbuf;
-        int ret = stat( g_acRoot, & statbuf );
-        if ( !S_ISDIR( statbuf.st_mode ) )
-            usage( "/r root argument isn't a folder" );
+        if ( xmsMegabytes && ( pcLoadSnapshot || g_pcSaveSnapshot ) )
+            usage( "-xms can't be used with -save or -load" );
+
+#if USE_FORK
+        if ( pcRecord && ( pcJobs || g_pcForkServer || pcConnect ) )
+            usage( "-record can't be used with -jobs, -server, or -connect" );
+        if ( pcFrames && ( pcJobs || g_pcForkServer || pcConnect ) )
+            usage( "-frames can't be used with -jobs, -server, or -connect" );
 #endif
-        tracer.Trace( "root full path: '%s'\n", g_acRoot );
 
-        if ( 0 == pcAPP )
+#if USE_FORK
+        if ( pcJobs )
         {
-            usage( "no command specified" );
-            assume_false; // prevent false prefast warning from the msft compiler
-        }
+            if ( pcAPP )
+                usage( "-jobs takes programs from the manifest, not the command line" );
 
-        strcpy( g_acApp, pcAPP );
-#ifdef _WIN32
-        _strupr( g_acApp );
-#else
-        const char * pLinuxPath = DOSToHostPath( g_acApp );
-        strcpy( g_acApp, pLinuxPath );
-#endif
+            // the jobs run in forked children once the machine is set up below. they have no console
 
-        if ( !file_exists( g_acApp ) )
-        {
-            if ( ends_with( g_acApp, ".com" ) || ends_with( g_acApp, ".exe" ) )
-                usage( "can't find command file .com or .exe" );
-            else
-            {
-                strcat( g_acApp, ".COM" );
-                if ( !file_exists( g_acApp ) )
-                {
-                    char * dot = strstr( g_acApp, ".COM" );
-                    strcpy( dot, ".EXE" );
-                    if ( !file_exists( g_acApp ) )
-                    {
-#ifdef _WIN32
-                        usage( "can't find command file" );
-#else
-                        tracer.Trace( "couldn't find input file '%s'\n", g_acApp );
-                        char * pdot = strrchr( g_acApp, '.' );
-                        strcpy( pdot, ".com" );
-                        if ( !file_exists( g_acApp ) )
-                        {
-                            strcpy( pdot, ".exe" );
-                            if ( !file_exists( g_acApp ) )
-                            {
-                                tracer.Trace( "looked last for '%s'\n", g_acApp );
-                                usage( "can't find command file" );
-                            }
-                        }
-#endif
-                    }
-                }
-            }
+            g_forceConsole = true;
+            g_UseOneThread = true;
         }
 
-        // Microsoft Pascal v1.0's second pass PAS2.EXE requires end of 64k block, not the middle of a block.
-        // Overload -h to do this as well -- have a conformant address space for apps.
+        if ( pcConnect )
+        {
+            if ( 0 == pcAPP )
+                usage( "no command specified" );
+            g_consoleConfig.RestoreConsole( false );
+            return RunForkServerClient( pcConnect, pcAPP, acAppArgs, penvVars ? penvVars : "" );
+        }
 
-        if ( ends_with( g_acApp, "pas2.exe" ) || g_PackedFileCorruptWorkaround )
-            g_segHardware = 0xa000;
+        // jobs get their own stdin/stdout/stderr from the client. there is no keyboard thread to fork with.
 
-#ifdef _WIN32
-        if ( 0 != dwProcessAffinityMask )
+        if ( g_pcForkServer )
         {
-            BOOL ok = SetProcessAffinityMask( (HANDLE) -1, dwProcessAffinityMask );
-            tracer.Trace( "Result of SetProcessAffinityMask( %#x ) is %d\n", dwProcessAffinityMask, ok );
+            g_forceConsole = true;
+            g_UseOneThread = true;
         }
 #endif
 
-        g_keyStrokes.SetMode( keystroke_mode );
+        static char logFile[ MAX_PATH + 10 ];
+        snprintf( logFile, sizeof( logFile ), "%s.log", g_thisApp );
+        tracer.Enable( trace, logFile, true );
+        tracer.SetQuiet( true );
+        cpu.trace_instructions( traceInstructions );
+
+        tracer.Trace( "Use one thread: %d\n", g_UseOneThread );
 
         // global bios memory
 
@@ -9820,16 +13691,119 @@ int main( int argc, char * argv[] )
         assert( curseg <= InterruptRoutineSegment );
 #endif
 
-        // allocate the environment space and load the binary
+#if USE_FORK
+        if ( pcJobs )
+        {
+            int jobsResult = RunJobManifest( pcJobs, jobWorkers, &pcAPP, acAppArgs, &penvVars, acRootArg );
+            if ( -1 != jobsResult )
+            {
+                g_consoleConfig.RestoreConsole( false );
+                return jobsResult;
+            }
+
+            // this is a forked child running one job. it continues with the job's program, root, and environment
+        }
+#endif
+
+#ifdef _WIN32
+        GetFullPathNameA( acRootArg, _countof( g_acRoot ), g_acRoot, 0 );
+        DWORD attr = GetFileAttributesA( g_acRoot );
+        if ( ( INVALID_FILE_ATTRIBUTES == attr ) || ( 0 == ( attr & FILE_ATTRIBUTE_DIRECTORY ) ) )
+            usage( "/r root argument isn't a folder" );
+        size_t len = strlen( g_acRoot );
+        if ( 0 == len )
+            usage( "error parsing /r argument. does the folder exist?" );
+        if ( '\\' != g_acRoot[ len - 1 ] )
+            strcat( g_acRoot, "\\" );
+#else
+        char * fpath = realpath( acRootArg, 0 );
+        if ( !fpath )
+            usage( "error parsing /r argument" );
+        strcpy( g_acRoot, fpath );
+        free( fpath );
+        size_t len = strlen( g_acRoot );
+        if ( 0 == len )
+            usage( "error parsing /r argument. does the folder exist?" );
+        if ( '/' != g_acRoot[ len - 1 ] )
+            strcat( g_acRoot, "/" );
+        struct stat statbuf;
+        int ret = stat( g_acRoot, & statbuf );
+        if ( !S_ISDIR( statbuf.st_mode ) )
+            usage( "/r root argument isn't a folder" );
+#endif
+        tracer.Trace( "root full path: '%s'\n", g_acRoot );
+
+        // a snapshot has the app, its arguments, and everything else needed to resume it
+
+        vector<uint8_t> snapshot;
+        bool snapshot80xRows = false;
+        if ( pcLoadSnapshot )
+        {
+            if ( pcAPP )
+                usage( "a program can't be specified with -load" );
+            if ( g_pcSaveSnapshot )
+                usage( "-save and -load can't be used together" );
+            if ( !ReadMachineSnapshot( pcLoadSnapshot, snapshot, g_acApp, snapshot80xRows ) )
+                usage( "can't read the -load snapshot file" );
+        }
+        else if ( 0 == pcAPP )
+        {
+            usage( "no command specified" );
+            assume_false; // prevent false prefast warning from the msft compiler
+        }
+        else
+        {
+            HostAppPath( pcAPP, g_acApp );
+        }
+
+        if ( !command_exists( g_acApp ) ) // appends .COM or .EXE if needed
+        {
+            tracer.Trace( "couldn't find input file '%s'\n", g_acApp );
+            if ( ends_with( g_acApp, ".com" ) || ends_with( g_acApp, ".exe" ) )
+                usage( "can't find command file .com or .exe" );
+            else
+                usage( "can't find command file" );
+        }
+
+        // Microsoft Pascal v1.0's second pass PAS2.EXE requires end of 64k block, not the middle of a block.
+        // Overload -h to do this as well -- have a conformant address space for apps.
+
+        if ( ends_with( g_acApp, "pas2.exe" ) || g_PackedFileCorruptWorkaround )
+            g_segHardware = 0xa000;
+
+#ifdef _WIN32
+        if ( 0 != dwProcessAffinityMask )
+        {
+            BOOL ok = SetProcessAffinityMask( (HANDLE) -1, dwProcessAffinityMask );
+            tracer.Trace( "Result of SetProcessAffinityMask( %#x ) is %d\n", dwProcessAffinityMask, ok );
+        }
+#endif
+
+        uint64_t cyclesPerTick = ( ( 0 != clockrate ) ? clockrate : 4772727 ) * 10 / 182; // 18.2 ticks per second
+        if ( !g_keyStrokes.SetMode( keystroke_mode, pcKeystrokeFile, cyclesPerTick, ascii_to_scancode ) )
+            usage( "unable to read the keystroke script" );
 
-        uint16_t segEnvironment = AllocateEnvironment( 0, g_acApp, penvVars );
-        if ( 0 == segEnvironment )
-            i8086_hard_exit( "unable to create environment for the app\n" );
+        if ( emsMegabytes && !InitializeEms( emsMegabytes ) )
+            usage( "unable to allocate memory for EMS" );
 
-        g_currentPSP = LoadBinary( g_acApp, acAppArgs, (uint8_t) strlen( acAppArgs ), segEnvironment, true, 0, 0, 0, 0, bootSectorLoad );
-        if ( 0 == g_currentPSP )
-            i8086_hard_exit( "unable to load executable\n" );
-        g_mainPSP = g_currentPSP;
+        if ( xmsMegabytes && !InitializeXms( xmsMegabytes ) )
+            usage( "unable to allocate memory for XMS" );
+
+        // allocate the environment space and load the binary. the snapshot is applied later since 80x25 mode clears the display
+
+        if ( !pcLoadSnapshot )
+        {
+            uint16_t segEnvironment = AllocateEnvironment( 0, g_acApp, penvVars );
+            if ( 0 == segEnvironment )
+                i8086_hard_exit( "unable to create environment for the app\n" );
+
+            g_currentPSP = LoadBinary( g_acApp, acAppArgs, (uint8_t) strlen( acAppArgs ), segEnvironment, true, 0, 0, 0, 0, bootSectorLoad );
+            if ( 0 == g_currentPSP )
+                i8086_hard_exit( "unable to load executable\n" );
+            g_mainPSP = g_currentPSP;
+        }
+        else if ( snapshot80xRows && !g_forceConsole )
+            force80xRows = true;
 
         // gwbasic calls ioctrl on stdin and stdout before doing anything that would indicate what mode it wants.
         // turbo pascal v3 doesn't give a good indication that it wants 80x25.
@@ -9844,14 +13818,38 @@ int main( int argc, char * argv[] )
                 force80xRows = true;
         }
 
+        // when stdin and stdout are both pipes or files there is no console to emulate. read and write them
+        // in bulk, don't poll for keystrokes, and don't switch to 80x25 mode when the app touches video memory.
+
+        g_batchIO = !force80xRows && !isatty( fileno( stdin ) ) && !isatty( fileno( stdout ) );
+        if ( g_batchIO )
+        {
+            g_forceConsole = true;
+            g_UseOneThread = true;
+#ifdef _WIN32
+            _setmode( _fileno( stdout ), _O_BINARY );
+            _setmode( _fileno( stderr ), _O_BINARY );
+#endif
+        }
+        tracer.Trace( "batch I/O mode: %d\n", g_batchIO );
+
         if ( force80xRows )
         {
             SetScreenRows( rowCount );
             PerhapsFlipTo80xRows();
         }
 
+        if ( pcLoadSnapshot && !ApplyMachineSnapshot( snapshot ) )
+            i8086_hard_exit( "unable to restore the -load snapshot\n" );
+
+#if USE_FORK
+        if ( g_pcForkServer && ( -1 == g_forkServerFunction ) )
+            RunForkServer(); // returns in each job's process
+#endif
+
         g_haltExecution = false;
-        cpu.set_interrupt( true ); // DOS starts apps with interrupts enabled
+        if ( !pcLoadSnapshot )
+            cpu.set_interrupt( true ); // DOS starts apps with interrupts enabled
         cpu.enable_interrupt_syscall( true ); // call back to ntvdm on i8086_interrupt_syscall
         le32_t * pDailyTimer = (le32_t *) ( pbiosdata + 0x6c );
 
@@ -9859,22 +13857,56 @@ int main( int argc, char * argv[] )
         // but keyboard peeks are very slow -- it makes cross-process calls. With the thread, the loop below is faster.
         // Note that kbhit() makes the same call internally to the same cross-process API. It's no faster.
 
+#if USE_EVENTFD
+        bool keyboardEvents = !g_UseOneThread && SetupKeyboardEvents();
+        unique_ptr<CSimpleThread> peekKbdThread( g_UseOneThread ? 0 : new CSimpleThread( keyboardEvents ? KeyboardEventThreadProc : PeekKeyboardThreadProc ) );
+#else
         unique_ptr<CSimpleThread> peekKbdThread( g_UseOneThread ? 0 : new CSimpleThread( PeekKeyboardThreadProc ) );
+#endif
+
+#if USE_RENDER_THREAD
+        // draw the display on another thread so terminal writes don't stall emulation
+
+        unique_ptr<CSimpleThread> renderThread( ( g_UseOneThread || g_headless ) ? 0 : new CSimpleThread( RenderThreadProc ) );
+        g_renderThread = renderThread.get();
+        g_renderThreadActive = ( 0 != renderThread.get() );
+
+        if ( pcRecord && !StartRecording( pcRecord, GetScreenRows() ) )
+            usage( "unable to create the -record file" );
+        unique_ptr<CSimpleThread> recordThread( ( pcRecord && !g_UseOneThread ) ? new CSimpleThread( RecordThreadProc ) : 0 );
+        g_recordThreadRunning = ( 0 != recordThread.get() );
+#endif
+
+        if ( pcFrames && !StartFrameLog( pcFrames ) )
+            usage( "unable to create the -frames file" );
 
         ConsoleConfiguration::ConvertRedirectedLFToCR( true );
         CPUCycleDelay delay( clockrate );
+        if ( 0 != clockrate )
+            g_retraceLineCycles = get_max( (uint64_t) 4, clockrate / 60 / RetraceFrameLines );
         g_tAppStart = high_resolution_clock::now();
+        if ( pcLoadSnapshot ) // continue the daily timer from where the snapshot left it
+            g_tAppStart -= std::chrono::nanoseconds( (uint64_t) *pDailyTimer * 54925100 );
         uint64_t total_cycles = 0; // this will be inaccurate if I8086_TRACK_CYCLES isn't defined
         uint32_t dtLastInt8 = 0;
         uint32_t dailyTimerCheckCount = 0;
 
         do
         {
+            g_cyclesBeforeEmulate = total_cycles;
             total_cycles += cpu.emulate( g_validateState ? 1 : 2000 );
 
             if ( g_haltExecution )
                 break;
 
+#if USE_FORK
+            if ( g_cycleBudget && ( total_cycles > g_cycleBudget ) )
+            {
+                fflush( 0 );
+                _exit( JobCyclesExitCode );
+            }
+#endif
+
             if ( g_validateState )
                 ValidateStateLooksOK();
 
@@ -9884,6 +13916,20 @@ int main( int argc, char * argv[] )
 
             if ( g_use80xRowsMode )
                 throttled_UpdateDisplay( 200 );
+            else if ( g_consoleOutputPending && g_consoleOutputDuration.HasTimeElapsedMS( 50 ) )
+                flush_console_output();
+
+            if ( g_framesFile )
+                throttled_LogGraphicsFrame();
+
+            if ( !g_KbdPeekAvailable && ScriptKeystrokeAvailable() )
+                g_KbdPeekAvailable = true; // a scripted keystroke is due
+
+            if ( g_keyStrokes.TimedOut() )
+            {
+                g_appTerminationReturnCode = 124; // like timeout(1). the error is shown after the console is restored
+                break;
+            }
 
             // reading the real clock is a real syscall -- expensive under a CPU emulator like sparcos/m68 --
             // and the daily timer only needs ~55ms (18.2 Hz) granularity, so don't refresh it every single
@@ -9898,7 +13944,7 @@ int main( int argc, char * argv[] )
                 // if the keyboard peek thread has detected a keystroke, process it with an int 9.
                 // don't plumb through port 60 since most apps work without that. (not quick basic 2 though)
 
-                if ( g_UseOneThread && g_consoleConfig.throttled_kbhit() )
+                if ( g_UseOneThread && !g_batchIO && g_consoleConfig.throttled_kbhit() )
                     g_KbdPeekAvailable = true; // make sure an int9 gets scheduled
 
                 if ( g_SendControlCInt )
@@ -9944,6 +13990,9 @@ int main( int argc, char * argv[] )
                     cpu.external_interrupt( 9 );
                     g_int9_pending = true;
                     g_KbdPeekAvailable = false;
+#if USE_EVENTFD
+                    SignalKeyboardEvent( g_keyboardRearmFd );
+#endif
                     continue;
                 }
 
@@ -9970,11 +14019,40 @@ int main( int argc, char * argv[] )
 
         if ( g_use80xRowsMode )  // get any last-second screen updates displayed
             UpdateDisplay();
+        if ( g_framesFile )
+        {
+            LogGraphicsFrame();
+            fclose( g_framesFile );
+            g_framesFile = 0;
+        }
+#if USE_RENDER_THREAD
+        if ( g_renderThreadActive )
+        {
+            renderThread->EndThread(); // it draws the final snapshot before ending
+            g_renderThreadActive = false;
+            g_renderThread = 0;
+        }
+#endif
+        flush_console_output();
+#if USE_RENDER_THREAD
+        if ( g_recordFile )
+        {
+            if ( g_recordThreadRunning )
+                recordThread->EndThread();
+            g_recordThreadRunning = false;
+            StopRecording();
+        }
+#endif
 
         high_resolution_clock::time_point tDone = high_resolution_clock::now();
 
         if ( !g_UseOneThread )
+        {
+#if USE_EVENTFD
+            SignalKeyboardEvent( g_keyboardStopFd );
+#endif
             peekKbdThread->EndThread();
+        }
 
         g_consoleConfig.RestoreConsole( clearDisplayOnExit );
 #ifdef _WIN32
@@ -9984,6 +14062,12 @@ int main( int argc, char * argv[] )
         if ( printVideoMemory )
             printDisplayBuffer( GetActiveDisplayPage() );
 
+        if ( pcScreenCapture && !WriteScreenCapture( pcScreenCapture, screenCaptureANSI ) )
+            printf( "unable to write the screen capture to %s\n", pcScreenCapture );
+
+        if ( g_keyStrokes.TimedOut() )
+            fprintf( stderr, "keystroke script line %u timed out waiting for '%s'\n", g_keyStrokes.TimedOutLine(), g_keyStrokes.TimedOutText() );
+
         if ( showPerformance )
         {
             char ac[ 100 ];
@@ -10049,6 +14133,12 @@ int main( int argc, char * argv[] )
     tracer.Trace( "exit code of %s: %d\n", g_thisApp, g_appTerminationReturnCode );
     tracer.Shutdown();
 
+#if USE_FORK
+    fflush( stdout );
+    fflush( stderr );
+    ReportForkServerExit( g_appTerminationReturnCode );
+#endif
+
     return g_appTerminationReturnCode; // return what the main app returned
 } //main
 